@@ -1,9 +1,27 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <climits>
+#include <cfloat>
+#include <vector>
+#include <thread>
+#include <unordered_map>
+#include <list>
+#include <random>
+#include <atomic>
+#include <exception>
+#include <fcntl.h>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "projects/BinaryTree/source/ExtendibleHash.h"
+#include "projects/BinaryTree/source/BlockStorage.h"
 
 using namespace std;
 
@@ -13,7 +31,30 @@ const int ADDRESSSIZE=45;
 
 enum RecordType {PERSON,FREELISTNODE};
 
+// The (last, first) name of a Person, NUL padded to a fixed width so two keys
+// compare equal exactly when Person::operator== says the people are equal
+class NameKey {
+  public:
+  char last[LASTSIZE],first[FIRSTSIZE];
+  NameKey(const char *newLast="",const char *newFirst="") {
+    memset(last,0,LASTSIZE);
+    memset(first,0,FIRSTSIZE);
+    strncpy(last,newLast,LASTSIZE);
+    strncpy(first,newFirst,FIRSTSIZE);
+  }
+  bool operator <(const NameKey &k) const {
+    int c=memcmp(last,k.last,LASTSIZE);
+    if (c==0) return memcmp(first,k.first,FIRSTSIZE)<0;
+    return c<0;
+  }
+  bool operator ==(const NameKey &k) const {
+    return memcmp(last,k.last,LASTSIZE)==0 && memcmp(first,k.first,FIRSTSIZE)==0;
+  }
+};
+
 class Person{
+  friend class PersonFilter;
+  friend class PaxTable;
   public:
   char start;
   RecordType type;
@@ -47,10 +88,21 @@ class Person{
     if (strncmp(p.last,last,LASTSIZE)==0) return strncmp(first,p.first,FIRSTSIZE)==0;
     return false;
   }
+  int getZip() const {
+    return zip;
+  }
+  float getSalary() const {
+    return salary;
+  }
+  NameKey key() const {
+    char l[LASTSIZE+1],f[FIRSTSIZE+1]; // the names are not terminated when they fill the field
+    memcpy(l,last,LASTSIZE); l[LASTSIZE]=0;
+    memcpy(f,first,FIRSTSIZE); f[FIRSTSIZE]=0;
+    return NameKey(l,f);
+  }
 };
 
 const long NULLRECORD=-1;
-long nextFreeNode=NULLRECORD;
 
 class FreeListNode {
 	public:
@@ -73,56 +125,333 @@ union PersonRecord {
 	FreeListNode n;
 };
 
+/*
+A page of the columnar (PAX) table format. Each column of the rows in the page
+is stored contiguously, so a scan over salary reads PAXROWS salaries from one
+run of bytes instead of pulling every row through the cache.
+*/
+const int PAXPAGE=4096;
+const int PAXROWS=(PAXPAGE-24)/(sizeof(int)+sizeof(float)+FIRSTSIZE+LASTSIZE+ADDRESSSIZE);  // 36
+
+struct PaxPage {
+  unsigned long used;  // bit r set when row r holds a Person
+  long nextFree;       // next page with a free row, only meaningful while this one has one
+  int count;           // rows used
+  int zip[PAXROWS];
+  float salary[PAXROWS];
+  char first[PAXROWS][FIRSTSIZE];
+  char last[PAXROWS][LASTSIZE];
+  char address[PAXROWS][ADDRESSSIZE];
+};
+
+static_assert(sizeof(PaxPage)<=PAXPAGE,"a PaxPage must fit in a page");
+static_assert(PAXROWS<=64,"the used bitmap is one word");
+
 class DBException {
+  string what;
   public:
+  DBException(string what="A database error occurred"):what(what) {}
   string message(){
-    return "A database error occurred";
+    return what;
   }
 };
 
-fstream dbfile;
+/*
+A cache of the people retrieve() found, keyed on their NameKey and held to a
+byte budget, so a hot row is returned without touching the table.
 
-void readAt(int i,PersonRecord &p) {
-	dbfile.seekg(i*sizeof(PersonRecord));
-	dbfile.read((char *)(&p),sizeof(PersonRecord));
-}
+It is W-TinyLFU. A new entry goes into a small LRU window (CACHEWINDOW of the
+entries). What falls out of the window only gets into the main part if it has
+been asked for more often than the entry it would push out, by a count-min
+sketch of how often every name was asked for, cached or not. The counts are
+halved every CACHESAMPLE lookups per entry so old popularity fades. The main
+part is a segmented LRU, an entry is on probation until it is hit again and
+then protected, the protected segment is CACHEPROTECTED of the main part. A
+scan through many names once fills the window and the probation segment but
+cannot push out the names that are asked for over and over.
+
+The budget covers the entries, their list and hash nodes and the sketch, and
+getBytes() is what they take now. The owner serializes every call but the
+counters, which any thread may read. Only names that were found are cached,
+a miss costs what it did before. Whoever changes what retrieve() would return
+for a name invalidates it, so a cached Person is never stale.
+*/
+const double CACHEWINDOW=0.01;
+const double CACHEPROTECTED=0.8;
+const int CACHESAMPLE=10;
+const int CACHEDEPTH=4;  // rows of the sketch
+const int CACHEMAXCOUNT=15;  // a sketch counter saturates here
+
+struct NameKeyHash {
+  size_t operator()(const NameKey &k) const {  // FNV-1a, like ExtendibleHash
+    const unsigned char *bytes=(const unsigned char *)&k;
+    unsigned long hash=14695981039346656037UL;
+    for (size_t i=0;i<sizeof(NameKey);i++) hash=(hash^bytes[i])*1099511628211UL;
+    return hash;
+  }
+};
+
+class PersonCache {
+  enum Segment {WINDOW,PROBATION,PROTECTED};
+  struct Entry {
+    NameKey key;
+    Person person;
+    Segment segment;
+  };
+  typedef list<Entry>::iterator Position;
+  list<Entry> segments[3];  // most recently used first
+  unordered_map<NameKey,Position,NameKeyHash> where;
+  vector<unsigned char> sketch;  // CACHEDEPTH rows of width counters
+  long width,capacity,windowCapacity,protectedCapacity,budget,samples;
+  atomic<long> hits,misses,entries;
+  unsigned char *counter(unsigned long hash,int row) {
+    return &sketch[row*width+((hash+row*((hash>>32)|1))&(width-1))];
+  }
+  int frequency(const NameKey &k) {  // O(1)
+    unsigned long hash=NameKeyHash()(k);
+    int f=CACHEMAXCOUNT;
+    for (int row=0;row<CACHEDEPTH;row++) f=min(f,(int)*counter(hash,row));
+    return f;
+  }
+  void countLookup(const NameKey &k) {  // O(1) amortized
+    unsigned long hash=NameKeyHash()(k);
+    for (int row=0;row<CACHEDEPTH;row++) {
+      unsigned char *c=counter(hash,row);
+      if (*c<CACHEMAXCOUNT) (*c)++;
+    }
+    if (++samples>=CACHESAMPLE*capacity) {
+      for (size_t i=0;i<sketch.size();i++) sketch[i]/=2;
+      samples/=2;
+    }
+  }
+  void moveTo(Position p,Segment s) {  // to the front of segment s
+    segments[s].splice(segments[s].begin(),segments[p->segment],p);
+    p->segment=s;
+  }
+  void evict(Position p) {
+    where.erase(p->key);
+    segments[p->segment].erase(p);
+    entries--;
+  }
+  void admit() {  // the window is over, its oldest entry competes for the main part
+    Position candidate=prev(segments[WINDOW].end());
+    moveTo(candidate,PROBATION);
+    if (entries<=capacity) return;
+    Segment from=segments[PROBATION].size()>1 || segments[PROTECTED].empty()?PROBATION:PROTECTED;
+    Position victim=prev(segments[from].end());
+    evict(victim!=candidate && frequency(candidate->key)>frequency(victim->key)?victim:candidate);
+  }
+  public:
+  PersonCache() {
+    hits=0;
+    misses=0;
+    entries=0;
+    setBudget(0);
+  }
+  static long entryBytes() {  // an entry in its list and in the hash, with the sketch counters it adds
+    return sizeof(Entry)+2*sizeof(void *)+sizeof(NameKey)+sizeof(Position)+3*sizeof(void *)+2*CACHEDEPTH;
+  }
+  void setBudget(long bytes) {  // empties the cache, 0 turns it off
+    clear();
+    budget=max(0L,bytes);
+    capacity=budget/entryBytes();
+    windowCapacity=max(1L,(long)(capacity*CACHEWINDOW));
+    protectedCapacity=(long)((capacity-windowCapacity)*CACHEPROTECTED);
+    width=1;
+    while (width<capacity) width*=2;
+    sketch.assign(capacity>0?CACHEDEPTH*width:0,0);
+    samples=0;
+  }
+  void clear() {
+    for (int s=0;s<3;s++) segments[s].clear();
+    where.clear();
+    entries=0;
+  }
+  bool get(const NameKey &k,Person &p) {  // O(1)
+    if (capacity==0) return false;
+    countLookup(k);
+    auto it=where.find(k);
+    if (it==where.end()) {
+      misses++;
+      return false;
+    }
+    Position e=it->second;
+    hits++;
+    p=e->person;
+    if (e->segment==PROBATION) {
+      moveTo(e,PROTECTED);
+      if ((long)segments[PROTECTED].size()>protectedCapacity) moveTo(prev(segments[PROTECTED].end()),PROBATION);
+    } else moveTo(e,e->segment);
+    return true;
+  }
+  void put(const NameKey &k,const Person &p) {  // O(1), after get missed k
+    if (capacity==0 || where.count(k)) return;
+    segments[WINDOW].push_front(Entry{k,p,WINDOW});
+    where[k]=segments[WINDOW].begin();
+    entries++;
+    if ((long)segments[WINDOW].size()>windowCapacity) admit();
+  }
+  void invalidate(const NameKey &k) {  // O(1)
+    auto it=where.find(k);
+    if (it!=where.end()) evict(it->second);
+  }
+  long getHits() const {
+    return hits;
+  }
+  long getMisses() const {
+    return misses;
+  }
+  double getHitRate() const {
+    long lookups=hits+misses;
+    return lookups==0?0.0:(double)hits/lookups;
+  }
+  long getSize() const {  // people cached
+    return entries;
+  }
+  long getBytes() const {  // what the entries and the sketch take now
+    return entries*(entryBytes()-2*CACHEDEPTH)+(long)sketch.size();
+  }
+  long getBudget() const {
+    return budget;
+  }
+};
 
-void writeAt(int i,PersonRecord other) {
-	dbfile.seekg(i*sizeof(PersonRecord));
-	dbfile.write((char *)(&other),sizeof(PersonRecord));
+/*
+Opens the name index of a table. An index that cannot be opened, a file that is
+not a hash or one a crash left unreadable, is lost but not needed, it is made
+again empty and lost is set so the table rebuilds it. False only when not even
+an empty index can be made.
+*/
+bool openNames(ExtendibleHash<NameKey> &names,const string &fileName,bool &lost) {
+  lost=!names.open(fileName);
+  if (!lost || names.isOpen()) return true;  // a rebuild clears what is open
+  remove(fileName.c_str());
+  return names.open(fileName);
 }
 
-void connectTable(string fname) {
-    struct stat s;
+/*
+The Person table in its row format, one PersonRecord per slot.
+
+A Table owns its storage, the head of its free list and its name index, so a
+process can have any number of tables open. Every public operation takes the
+table's latch, so one Table can be used from several threads. connect,
+disconnect and setDurability are the exception, they belong to whoever owns
+the table.
+
+The records sit on whichever BlockStorage connect is given, pread by default.
+STORAGE_MEMORY keeps the records in RAM only, which is how a benchmark
+measures the table apart from the disk. The name index is a file either way.
+
+Every create, update and del is a commit of the table's Durability, which is
+DURABILITY_NONE until setDurability picks another mode. The commit happens
+after the latch is released, so commits from several threads share a sync. In
+any mode but none the head of the free list is written whenever it moves, so a
+synced table never points its head at a live record. The name index is not
+synced, it is rebuilt after a crash.
+
+retrieve() answers from a PersonCache once setCacheBudget gives it room.
+create, update and del invalidate the name they touch, a create too because
+the new record may take a lower slot than the one the name index found.
+*/
+class Table {
+  string fileName;
+  BlockStorage *storage;
+  Durability *durability;
+  long nextFreeNode;
+  ExtendibleHash<NameKey> nameIndex;  // see rebuildNameIndex
+  PersonCache cache;
+  mutex latch;
+  int numRecords() {  // O(1), no system call
+    return storage->getSize()/sizeof(PersonRecord);
+  }
+  void readAt(int i,PersonRecord &p) {
+	if (!storage->read((long)i*sizeof(PersonRecord),(char *)(&p),sizeof(PersonRecord))) throw DBException();
+  }
+  void writeAt(int i,PersonRecord other) {
+	if (!storage->write((long)i*sizeof(PersonRecord),(char *)(&other),sizeof(PersonRecord))) throw DBException();
+  }
+  void saveHead() {
+	PersonRecord pr;
+	pr.n.init(nextFreeNode);
+	writeAt(0,pr); // First record is where we store the next (head of the linked list)
+  }
+  void headMoved() {  // the head is only saved on disconnect when nothing is synced
+	if (durability->getMode()!=DURABILITY_NONE) saveHead();
+  }
+  void commit(unique_lock<mutex> &lock) {
+	lock.unlock();
+	if (!durability->commit()) throw DBException();
+  }
+  long findSlot(const NameKey &k) {  // O(1), one read
+    long slot=NULLRECORD;
+    if (nameIndex.find(k,slot)) return slot;
+    return NULLRECORD;
+  }
+  void rebuildNameIndex();
+  public:
+  Table() {
+    storage=NULL;
+    durability=NULL;
+    nextFreeNode=NULLRECORD;
+  }
+  void connect(string fname,StorageKind kind=STORAGE_PREAD) {
 	PersonRecord pr;
-    if (stat(fname.c_str(),&s)!=0){
-		ofstream temp;
-		temp.open(fname);
-		temp.close();
-		dbfile.open(fname);
+	bool lost;
+	storage=BlockStorage::open(kind,fname);
+	if (storage==NULL) throw DBException(fname+": the table cannot be opened");
+    if (storage->getSize()==0){
 		pr.n.init(NULLRECORD);
 		writeAt(0,pr); // First record is where we store the next (head of the linked list)
-    }  else {
-	  dbfile.open(fname);
     }
-	if (!dbfile.is_open()) throw DBException();
+	fileName=fname;
+	setDurability(DURABILITY_NONE);
 	readAt(0,pr);        // Read first record to get the head of the free list
 	nextFreeNode=pr.n.next;
-}
-
-void disconnectTable() {
-	PersonRecord pr;
-	pr.n.init(nextFreeNode);
-	writeAt(0,pr); // First record is where we store the next (head of the linked list)	
-	dbfile.close();
-}
-
-int getNumPeople() {
-  dbfile.seekg(0,ios::end);
-  int filesize=dbfile.tellg();
-  return filesize/sizeof(PersonRecord);
-}
-
+	if (!openNames(nameIndex,fname+".names",lost)) throw DBException(fname+".names: the name index cannot be opened or made again");
+	if (lost || !nameIndex.openedClean() || nameIndex.getTag()!=numRecords()) rebuildNameIndex();
+	cache.clear();
+  }
+  void disconnect() {
+	saveHead();
+	nameIndex.setTag(numRecords());
+	nameIndex.close();
+	delete durability;  // a last sync unless the mode is none
+	durability=NULL;
+	delete storage;
+	storage=NULL;
+  }
+  void setDurability(DurabilityMode mode,int intervalMs=DURABILITY_INTERVAL) {  // see BlockStorage.h for the modes
+	delete durability;
+	durability=new Durability(mode,[this]() { return storage->syncData(); },intervalMs);
+  }
+  Durability &getDurability() {  // commits, syncs and the time they took
+	return *durability;
+  }
+  void setCacheBudget(long bytes) {  // see PersonCache, 0 turns the cache off
+	lock_guard<mutex> lock(latch);
+	cache.setBudget(bytes);
+  }
+  PersonCache &getCache() {  // hit rate and memory use
+	return cache;
+  }
+  string getFileName() {
+    return fileName;
+  }
+  BlockStorage &getStorage() {
+    return *storage;
+  }
+  int getNumPeople() {
+    lock_guard<mutex> lock(latch);
+    return numRecords();
+  }
+  void readRecords(int first,int count,char *buffer) {  // one read of count records, for scans
+    lock_guard<mutex> lock(latch);
+    if (!storage->read((long)first*sizeof(PersonRecord),buffer,(long)count*sizeof(PersonRecord))) throw DBException();
+  }
+  void flush() {
+    lock_guard<mutex> lock(latch);
+    if (!storage->flush()) throw DBException();
+  }
 /*
 nextFreeNode=2 after connection to database 
  
@@ -132,114 +461,1192 @@ nextFreeNode=2 after connection to database
 3 [Person      ]
 4 [FreeListNode]
 */
-void create(Person p) {  // O(1)
+  void create(Person p) {  // O(1)
+    unique_lock<mutex> lock(latch);
+    int i;
+    long head=nextFreeNode;
+    PersonRecord pr;
+    if (nextFreeNode==NULLRECORD) 
+      i=numRecords(); 
+    else {
+      readAt(nextFreeNode,pr);
+      i=nextFreeNode;
+      nextFreeNode=pr.n.next;
+    }
+    pr.p=p;
+    writeAt(i,pr);
+    if (nextFreeNode!=head) headMoved();
+    if (!nameIndex.insert(p.key(),i)) throw DBException();
+    cache.invalidate(p.key());
+    commit(lock);
+  }
+  int find(Person p) {  // O(1)
+    lock_guard<mutex> lock(latch);
+    return findSlot(p.key());
+  }
+  Person retrieve(Person p) {  // O(1), no read when the person is cached
+    lock_guard<mutex> lock(latch);
+    NameKey k=p.key();
+    Person found;
+    if (cache.get(k,found)) return found;
+    long i=findSlot(k);
+    if (i!=NULLRECORD) {
+	   PersonRecord otherRecord;
+	   readAt(i,otherRecord);
+	   cache.put(k,otherRecord.p);
+	   return otherRecord.p;
+    }
+    return Person();
+  }
+  void update(Person p) {  // O(1)
+    unique_lock<mutex> lock(latch);
+    NameKey k=p.key();
+    long i=findSlot(k);
+    if (i!=NULLRECORD) {
+	   PersonRecord pr;
+	   pr.p=p; 
+       writeAt(i,pr);
+       cache.invalidate(k);
+       commit(lock);
+    }
+  }
+  void del(Person p) {  // O(1)
+    unique_lock<mutex> lock(latch);
+    NameKey k=p.key();
+    long i=findSlot(k);
+    if (i!=NULLRECORD) {
+	   PersonRecord pr;
+	   pr.n.init(nextFreeNode);
+	   nextFreeNode=i;
+	   writeAt(i,pr);
+	   headMoved();
+	   nameIndex.erase(k,i);
+	   cache.invalidate(k);
+	   commit(lock);
+    }
+  }
+};
+
+/*
+Full table scans read the table in chunks of about SCANCHUNK bytes into one
+reused buffer, one read per chunk instead of a seekg and a read per record. A
+chunk is a whole number of records and a whole number of 4 KiB pages, so every
+read starts on a page boundary of the file. Free list nodes are skipped in
+memory.
+*/
+const int SCANCHUNK=1<<20;
+
+int scanChunkRecords(int chunkBytes) {  // records in a chunk of about chunkBytes that fills whole pages
+  int align=4096/gcd((int)sizeof(PersonRecord),4096); // fewest records that fill whole pages
+  return max(align,chunkBytes/(int)sizeof(PersonRecord)/align*align);
+}
+
+class TableScan {
+  Table &table;
+  char *buffer;
+  int chunkRecords,numRecords;
+  int first,count;   // the buffer holds records [first,first+count)
+  int slot;          // next record to look at
+  long reads;
+  void fill() {
+    first=slot;
+    count=min(chunkRecords,numRecords-first);
+    table.readRecords(first,count,buffer);
+    reads++;
+  }
+  public:
+  TableScan(Table &table,int chunkBytes=SCANCHUNK) : table(table) {
+    chunkRecords=scanChunkRecords(chunkBytes);
+    buffer=new char[(long)chunkRecords*sizeof(PersonRecord)];
+    numRecords=table.getNumPeople();
+    first=count=slot=0;
+    reads=0;
+  }
+  ~TableScan() {
+    delete[] buffer;
+  }
+  TableScan(const TableScan &)=delete;
+  TableScan &operator =(const TableScan &)=delete;
+  bool next(Person &p,int &i) {  // O(1) amortized, false once the table is done
+    while (slot<numRecords) {
+      if (slot>=first+count) fill();
+      PersonRecord *r=(PersonRecord *)(buffer+(long)(slot-first)*sizeof(PersonRecord));
+      i=slot++;
+      if (r->p.type==PERSON) {
+        p=r->p;
+        return true;
+      }
+    }
+    return false;
+  }
+  bool nextChunk(const PersonRecord *&records,int &firstSlot,int &numRecords) {  // the rest of the buffer, then one chunk at a time
+    if (slot>=this->numRecords) return false;
+    if (slot>=first+count) fill();
+    records=(const PersonRecord *)(buffer+(long)(slot-first)*sizeof(PersonRecord));
+    firstSlot=slot;
+    numRecords=first+count-slot;
+    slot=first+count;
+    return true;
+  }
+  long getReads() {
+    return reads;
+  }
+};
+
+// Calls visit(person,slot) for every Person in the table, in slot order
+template <class Visit>
+void scanTable(Table &table,Visit visit) {  // O(n), n/SCANCHUNK reads
+  TableScan scan(table);
+  Person p;
   int i;
-  PersonRecord pr;
-  if (nextFreeNode==NULLRECORD) 
-    i=getNumPeople(); 
-  else {
-    readAt(nextFreeNode,pr);
-    i=nextFreeNode;
-    nextFreeNode=pr.n.next;
-  }
-  pr.p=p;
-  writeAt(i,pr);
-}
-
-int find(Person p) {  // O(n)
-  int numPeople=getNumPeople();
-  for (int i=0;i<numPeople;i++) {
-	 PersonRecord otherRecord;
-	 readAt(i,otherRecord);
-	 if (otherRecord.p.type==PERSON) {  // Skip freeNodeList records
-	   Person other=otherRecord.p;
-       if (other==p) return i;
-     }
-  }
-  return NULLRECORD;
-}
-
-Person retrieve(Person p) {  // O(n)
-  int numPeople=getNumPeople();
-  for (int i=0;i<numPeople;i++) {
-	 PersonRecord otherRecord;
-	 readAt(i,otherRecord);
-	 if (otherRecord.p.type==PERSON) {  // Skip freeNodeList records
-	   Person other=otherRecord.p;
-       if (other==p) return other;
-     }
-  }
-  return Person();
-}
-
-void update(Person p) {  // O(n)
-  int numPeople=getNumPeople();
-  for (int i=0;i<numPeople;i++) {
-	 PersonRecord otherRecord;
-	 readAt(i,otherRecord);
-	 if (otherRecord.p.type==PERSON) { // Skip freeNodeList records
-	   Person other=otherRecord.p;
-       if (other==p) {
-	     PersonRecord pr;
-	     pr.p=p; 
-         writeAt(i,pr);
-         break;
-       }
-     }
-  }
-}
-
-void del(Person p) {  // O(n)
-  int numPeople=getNumPeople();
-  for (int i=0;i<numPeople;i++) {
-	 PersonRecord otherRecord;
-	 readAt(i,otherRecord);
-	 if (otherRecord.p.type==PERSON) {
-	   Person other=otherRecord.p;
-       if (other==p) {
-		 PersonRecord pr;
-		 pr.n.init(nextFreeNode);
-		 nextFreeNode=i;
-		 writeAt(i,pr);
-		 break;
-	   }
-     }
+  while (scan.next(p,i)) visit(p,i);
+}
+
+/*
+Parallel scans cut the file into morsels of about SCANCHUNK bytes. Each worker
+thread claims the next morsel from a shared counter and reads it from the
+table's storage into its own buffer. pread, mmap and memory reads are
+positional, so no thread waits on another's seek. An fstream has one position
+and takes its reads in turn. Workers that finish early just claim more morsels. An exception in any worker
+is rethrown by the calling thread once all of them have stopped.
+*/
+int defaultThreads() {
+  return max(1,(int)thread::hardware_concurrency());
+}
+
+// Calls work(thread,data,firstUnit,numUnits) for every morsel of numUnits units of unitSize bytes stored from offset
+template <class Work>
+void parallelMorsels(BlockStorage &storage,long offset,int unitSize,long numUnits,long morselUnits,int threads,Work work) {
+  atomic<long> next(0);
+  atomic<bool> failed(false);
+  exception_ptr error;
+  auto worker=[&](int t) {
+    try {
+      vector<char> buffer(morselUnits*unitSize);
+      for (long m=next++;!failed && m*morselUnits<numUnits;m=next++) {
+        long first=m*morselUnits,count=min(morselUnits,numUnits-first);
+        if (!storage.read(offset+first*unitSize,buffer.data(),count*unitSize)) throw DBException();
+        work(t,buffer.data(),first,count);
+      }
+    } catch (...) {
+      if (!failed.exchange(true)) error=current_exception();
+    }
+  };
+  vector<thread> workers;
+  for (int t=1;t<threads;t++) workers.emplace_back(worker,t);
+  worker(0);
+  for (auto &w:workers) w.join();
+  if (error) rethrow_exception(error);
+}
+
+// Calls work(thread,records,firstSlot,count) for every morsel of the row table
+template <class Work>
+void parallelScan(Table &table,int threads,Work work) {  // O(n/threads)
+  parallelMorsels(table.getStorage(),0,sizeof(PersonRecord),table.getNumPeople(),scanChunkRecords(SCANCHUNK),max(1,threads),
+    [&work](int t,const char *data,long first,long count) {
+      work(t,(const PersonRecord *)data,(int)first,(int)count);
+    });
+}
+
+/*
+A conjunction of an exact last/first name and zip and salary ranges, evaluated
+over a block of records at a time into a selection bitmap (bit i of word i/64
+set when record i is a Person that matches).
+
+A name matches the way strncmp does: the bytes up to and including the NUL
+that ends the wanted name must be equal, or all of the field when the name
+fills it. The kernels compare a whole name field with one AVX2 or two SSE2
+byte compares and mask off the bytes past that NUL, instead of strncmp walking
+the field a byte at a time. A row stops at the first predicate it fails, the
+fixed width fields first. The kernel is picked once from what the CPU
+supports, falling back to plain C++.
+*/
+class PersonFilter {
+  public:
+  char last[32],first[32];     // wanted names, NUL padded
+  unsigned lastMask,firstMask;  // bit b set when byte b of the field has to match, 0 when the name is not filtered
+  int zipLow,zipHigh;
+  float salaryLow,salaryHigh;
+  PersonFilter() {
+    memset(last,0,sizeof(last));
+    memset(first,0,sizeof(first));
+    lastMask=firstMask=0;
+    zipLow=INT_MIN; zipHigh=INT_MAX;
+    salaryLow=-FLT_MAX; salaryHigh=FLT_MAX;
+  }
+  static unsigned careMask(const char *name,int width) {
+    int n=min((int)strlen(name)+1,width);
+    return n==32? 0xffffffffu: (1u<<n)-1;
+  }
+  PersonFilter &name(string newLast,string newFirst="") {  // an empty first name matches any first name
+    strncpy(last,newLast.c_str(),LASTSIZE);
+    lastMask=careMask(last,LASTSIZE);
+    if (newFirst!="") {
+      strncpy(first,newFirst.c_str(),FIRSTSIZE);
+      firstMask=careMask(first,FIRSTSIZE);
+    }
+    return *this;
+  }
+  PersonFilter &zip(int low,int high) {
+    zipLow=low; zipHigh=high;
+    return *this;
+  }
+  PersonFilter &salary(float low,float high) {
+    salaryLow=low; salaryHigh=high;
+    return *this;
+  }
+  bool namesMatch(const Person &p) const {
+    return fieldMatches(p.last,last,lastMask) && fieldMatches(p.first,first,firstMask);
+  }
+  static bool fieldMatches(const char *field,const char *want,unsigned mask) {
+    return mask==0 || memcmp(field,want,__builtin_popcount(mask))==0;
+  }
+  bool matches(const Person &p) const {  // one row, no vectors
+    return p.type==PERSON && p.zip>=zipLow && p.zip<=zipHigh
+        && p.salary>=salaryLow && p.salary<=salaryHigh && namesMatch(p);
+  }
+  void select(const PersonRecord *records,int count,unsigned long *selection) const;
+  unsigned long selectPage(const PaxPage &page) const;
+  // the kernels select picks from
+  static void selectScalar(const PersonFilter &f,const PersonRecord *records,int count,unsigned long *selection);
+  static void selectSSE2(const PersonFilter &f,const PersonRecord *records,int count,unsigned long *selection);
+  static void selectAVX2(const PersonFilter &f,const PersonRecord *records,int count,unsigned long *selection);
+};
+
+typedef void (*SelectKernel)(const PersonFilter &,const PersonRecord *,int,unsigned long *);
+
+void PersonFilter::selectScalar(const PersonFilter &f,const PersonRecord *records,int count,unsigned long *selection) {
+  for (int w=0;w<(count+63)/64;w++) selection[w]=0;
+  for (int i=0;i<count;i++)
+    if (f.matches(records[i].p)) selection[i/64]|=1UL<<(i%64);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The name fields sit far enough from the end of a record that reading 32 bytes from either stays inside it
+static_assert(sizeof(PersonRecord)>=32+FIRSTSIZE+LASTSIZE,"name loads must stay inside the record");
+
+// Bit b set in the result when byte b of field equals byte b of want, over 32 bytes
+__attribute__((target("sse2")))
+static inline unsigned equalBytesSSE2(const char *field,__m128i wantLo,__m128i wantHi) {
+  __m128i lo=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)field),wantLo);
+  __m128i hi=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(field+16)),wantHi);
+  return (unsigned)_mm_movemask_epi8(lo)|((unsigned)_mm_movemask_epi8(hi)<<16);
+}
+
+__attribute__((target("sse2")))
+void PersonFilter::selectSSE2(const PersonFilter &f,const PersonRecord *records,int count,unsigned long *selection) {
+  const __m128i lastLo=_mm_loadu_si128((const __m128i *)f.last),lastHi=_mm_loadu_si128((const __m128i *)(f.last+16));
+  const __m128i firstLo=_mm_loadu_si128((const __m128i *)f.first),firstHi=_mm_loadu_si128((const __m128i *)(f.first+16));
+  for (int w=0;w<(count+63)/64;w++) selection[w]=0;
+  for (int i=0;i<count;i++) {
+    const Person &p=records[i].p;
+    if (p.type==PERSON && p.zip>=f.zipLow && p.zip<=f.zipHigh && p.salary>=f.salaryLow && p.salary<=f.salaryHigh
+        && (equalBytesSSE2(p.last,lastLo,lastHi)&f.lastMask)==f.lastMask && (equalBytesSSE2(p.first,firstLo,firstHi)&f.firstMask)==f.firstMask)
+      selection[i/64]|=1UL<<(i%64);
+  }
+}
+
+__attribute__((target("avx2")))
+static inline unsigned equalBytesAVX2(const char *field,__m256i want) {
+  return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)field),want));
+}
+
+__attribute__((target("avx2")))
+void PersonFilter::selectAVX2(const PersonFilter &f,const PersonRecord *records,int count,unsigned long *selection) {
+  const __m256i last=_mm256_loadu_si256((const __m256i *)f.last),first=_mm256_loadu_si256((const __m256i *)f.first);
+  for (int w=0;w<(count+63)/64;w++) selection[w]=0;
+  for (int i=0;i<count;i++) {
+    const Person &p=records[i].p;
+    if (p.type==PERSON && p.zip>=f.zipLow && p.zip<=f.zipHigh && p.salary>=f.salaryLow && p.salary<=f.salaryHigh
+        && (equalBytesAVX2(p.last,last)&f.lastMask)==f.lastMask && (equalBytesAVX2(p.first,first)&f.firstMask)==f.firstMask)
+      selection[i/64]|=1UL<<(i%64);
+  }
+}
+
+SelectKernel pickKernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return PersonFilter::selectAVX2;
+  if (__builtin_cpu_supports("sse2")) return PersonFilter::selectSSE2;
+  return PersonFilter::selectScalar;
+}
+#else
+SelectKernel pickKernel() {
+  return PersonFilter::selectScalar;
+}
+#endif
+
+SelectKernel selectKernel=pickKernel();
+
+void PersonFilter::select(const PersonRecord *records,int count,unsigned long *selection) const {  // O(count)
+  selectKernel(*this,records,count,selection);
+}
+
+// Bit r set when row r of a PAX page is a Person that matches, only the filtered columns are read
+unsigned long PersonFilter::selectPage(const PaxPage &page) const {  // O(PAXROWS)
+  unsigned long bits=page.used;
+  if (zipLow!=INT_MIN || zipHigh!=INT_MAX) {
+    unsigned long in=0;
+    for (int r=0;r<PAXROWS;r++) in|=(unsigned long)(page.zip[r]>=zipLow && page.zip[r]<=zipHigh)<<r;
+    bits&=in;
+  }
+  if (salaryLow!=-FLT_MAX || salaryHigh!=FLT_MAX) {
+    unsigned long in=0;
+    for (int r=0;r<PAXROWS;r++) in|=(unsigned long)(page.salary[r]>=salaryLow && page.salary[r]<=salaryHigh)<<r;
+    bits&=in;
+  }
+  if (lastMask|firstMask) {
+    for (unsigned long left=bits;left;left&=left-1) {
+      int r=__builtin_ctzl(left);
+      if (!fieldMatches(page.last[r],last,lastMask) || !fieldMatches(page.first[r],first,firstMask)) bits&=~(1UL<<r);
+    }
+  }
+  return bits;
+}
+
+// Calls visit(person,slot) for every Person the filter selects, in slot order
+template <class Visit>
+void scanTable(Table &table,const PersonFilter &f,Visit visit) {  // O(n), n/SCANCHUNK reads
+  TableScan scan(table);
+  const PersonRecord *records;
+  int firstSlot,count;
+  vector<unsigned long> selection;
+  while (scan.nextChunk(records,firstSlot,count)) {
+    selection.resize((count+63)/64);
+    f.select(records,count,selection.data());
+    for (int w=0;w<(int)selection.size();w++)
+      for (unsigned long bits=selection[w];bits;bits&=bits-1) {
+        int i=w*64+__builtin_ctzl(bits);
+        visit(records[i].p,firstSlot+i);
+      }
+  }
+}
+
+/*
+Secondary index on the name of every Person, an extendible hash stored next to
+the table in <table>.names that maps each NameKey to the slot of its record. A
+lookup reads a single bucket page, and usually none for a name that is not in
+the table, the hash keeps a Bloom filter of the names (see ExtendibleHash.h).
+
+The hash is tagged with the number of records in the table when it is closed.
+If it was not closed (the program died before disconnect) or the table 
+has a different size, it is rebuilt from the table, and so is one that
+cannot be opened (see openNames). A name held by several 
+records maps to all of their slots, and the lowest slot wins, which is the 
+record the old scan found first.
+*/
+void Table::rebuildNameIndex() {  // O(n)
+  if (!nameIndex.clear()) throw DBException();
+  scanTable(*this,[this](const Person &p,int i) {
+	 if (!nameIndex.insert(p.key(),i)) throw DBException();
+  });
+}
+
+/*
+The Person table in the columnar (PAX) format, with the same operations as the
+row table above.
+
+Page 0 of the file holds a PaxMeta, row s of the table is row s%PAXROWS of
+page 1+s/PAXROWS. Pages with a free row are linked through nextFree from
+freeHead, a new Person goes into the first row free in the head page. A page
+leaves the list when it fills and goes back to its head when a row is freed.
+The name index works like the row table's, in <table>.names tagged with the
+number of people, and so does the PersonCache in front of retrieve().
+*/
+const long PAXMAGIC=0x5841504E4F535245;  // "ERSONPAX"
+
+struct PaxMeta {
+  long magic;
+  long freeHead;
+  long count;  // people in the table
+};
+
+class PaxTable {
+  string fileName;
+  BlockStorage *storage;
+  Durability *durability;  // like Table's, the meta page is already written whenever the free list head moves
+  PaxMeta meta;
+  ExtendibleHash<NameKey> names;
+  PersonCache cache;
+  mutex latch;  // taken by every public operation but connect, disconnect and setDurability, like Table
+  long getNumPages() {
+    return max(1L,storage->getSize()/PAXPAGE);
+  }
+  void readPage(long page,PaxPage &pg) {
+    if (!storage->read(page*PAXPAGE,(char *)&pg,sizeof(PaxPage))) throw DBException();
+  }
+  void writePage(long page,const PaxPage &pg) {
+    char buffer[PAXPAGE]={0};
+    memcpy(buffer,&pg,sizeof(PaxPage));
+    if (!storage->write(page*PAXPAGE,buffer,PAXPAGE)) throw DBException();
+  }
+  void saveMeta() {
+    char buffer[PAXPAGE]={0};
+    memcpy(buffer,&meta,sizeof(PaxMeta));
+    if (!storage->write(0,buffer,PAXPAGE)) throw DBException();
+  }
+  void commit(unique_lock<mutex> &lock) {
+    lock.unlock();
+    if (!durability->commit()) throw DBException();
+  }
+  static Person getRow(const PaxPage &pg,int r) {
+    Person p;
+    p.init();
+    p.zip=pg.zip[r];
+    p.salary=pg.salary[r];
+    memcpy(p.first,pg.first[r],FIRSTSIZE);
+    memcpy(p.last,pg.last[r],LASTSIZE);
+    memcpy(p.address,pg.address[r],ADDRESSSIZE);
+    return p;
+  }
+  static void setRow(PaxPage &pg,int r,const Person &p) {
+    pg.zip[r]=p.zip;
+    pg.salary[r]=p.salary;
+    memcpy(pg.first[r],p.first,FIRSTSIZE);
+    memcpy(pg.last[r],p.last,LASTSIZE);
+    memcpy(pg.address[r],p.address,ADDRESSSIZE);
+  }
+  long findSlot(const NameKey &k) {  // O(1), one read
+    long slot=NULLRECORD;
+    if (names.find(k,slot)) return slot;
+    return NULLRECORD;
+  }
+  void rebuildNames() {  // O(n)
+    if (!names.clear()) throw DBException();
+    meta.count=0;
+    scan([this](const Person &p,int i) {
+      if (!names.insert(p.key(),i)) throw DBException();
+      meta.count++;
+    });
+  }
+  public:
+  PaxTable() {
+    storage=NULL;
+    durability=NULL;
   }
+  void connect(string fname,StorageKind kind=STORAGE_PREAD) {  // see Table for the kinds of storage
+    bool lost;
+    fileName=fname;
+    storage=BlockStorage::open(kind,fname);
+    if (storage==NULL) throw DBException(fname+": the table cannot be opened");
+    setDurability(DURABILITY_NONE);
+    if (storage->getSize()==0) {
+      meta.magic=PAXMAGIC;
+      meta.freeHead=NULLRECORD;
+      meta.count=0;
+      saveMeta();
+    } else {
+      if (!storage->read(0,(char *)&meta,sizeof(PaxMeta))) throw DBException(fname+": the first page cannot be read");
+      if (meta.magic!=PAXMAGIC) throw DBException(fname+": not a PAX table");
+    }
+    if (!openNames(names,fname+".names",lost)) throw DBException(fname+".names: the name index cannot be opened or made again");
+    if (lost || !names.openedClean() || names.getTag()!=meta.count) rebuildNames();
+    cache.clear();
+  }
+  void disconnect() {
+    saveMeta();
+    names.setTag(meta.count);
+    names.close();
+    delete durability;
+    durability=NULL;
+    delete storage;
+    storage=NULL;
+  }
+  void setDurability(DurabilityMode mode,int intervalMs=DURABILITY_INTERVAL) {
+    delete durability;
+    durability=new Durability(mode,[this]() { return storage->syncData(); },intervalMs);
+  }
+  Durability &getDurability() {
+    return *durability;
+  }
+  void setCacheBudget(long bytes) {
+    lock_guard<mutex> lock(latch);
+    cache.setBudget(bytes);
+  }
+  PersonCache &getCache() {
+    return cache;
+  }
+  long getNumPeople() {
+    lock_guard<mutex> lock(latch);
+    return meta.count;
+  }
+  void create(Person p) {  // O(1)
+    unique_lock<mutex> lock(latch);
+    PaxPage pg;
+    long page=meta.freeHead;
+    if (page==NULLRECORD) {
+      page=getNumPages();
+      memset(&pg,0,sizeof(PaxPage));
+      pg.nextFree=NULLRECORD;
+      meta.freeHead=page;
+    } else readPage(page,pg);
+    int r=__builtin_ctzl(~pg.used);
+    pg.used|=1UL<<r;
+    pg.count++;
+    setRow(pg,r,p);
+    writePage(page,pg);
+    if (pg.count==PAXROWS) meta.freeHead=pg.nextFree;
+    if (page!=meta.freeHead || pg.count==1) saveMeta();  // the head moved
+    meta.count++;
+    if (!names.insert(p.key(),(page-1)*PAXROWS+r)) throw DBException();
+    cache.invalidate(p.key());
+    commit(lock);
+  }
+  int find(Person p) {  // O(1)
+    lock_guard<mutex> lock(latch);
+    return findSlot(p.key());
+  }
+  Person retrieve(Person p) {  // O(1), no read when the person is cached
+    lock_guard<mutex> lock(latch);
+    NameKey k=p.key();
+    Person found;
+    if (cache.get(k,found)) return found;
+    long i=findSlot(k);
+    if (i!=NULLRECORD) {
+      PaxPage pg;
+      readPage(1+i/PAXROWS,pg);
+      found=getRow(pg,i%PAXROWS);
+      cache.put(k,found);
+      return found;
+    }
+    return Person();
+  }
+  void update(Person p) {  // O(1)
+    unique_lock<mutex> lock(latch);
+    NameKey k=p.key();
+    long i=findSlot(k);
+    if (i!=NULLRECORD) {
+      PaxPage pg;
+      readPage(1+i/PAXROWS,pg);
+      setRow(pg,i%PAXROWS,p);
+      writePage(1+i/PAXROWS,pg);
+      cache.invalidate(k);
+      commit(lock);
+    }
+  }
+  void del(Person p) {  // O(1)
+    unique_lock<mutex> lock(latch);
+    NameKey k=p.key();
+    long i=findSlot(k);
+    if (i!=NULLRECORD) {
+      PaxPage pg;
+      long page=1+i/PAXROWS;
+      readPage(page,pg);
+      if (pg.count==PAXROWS) {  // full pages are not on the free list
+        pg.nextFree=meta.freeHead;
+        meta.freeHead=page;
+        saveMeta();
+      }
+      pg.used&=~(1UL<<(i%PAXROWS));
+      pg.count--;
+      writePage(page,pg);
+      meta.count--;
+      names.erase(k,i);
+      cache.invalidate(k);
+      commit(lock);
+    }
+  }
+  // Calls visit(pages,numPages,firstSlot) for every SCANCHUNK bytes of pages, one read each
+  template <class Visit>
+  void scanChunks(Visit visit) {  // O(n), n/SCANCHUNK reads
+    const long chunkPages=SCANCHUNK/PAXPAGE;
+    long numPages;
+    vector<char> buffer(chunkPages*PAXPAGE);
+    {
+      lock_guard<mutex> lock(latch);
+      numPages=getNumPages();
+    }
+    for (long page=1;page<numPages;page+=chunkPages) {
+      long pages=min(chunkPages,numPages-page);
+      {
+        lock_guard<mutex> lock(latch);
+        if (!storage->read(page*PAXPAGE,buffer.data(),pages*PAXPAGE)) throw DBException();
+      }
+      visit(buffer.data(),(int)pages,(int)((page-1)*PAXROWS));
+    }
+  }
+  // Calls work(thread,pages,numPages,firstSlot) for every morsel of pages, see parallelMorsels
+  template <class Work>
+  void parallelScan(int threads,Work work) {  // O(n/threads)
+    long numPages;
+    {
+      lock_guard<mutex> lock(latch);
+      numPages=getNumPages();
+    }
+    parallelMorsels(*storage,PAXPAGE,PAXPAGE,numPages-1,SCANCHUNK/PAXPAGE,max(1,threads),
+      [&work](int t,const char *data,long first,long count) {
+        work(t,data,(int)count,(int)(first*PAXROWS));
+      });
+  }
+  // Calls visit(page,firstSlot) for every page of rows
+  template <class Visit>
+  void scanPages(Visit visit) {  // O(n), n/SCANCHUNK reads
+    scanChunks([&visit](const char *pages,int numPages,int firstSlot) {
+      for (int i=0;i<numPages;i++) visit(*(const PaxPage *)(pages+(long)i*PAXPAGE),firstSlot+i*PAXROWS);
+    });
+  }
+  // Calls visit(person,slot) for every Person in the table, in slot order
+  template <class Visit>
+  void scan(Visit visit) {  // O(n)
+    scanPages([&visit](const PaxPage &pg,int firstSlot) {
+      for (unsigned long bits=pg.used;bits;bits&=bits-1) {
+        int r=__builtin_ctzl(bits);
+        visit(getRow(pg,r),firstSlot+r);
+      }
+    });
+  }
+  // Calls visit(person,slot) for every Person the filter selects, in slot order
+  template <class Visit>
+  void scan(const PersonFilter &f,Visit visit) {  // O(n)
+    scanPages([&f,&visit](const PaxPage &pg,int firstSlot) {
+      for (unsigned long bits=f.selectPage(pg);bits;bits&=bits-1) {
+        int r=__builtin_ctzl(bits);
+        visit(getRow(pg,r),firstSlot+r);
+      }
+    });
+  }
+};
+
+/*
+Aggregates over salary, for the whole table or grouped by zip, computed in
+one streaming pass over the table instead of a retrieve() per person.
+
+The pass is a parallel scan, each thread folds the morsels it reads into its
+own partial aggregate (for GROUP BY, its own hash table from zip to
+aggregate), so the threads never share anything they write. The partials are
+merged once at the end of the scan.
+*/
+class SalaryAggregate {
+  public:
+  long count;
+  double sum;
+  float min,max;
+  SalaryAggregate() {
+    count=0;
+    sum=0;
+    min=FLT_MAX;
+    max=-FLT_MAX;
+  }
+  void add(float salary) {
+    count++;
+    sum+=salary;
+    if (salary<min) min=salary;
+    if (salary>max) max=salary;
+  }
+  void merge(const SalaryAggregate &a) {
+    count+=a.count;
+    sum+=a.sum;
+    if (a.min<min) min=a.min;
+    if (a.max>max) max=a.max;
+  }
+  double avg() const {
+    return count==0? 0: sum/count;
+  }
+};
+
+typedef unordered_map<int,SalaryAggregate> ZipGroups;
+
+void merge(SalaryAggregate &into,const SalaryAggregate &from) {
+  into.merge(from);
+}
+
+void merge(ZipGroups &into,const ZipGroups &from) {
+  for (auto &g:from) into[g.first].merge(g.second);
+}
+
+void merge(vector<int> &into,const vector<int> &from) {
+  into.insert(into.end(),from.begin(),from.end());
+}
+
+// Folds every selected Person of the row table into partials[thread] with add(partial,person,slot)
+template <class Partial,class Add>
+Partial aggregateTable(Table &table,const PersonFilter &f,int threads,Add add) {  // O(n/threads), one scan
+  vector<Partial> partials(max(1,threads));
+  parallelScan(table,threads,[&](int t,const PersonRecord *records,int firstSlot,int count) {
+    vector<unsigned long> selection((count+63)/64);
+    f.select(records,count,selection.data());
+    for (int w=0;w<(int)selection.size();w++)
+      for (unsigned long bits=selection[w];bits;bits&=bits-1) {
+        int i=w*64+__builtin_ctzl(bits);
+        add(partials[t],records[i].p,firstSlot+i);
+      }
+  });
+  for (int t=1;t<(int)partials.size();t++) merge(partials[0],partials[t]);
+  return partials[0];
+}
+
+// The same over a PAX table with add(partial,page,row,slot), reading only the columns the filter and the aggregate need
+template <class Partial,class Add>
+Partial aggregateTable(PaxTable &table,const PersonFilter &f,int threads,Add add) {  // O(n/threads), one scan
+  vector<Partial> partials(max(1,threads));
+  table.parallelScan(threads,[&](int t,const char *pages,int numPages,int firstSlot) {
+    for (int i=0;i<numPages;i++) {
+      const PaxPage &page=*(const PaxPage *)(pages+(long)i*PAXPAGE);
+      for (unsigned long bits=f.selectPage(page);bits;bits&=bits-1) {
+        int r=__builtin_ctzl(bits);
+        add(partials[t],page,r,firstSlot+i*PAXROWS+r);
+      }
+    }
+  });
+  for (int t=1;t<(int)partials.size();t++) merge(partials[0],partials[t]);
+  return partials[0];
+}
+
+SalaryAggregate aggregateSalary(Table &table,const PersonFilter &f=PersonFilter(),int threads=defaultThreads()) {  // O(n)
+  return aggregateTable<SalaryAggregate>(table,f,threads,[](SalaryAggregate &a,const Person &p,int) {
+    a.add(p.getSalary());
+  });
+}
+
+ZipGroups groupByZip(Table &table,const PersonFilter &f=PersonFilter(),int threads=defaultThreads()) {  // O(n)
+  return aggregateTable<ZipGroups>(table,f,threads,[](ZipGroups &g,const Person &p,int) {
+    g[p.getZip()].add(p.getSalary());
+  });
+}
+
+// Slots of every Person the filter selects, in slot order
+vector<int> findAll(Table &table,const PersonFilter &f,int threads=defaultThreads()) {  // O(n)
+  vector<int> slots=aggregateTable<vector<int>>(table,f,threads,[](vector<int> &v,const Person &,int slot) {
+    v.push_back(slot);
+  });
+  sort(slots.begin(),slots.end());
+  return slots;
+}
+
+SalaryAggregate aggregateSalary(PaxTable &table,const PersonFilter &f=PersonFilter(),int threads=defaultThreads()) {  // O(n)
+  return aggregateTable<SalaryAggregate>(table,f,threads,[](SalaryAggregate &a,const PaxPage &page,int r,int) {
+    a.add(page.salary[r]);
+  });
+}
+
+ZipGroups groupByZip(PaxTable &table,const PersonFilter &f=PersonFilter(),int threads=defaultThreads()) {  // O(n)
+  return aggregateTable<ZipGroups>(table,f,threads,[](ZipGroups &g,const PaxPage &page,int r,int) {
+    g[page.zip[r]].add(page.salary[r]);
+  });
+}
+
+vector<int> findAll(PaxTable &table,const PersonFilter &f,int threads=defaultThreads()) {  // O(n)
+  vector<int> slots=aggregateTable<vector<int>>(table,f,threads,[](vector<int> &v,const PaxPage &,int,int slot) {
+    v.push_back(slot);
+  });
+  sort(slots.begin(),slots.end());
+  return slots;
 }
 
 Person p;
 
-int main() {
+/*
+Tests, run with "./a.out test" instead of the demo. Each prints its name and
+Passed or Failed, and the program exits with 1 when any of them failed.
+*/
+bool check(string name,bool pass) {
+  cout << "\t" << name << ": " << (pass?"Passed":"Failed") << endl;
+  return pass;
+}
+
+// Every kernel selects exactly what selectScalar does, over random rows and filters
+bool selectTest() {
+  const string full="ABCDEFGHIJKLMNOPQRSTUVWXYZabcd";  // fills the field, no NUL
+  const string lasts[]={"Castleton","Cast","Castletons",full,full.substr(0,29),full.substr(0,29)+"e"};
+  const string firsts[]={"Karl","Kim","Ka",full,full.substr(0,29)+"e"};
+  const int rows=1000;
+  mt19937 random(12);
+  vector<PersonRecord> records(rows);
+  vector<SelectKernel> kernels;
+  bool pass=true;
+  long selected=0;
+  memset(records.data(),0,rows*sizeof(PersonRecord));
+  for (int i=0;i<rows;i++) {
+    if (random()%10==0) records[i].n.init(i);  // a hole in the file
+    else records[i].p.init(firsts[random()%5],lasts[random()%6],"",81500+random()%4,40000+random()%4*10000);
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse2")) kernels.push_back(PersonFilter::selectSSE2);
+  if (__builtin_cpu_supports("avx2")) kernels.push_back(PersonFilter::selectAVX2);
+#endif
+  for (int t=0;t<500;t++) {
+    PersonFilter f;
+    int count=1+random()%rows;  // not always whole words
+    if (random()%4) f.name(lasts[random()%6],random()%3? firsts[random()%5]: "");
+    if (random()%2) f.zip(81500+random()%4,81503);
+    if (random()%2) f.salary(45000,45000+random()%4*10000);
+    vector<unsigned long> want((count+63)/64),got((count+63)/64);
+    PersonFilter::selectScalar(f,records.data(),count,want.data());
+    for (int w=0;w<(int)want.size();w++) selected+=__builtin_popcountl(want[w]);
+    for (auto kernel:kernels) {
+      kernel(f,records.data(),count,got.data());
+      pass=pass && got==want;
+    }
+  }
+  cout << "\t" << kernels.size() << " vector kernels, " << selected << " rows selected" << endl;
+  return check("Vector kernels select what selectScalar does",pass && selected>0);
+}
+
+// removes a table file and its name index
+void removeTable(string fileName) {
+  remove(fileName.c_str());
+  remove((fileName+".names").c_str());
+}
+
+// Create, retrieve, update and del on PaxTable, rows freed on one page reused before a new page, and a reopen
+bool paxTest() {
+  const string file="PaxTest.bin";
+  const int people=100;  // three pages
+  PaxTable pax;
+  Person p;
+  struct stat s;
+  bool pass=true;
+  long size;
+  removeTable(file);
+  pax.connect(file);
+  for (int i=0;i<people;i++) {
+    p.init("First"+to_string(i),"Pax","",80000+i,1000.0f*i);
+    pax.create(p);
+  }
+  for (int i=0;i<people;i++) {
+    p.init("First"+to_string(i),"Pax");
+    Person r=pax.retrieve(p);
+    pass=pass && r==p && r.getZip()==80000+i && r.getSalary()==1000.0f*i && pax.find(p)==i;
+  }
+  p.init("First5","Pax","",80005,7.0f);
+  pax.update(p);
+  pass=pass && pax.retrieve(p).getSalary()==7.0f && pax.getNumPeople()==people;
+  pass=check("PaxTable create, retrieve and update",pass);
+
+  stat(file.c_str(),&s);
+  size=s.st_size;
+  p.init("First3","Pax");
+  pax.del(p);
+  pass=pass && pax.retrieve(p).getZip()==0 && pax.find(p)==NULLRECORD;
+  p.init("First40","Pax");
+  pax.del(p);
+  pass=pass && pax.retrieve(p).getZip()==0 && pax.getNumPeople()==people-2;
+  p.init("New1","Pax","",1,1.0f);
+  pax.create(p);
+  pass=pass && pax.find(p)==40;  // the page freed last heads the list
+  p.init("New2","Pax","",2,2.0f);
+  pax.create(p);
+  pass=pass && pax.find(p)==3 && pax.retrieve(p).getZip()==2;
+  stat(file.c_str(),&s);
+  pass=check("PaxTable del frees rows that create reuses",pass && s.st_size==size && pax.getNumPeople()==people);
+  pax.disconnect();
+
+  pax.connect(file);
+  p.init("New2","Pax");
+  pass=pass && pax.getNumPeople()==people && pax.find(p)==3;
+  p.init("First5","Pax");
+  pass=pass && pax.retrieve(p).getSalary()==7.0f;
+  p.init("First3","Pax");
+  pass=pass && pax.find(p)==NULLRECORD;
+  pax.disconnect();
+  remove((file+".names").c_str());  // lost, rebuilt from the pages
+  pax.connect(file);
+  p.init("First99","Pax");
+  pass=pass && pax.getNumPeople()==people && pax.find(p)==99 && pax.retrieve(p).getZip()==80099;
+  pax.disconnect();
+  removeTable(file);
+  return check("PaxTable reopens with its rows and name index",pass);
+}
+
+// A table whose name index cannot be opened rebuilds it on connect
+template <class T>
+bool lostNamesChecks(T &table,const string &file) {
+  const int people=600;  // a few buckets
+  const string names=file+".names";
+  const char zeros[16]={0};
+  Person p;
+  bool pass=true;
+  removeTable(file);
+  table.connect(file);
+  for (int i=0;i<people;i++) {
+    p.init("First"+to_string(i),"Lost","",80000+i,i);
+    table.create(p);
+  }
+  table.disconnect();
+  for (int damage=0;damage<2;damage++) {
+    if (damage==0) {  // not a hash any more, the magic number is gone
+      fstream f(names,ios::in|ios::out|ios::binary);
+      f.write(zeros,sizeof(zeros));
+    } else if (truncate(names.c_str(),HASH_PAGE_SIZE)!=0) return false;  // cut short, the header names buckets that are not there
+    table.connect(file);
+    for (int i=0;i<people;i+=7) {
+      p.init("First"+to_string(i),"Lost");
+      pass=pass && table.find(p)!=NULLRECORD && table.retrieve(p).getZip()==80000+i;
+    }
+    table.disconnect();
+  }
+  removeTable(file);
+  return pass;
+}
+
+bool lostNamesTest() {
+  Table table;
+  PaxTable pax;
+  bool pass=lostNamesChecks(table,"LostNames.bin") && lostNamesChecks(pax,"LostPax.bin");
+  return check("A name index that cannot be opened is rebuilt on connect",pass);
+}
+
+// The aggregates of a table holding the people aggregateTest makes, against sums worked out by hand
+template <class T>
+bool aggregateChecks(T &table,int threads) {
+  SalaryAggregate all=aggregateSalary(table,PersonFilter(),threads);
+  SalaryAggregate none=aggregateSalary(table,PersonFilter().zip(81503,81503),threads);
+  SalaryAggregate some=aggregateSalary(table,PersonFilter().salary(15,50),threads);
+  ZipGroups groups=groupByZip(table,PersonFilter(),threads);
+  bool pass=all.count==4 && all.sum==160 && all.min==10 && all.max==100 && all.avg()==40
+    && none.count==0 && none.avg()==0 && none.min==FLT_MAX && none.max==-FLT_MAX
+    && some.count==2 && some.sum==50
+    && groups.size()==2 && groups.count(81503)==0
+    && groupByZip(table,PersonFilter().zip(81503,81503),threads).empty();
+  if (!pass) return false;
+  SalaryAggregate &a=groups[81501],&b=groups[81502];
+  return a.count==3 && a.sum==60 && a.min==10 && a.max==30 && a.avg()==20
+    && b.count==1 && b.sum==100 && b.min==100 && b.max==100;
+}
+
+// aggregateSalary and groupByZip over both table formats, a zip whose only person was deleted is no group
+bool aggregateTest() {
+  const string rowFile="AggregateTest.bin",paxFile="AggregatePax.bin";
+  const int zips[]={81501,81501,81501,81502,81503,81501};
+  const float salaries[]={10,20,30,100,5,1000};
+  Table table;
+  PaxTable pax;
+  Person p;
+  bool pass=true;
+  removeTable(rowFile);
+  removeTable(paxFile);
+  table.connect(rowFile);
+  pax.connect(paxFile);
+  for (int i=0;i<6;i++) {
+    p.init("Person"+to_string(i),"Aggregate","",zips[i],salaries[i]);
+    table.create(p);
+    pax.create(p);
+  }
+  for (int i=4;i<6;i++) {  // deleted rows are not counted
+    p.init("Person"+to_string(i),"Aggregate");
+    table.del(p);
+    pax.del(p);
+  }
+  for (int threads=1;threads<=4;threads*=4)
+    pass=pass && aggregateChecks(table,threads) && aggregateChecks(pax,threads);
+  table.disconnect();
+  pax.disconnect();
+  removeTable(rowFile);
+  removeTable(paxFile);
+  return check("Salary aggregates and zip groups match the hand computed ones",pass);
+}
+
+// Parallel scans select the slots a serial scanTable does, with morsels of the usual size and of a few records
+bool parallelTest() {
+  const string file="ParallelTest.bin";
+  const StorageKind kinds[]={STORAGE_PREAD,STORAGE_MEMORY};
+  const int people=2*scanChunkRecords(SCANCHUNK)+100;  // three morsels, the last one short
+  bool pass=true;
+  for (StorageKind kind:kinds) {
+    Table table;
+    Person p;
+    mt19937 random(15);
+    removeTable(file);
+    table.connect(file,kind);
+    for (int i=0;i<people;i++) {
+      p.init("Person"+to_string(i),"Parallel","",81500+random()%10,random()%100000);
+      table.create(p);
+    }
+    for (int i=0;i<people;i+=5) {  // holes all through the file
+      p.init("Person"+to_string(i),"Parallel");
+      table.del(p);
+    }
+    PersonFilter filters[]={PersonFilter(),PersonFilter().zip(81502,81504).salary(10000,60000)};
+    for (const PersonFilter &f:filters) {
+      vector<int> serial,small;
+      vector<vector<int>> partials(4);
+      vector<int> visits(table.getNumPeople());
+      mutex lock;
+      scanTable(table,f,[&serial](const Person &,int slot) { serial.push_back(slot); });
+      parallelMorsels(table.getStorage(),0,sizeof(PersonRecord),table.getNumPeople(),7,4,
+        [&](int t,const char *data,long first,long count) {
+          vector<unsigned long> selection((count+63)/64);
+          f.select((const PersonRecord *)data,(int)count,selection.data());
+          for (int w=0;w<(int)selection.size();w++)
+            for (unsigned long bits=selection[w];bits;bits&=bits-1) partials[t].push_back((int)first+w*64+__builtin_ctzl(bits));
+          lock_guard<mutex> guard(lock);
+          for (long i=first;i<first+count;i++) visits[i]++;
+        });
+      for (auto &part:partials) small.insert(small.end(),part.begin(),part.end());
+      sort(small.begin(),small.end());
+      pass=pass && serial.size()>0 && findAll(table,f,4)==serial && small==serial
+        && count(visits.begin(),visits.end(),1)==(long)visits.size();
+    }
+    table.disconnect();
+    removeTable(file);
+  }
+  return check("Parallel scans select what a serial scan does, on a file and in memory",pass);
+}
+
+// A hot set survives a scan, the cache keeps to its budget and counts its hits and misses
+bool cacheTest() {
+  const int capacity=200,hot=50,cold=20*capacity;
+  PersonCache cache;
+  Person p,found;
+  bool pass=true;
+  cache.setBudget(capacity*PersonCache::entryBytes());
+  p.init("Hot","Cache","",81501,1.0f);
+  pass=!cache.get(p.key(),found) && cache.getMisses()==1 && cache.getHitRate()==0.0;
+  cache.put(p.key(),p);
+  pass=pass && cache.get(p.key(),found) && found==p && found.getSalary()==1.0f
+    && cache.getHits()==1 && cache.getHitRate()==0.5 && cache.getSize()==1
+    && cache.getBytes()>0 && cache.getBytes()<=cache.getBudget();
+  cache.invalidate(p.key());
+  pass=pass && cache.getSize()==0 && !cache.get(p.key(),found) && cache.getMisses()==2;
+  pass=check("PersonCache counts hits, misses and what it holds",pass);
+
+  cache.setBudget(capacity*PersonCache::entryBytes());
+  for (int round=0;round<5;round++)
+    for (int i=0;i<hot;i++) {
+      p.init("Hot"+to_string(i),"Cache","",81501,i);
+      if (!cache.get(p.key(),found)) cache.put(p.key(),p);
+    }
+  long hits=cache.getHits();
+  for (int i=0;i<cold;i++) {  // each cold name once, the way a scan asks, between lookups of the hot set
+    p.init("Cold"+to_string(i),"Cache","",81502,i);
+    if (!cache.get(p.key(),found)) cache.put(p.key(),p);
+    pass=pass && cache.getBytes()<=cache.getBudget();
+    if (i%5) continue;
+    p.init("Hot"+to_string(i/5%hot),"Cache","",81501,i/5%hot);
+    if (!cache.get(p.key(),found)) cache.put(p.key(),p);
+  }
+  pass=pass && cache.getHits()==hits+cold/5;  // 300 names apart, a plain LRU of capacity would miss them all
+  for (int i=0;i<hot;i++) {
+    p.init("Hot"+to_string(i),"Cache");
+    pass=pass && cache.get(p.key(),found) && found.getSalary()==i;
+  }
+  pass=pass && cache.getSize()<=capacity && cache.getSize()>hot;
+  pass=check("PersonCache keeps its hot set through a scan and stays in budget",pass);
+
+  cache.setBudget(0);
+  cache.put(p.key(),p);
+  return check("PersonCache with no budget holds nothing",cache.getSize()==0 && cache.getBytes()==0
+    && !cache.get(p.key(),found));
+}
+
+// What a cached retrieve returns after create, update and del is what the table holds
+template <class T>
+bool cacheChecks(T &table) {
+  Person p,r;
+  bool pass=true;
+  table.setCacheBudget(1<<16);
+  for (int i=0;i<3;i++) {
+    p.init("Person"+to_string(i),"Cached","",81500+i,i);
+    table.create(p);
+  }
+  p.init("Person1","Cached");
+  table.retrieve(p);
+  long hits=table.getCache().getHits(),misses=table.getCache().getMisses();
+  pass=table.retrieve(p).getZip()==81501 && table.getCache().getHits()==hits+1;
+
+  p.init("Person1","Cached","",81599,99);
+  table.update(p);
+  r=table.retrieve(p);
+  pass=pass && r.getZip()==81599 && r.getSalary()==99 && table.getCache().getMisses()==misses+1;
+
+  p.init("Person0","Cached");
+  table.del(p);  // frees a lower slot than Person1's
+  p.init("Person1","Cached","",81598,98);
+  table.create(p);
+  r=table.retrieve(p);
+  table.setCacheBudget(0);
+  pass=pass && r==table.retrieve(p) && r.getZip()==table.retrieve(p).getZip()
+    && r.getSalary()==table.retrieve(p).getSalary();
+
+  table.setCacheBudget(1<<16);
+  table.retrieve(p);
+  p.init("Person2","Cached");
+  table.retrieve(p);
+  table.del(p);
+  pass=pass && table.getCache().getSize()==1;  // only the deleted name is dropped
+  return pass && table.retrieve(p).getZip()==0 && table.getCache().getSize()==1;
+}
+
+// create, update and del on both table formats leave no stale person in the cache
+bool cacheInvalidateTest() {
+  const string rowFile="CacheTest.bin",paxFile="CachePax.bin";
+  Table table;
+  PaxTable pax;
+  bool pass;
+  removeTable(rowFile);
+  removeTable(paxFile);
+  table.connect(rowFile);
+  pax.connect(paxFile);
+  pass=cacheChecks(table) && cacheChecks(pax);
+  table.disconnect();
+  pax.disconnect();
+  removeTable(rowFile);
+  removeTable(paxFile);
+  return check("Create, update and del invalidate the cached person",pass);
+}
+
+int runTests() {
+  bool pass=true;
+  cout << "Records Test" << endl;
+  pass=selectTest() && pass;
+  pass=paxTest() && pass;
+  pass=lostNamesTest() && pass;
+  pass=aggregateTest() && pass;
+  pass=parallelTest() && pass;
+  pass=cacheTest() && pass;
+  pass=cacheInvalidateTest() && pass;
+  cout << (pass?"All Tests Passed":"Some Tests Failed") << endl;
+  return pass?0:1;
+}
+
+int main(int argc,char **argv) {
+  if (argc>1 && string(argv[1])=="test") return runTests();
   try {
-	connectTable("TestLinked.bin");
+	Table table;
+	table.connect("TestLinked.bin");
+	table.setDurability(DURABILITY_COMMIT);  // every change is on disk before it returns
+	table.setCacheBudget(1<<20);  // hot people are returned without a read
 
 	Person karl;
 	karl.init("Karl","Castleton","1100 North Avenue",81501,50000.0);
-	create(karl);
+	table.create(karl);
 
 	Person kim;
 	kim.init("Kim","Castleton","1200 North Avenue",81502,60000.0);
-	create(kim);
+	table.create(kim);
 
 	Person karlKey;
 	karlKey.init("Karl","Castleton");
-	Person t=retrieve(karlKey);
+	Person t=table.retrieve(karlKey);
 	cout << t;
 
 	Person karlUpdate;
 	karlUpdate.init("Karl","Castleton","1100 North Avenue",81503,65000.0);
-	update(karlUpdate);
+	table.update(karlUpdate);
 
-	t=retrieve(karlKey);
+	t=table.retrieve(karlKey);
 	cout << t;
 
-	del(karlKey);
-	t=retrieve(karlKey);
+	ZipGroups payroll=groupByZip(table);
+	for (auto &g:payroll) cout << "Zip:" << g.first << " People:" << g.second.count << " Average salary:" << g.second.avg() << endl;
+
+	table.del(karlKey);
+	t=table.retrieve(karlKey);
 	cout << t; 
 
-	disconnectTable();
+	table.disconnect();
+
+	PaxTable pax;  // the same again in the columnar format
+	pax.connect("TestPax.bin");
+	pax.create(karl);
+	pax.create(kim);
+	cout << pax.retrieve(karlKey);
+	pax.update(karlUpdate);
+	cout << pax.retrieve(karlKey);
+	pax.del(karlKey);
+	cout << pax.retrieve(karlKey);
+	pax.disconnect();
   } catch (DBException dbe) {
-	  cerr << "A database exception occurred" << endl;
+	  cerr << "A database exception occurred: " << dbe.message() << endl;
   }
 	return 0;
 }
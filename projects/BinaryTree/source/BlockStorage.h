@@ -0,0 +1,820 @@
+/**
+ * @file BlockStorage.h
+ * @author James Halladay
+ *
+ * Class: Database Design
+ * Professor: Karl Castleton
+ *
+ * @brief Byte addressed storage under the index and the tables
+ *
+ * @details
+ *      A BlockStorage is a growable run of bytes read and written at an
+ *          offset. Reading past the end gives zeros, writing past the end
+ *          grows it. Which one a structure sits on only changes where its
+ *          bytes live, so the same code can be measured on a file or on
+ *          memory alone:
+ *
+ *          FstreamStorage  seeks and reads through a std::fstream
+ *          PreadStorage    pread and pwrite on a descriptor
+ *          MappedStorage   the file mapped into memory
+ *          MemoryStorage   anonymous memory, nothing reaches a file
+ *
+ *      The mapped and memory storages reserve MAP_RESERVE bytes of address
+ *          space up front and grow inside it, so address() stays good for
+ *          the life of the storage. The others have no address.
+ *
+ *      read may be called from several threads at once, and alongside
+ *          write. Overlapping writes are the caller's problem.
+ *
+ *      A Durability decides when what a structure wrote is made durable,
+ *          trading commit latency against how much a crash can lose:
+ *
+ *          DURABILITY_NONE     never synced until close, a crash loses
+ *                              whatever the OS had not written yet
+ *          DURABILITY_ASYNC    a background thread syncs every interval,
+ *                              commits do not wait, a crash loses at most
+ *                              the last interval
+ *          DURABILITY_BATCHED  the same thread, but a commit waits for the
+ *                              sync that covers it, one sync per interval
+ *                              is shared by every commit in it
+ *          DURABILITY_COMMIT   every commit syncs before it returns,
+ *                              commits that arrive during a sync share
+ *                              the next one
+ *
+ *          It counts its syncs and the time spent in them and waiting on
+ *          them, which is what each mode costs.
+ *
+ *      This header does not depend on main.h or Records.cpp, so it reports
+ *          failures by returning false and leaves throwing to the caller.
+ *
+ * @version 0.1
+ * @date 2023-04-25
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef BLOCK_STORAGE_H
+#define BLOCK_STORAGE_H
+
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+const long MAP_RESERVE = 1L << 32;  // address space a mapped or memory storage reserves, it can grow this far in place
+const long MAP_GRAIN = 4096;        // the smallest mapping, it doubles from here
+
+const int DURABILITY_INTERVAL = 10; // milliseconds between background syncs
+
+enum StorageKind {
+    STORAGE_FSTREAM,
+    STORAGE_PREAD,
+    STORAGE_MAPPED,
+    STORAGE_MEMORY
+};
+
+enum DurabilityMode {
+    DURABILITY_NONE,
+    DURABILITY_ASYNC,
+    DURABILITY_BATCHED,
+    DURABILITY_COMMIT
+};
+
+class BlockStorage {
+    protected:
+        atomic<long> size;
+
+        void grew(long end);
+
+    public:
+        BlockStorage();
+        virtual ~BlockStorage();
+
+        // getters
+        virtual string getName() = 0;
+        long getSize();
+        virtual char *address(long offset);
+
+        // manipulation
+        virtual bool read(long offset, char *dest, long bytes) = 0;
+        virtual bool write(long offset, const char *src, long bytes) = 0;
+        virtual bool flush();
+        virtual bool sync() = 0;
+        virtual bool syncData();    // like sync, but skips metadata the data can be read back without
+
+        static BlockStorage *open(StorageKind kind, string fileName);
+};
+
+class FstreamStorage : public BlockStorage {
+    private:
+        fstream file;
+        mutex latch;    // a stream has one position, every read and write moves it
+
+    public:
+        FstreamStorage(string fileName);
+        ~FstreamStorage();
+
+        bool isOpen();
+        string getName();
+        bool read(long offset, char *dest, long bytes);
+        bool write(long offset, const char *src, long bytes);
+        bool flush();
+        bool sync();
+        bool syncData();
+
+    private:
+        string fileName;
+
+        bool syncFile(bool dataOnly);
+};
+
+class PreadStorage : public BlockStorage {
+    private:
+        int fd;
+
+    public:
+        PreadStorage(string fileName);
+        ~PreadStorage();
+
+        bool isOpen();
+        string getName();
+        bool read(long offset, char *dest, long bytes);
+        bool write(long offset, const char *src, long bytes);
+        bool sync();
+        bool syncData();
+};
+
+class MappedStorage : public BlockStorage {
+    private:
+        int fd;             // -1 for anonymous memory
+        char *base;
+        atomic<long> mapped;
+        mutex growing;
+
+        bool reserve();
+        bool grow(long bytes);
+        bool syncMapping(bool dataOnly);
+
+    public:
+        MappedStorage(string fileName);
+        MappedStorage();    // anonymous memory, see MemoryStorage
+        ~MappedStorage();
+
+        bool isOpen();
+        string getName();
+        char *address(long offset);
+        bool read(long offset, char *dest, long bytes);
+        bool write(long offset, const char *src, long bytes);
+        bool sync();
+        bool syncData();
+};
+
+/**
+ * A MappedStorage with no file behind it
+ */
+class MemoryStorage : public MappedStorage {
+    public:
+        string getName();
+};
+
+/**
+ * When the writes of one structure are made durable, see DURABILITY_NONE and the rest above
+ *
+ * Whoever owns the structure calls commit once a change is complete and
+ *      outside any latch of its own, so commits from several threads can
+ *      share a sync. syncer is what makes everything written so far
+ *      durable, it is only ever called by one thread at a time.
+ */
+class Durability {
+    private:
+        DurabilityMode mode;
+        int intervalMs;
+        function<bool()> syncer;
+        mutex latch;
+        condition_variable synced;  // a sync finished
+        condition_variable wake;    // the flusher has to stop
+        thread flusher;
+        bool stopping;
+        bool syncing;
+        bool failed;
+        long committed;     // commits so far, each one is numbered by its place in this count
+        long durable;       // commits covered by a sync that finished
+        long syncs;
+        long syncNanos;
+        long waitNanos;
+        long maxWaitNanos;
+
+        bool syncTo(unique_lock<mutex> &lock, long target);
+        void flush();
+
+    public:
+        Durability(DurabilityMode mode, function<bool()> syncer, int intervalMs = DURABILITY_INTERVAL);
+        ~Durability();
+
+        // getters
+        DurabilityMode getMode();
+        string getName();
+        int getInterval();
+        long getCommits();
+        long getSyncs();
+        long getSyncMicros();
+        long getWaitMicros();
+        long getMaxWaitMicros();
+
+        // manipulation
+        bool commit();
+        bool sync();
+};
+
+
+inline BlockStorage::BlockStorage(): size(0) {
+}
+
+inline BlockStorage::~BlockStorage() {
+}
+
+inline long BlockStorage::getSize() {
+    return size;
+}
+
+/**
+ * @brief moves the end of the storage out to end if it is not past it already
+ */
+inline void BlockStorage::grew(long end) {
+    long current = size;
+
+    while (end > current && !size.compare_exchange_weak(current, end)) {
+    }
+}
+
+inline char *BlockStorage::address(long /* offset */) {
+    return NULL;
+}
+
+inline bool BlockStorage::flush() {
+    return true;
+}
+
+inline bool BlockStorage::syncData() {
+    return sync();
+}
+
+/**
+ * @brief opens fileName on the kind of storage asked for, creating the file if it is not there
+ *
+ * @return BlockStorage* -- NULL if the file could not be opened, the caller deletes it
+ */
+inline BlockStorage *BlockStorage::open(StorageKind kind, string fileName) {
+    BlockStorage *result = NULL;
+    bool ok = false;
+
+    if (kind == STORAGE_FSTREAM) {
+        FstreamStorage *storage = new FstreamStorage(fileName);
+        ok = storage->isOpen();
+        result = storage;
+    } else if (kind == STORAGE_PREAD) {
+        PreadStorage *storage = new PreadStorage(fileName);
+        ok = storage->isOpen();
+        result = storage;
+    } else if (kind == STORAGE_MAPPED) {
+        MappedStorage *storage = new MappedStorage(fileName);
+        ok = storage->isOpen();
+        result = storage;
+    } else if (kind == STORAGE_MEMORY) {
+        MemoryStorage *storage = new MemoryStorage();
+        ok = storage->isOpen();
+        result = storage;
+    }
+
+    if (!ok) {
+        delete result;
+        return NULL;
+    }
+
+    return result;
+}
+
+
+inline FstreamStorage::FstreamStorage(string fileName) {
+    struct stat s;
+
+    this->fileName = fileName;
+
+    if (stat(fileName.c_str(), &s) != 0) {
+        ofstream t(fileName.c_str());
+        s.st_size = 0;
+    }
+
+    file.open(fileName.c_str(), ios::in | ios::out | ios::binary);
+    size = s.st_size;
+}
+
+inline FstreamStorage::~FstreamStorage() {
+    if (file.is_open()) {
+        file.close();
+    }
+}
+
+inline bool FstreamStorage::isOpen() {
+    return file.is_open();
+}
+
+inline string FstreamStorage::getName() {
+    return "fstream";
+}
+
+inline bool FstreamStorage::read(long offset, char *dest, long bytes) {
+    lock_guard<mutex> lock(latch);
+    long inFile = max(0L, min(bytes, size - offset));
+
+    memset(dest + inFile, 0, bytes - inFile);
+
+    if (inFile == 0) {
+        return true;
+    }
+
+    file.clear();
+    file.seekg(offset);
+    return (bool) file.read(dest, inFile);
+}
+
+inline bool FstreamStorage::write(long offset, const char *src, long bytes) {
+    lock_guard<mutex> lock(latch);
+
+    file.clear();
+    file.seekp(offset);
+
+    if (!file.write(src, bytes)) {
+        return false;
+    }
+
+    grew(offset + bytes);
+    return true;
+}
+
+inline bool FstreamStorage::flush() {
+    lock_guard<mutex> lock(latch);
+    return (bool) file.flush();
+}
+
+inline bool FstreamStorage::sync() {
+    return syncFile(false);
+}
+
+inline bool FstreamStorage::syncData() {
+    return syncFile(true);
+}
+
+/**
+ * @brief flushes the stream, then syncs the file through a descriptor of our own since fstream has none to give
+ */
+inline bool FstreamStorage::syncFile(bool dataOnly) {
+    int fd;
+    bool ok;
+
+    if (!flush()) {
+        return false;
+    }
+
+    fd = ::open(fileName.c_str(), O_RDONLY);
+    ok = fd >= 0 && (dataOnly? fdatasync(fd): fsync(fd)) == 0;
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ok;
+}
+
+
+inline PreadStorage::PreadStorage(string fileName) {
+    struct stat s;
+
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if (fd >= 0 && fstat(fd, &s) == 0) {
+        size = s.st_size;
+    }
+}
+
+inline PreadStorage::~PreadStorage() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+inline bool PreadStorage::isOpen() {
+    return fd >= 0;
+}
+
+inline string PreadStorage::getName() {
+    return "pread";
+}
+
+inline bool PreadStorage::read(long offset, char *dest, long bytes) {
+    long done = 0;
+
+    while (done < bytes) {
+        ssize_t got = pread(fd, dest + done, bytes - done, offset + done);
+
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0) {
+            return false;
+        } else if (got == 0) {
+            memset(dest + done, 0, bytes - done); // the end of the file
+            break;
+        }
+
+        done += got;
+    }
+
+    return true;
+}
+
+inline bool PreadStorage::write(long offset, const char *src, long bytes) {
+    long done = 0;
+
+    while (done < bytes) {
+        ssize_t put = pwrite(fd, src + done, bytes - done, offset + done);
+
+        if (put < 0 && errno == EINTR) {
+            continue;
+        } else if (put <= 0) {
+            return false;
+        }
+
+        done += put;
+    }
+
+    grew(offset + bytes);
+    return true;
+}
+
+inline bool PreadStorage::sync() {
+    return fsync(fd) == 0;
+}
+
+inline bool PreadStorage::syncData() {
+    return fdatasync(fd) == 0;
+}
+
+
+inline MappedStorage::MappedStorage(string fileName): mapped(0) {
+    struct stat s;
+
+    base = NULL;
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0 || fstat(fd, &s) != 0 || !reserve()) {
+        return;
+    }
+
+    size = s.st_size;
+
+    if (!grow(size)) {
+        munmap(base, MAP_RESERVE);
+        base = NULL;
+    }
+}
+
+inline MappedStorage::MappedStorage(): mapped(0) {
+    fd = -1;
+    base = NULL;
+    reserve();
+}
+
+/**
+ * @brief unmaps everything and cuts the file back to the bytes that were written, it grew ahead of them
+ */
+inline MappedStorage::~MappedStorage() {
+    if (base != NULL) {
+        munmap(base, MAP_RESERVE);
+    }
+
+    if (fd >= 0) {
+        if (ftruncate(fd, size) != 0) {
+            // the file keeps its zero tail, it reads the same either way
+        }
+
+        close(fd);
+    }
+}
+
+/**
+ * @brief takes MAP_RESERVE bytes of address space that nothing can use until grow maps it
+ */
+inline bool MappedStorage::reserve() {
+    void *result = mmap(NULL, MAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    base = result == MAP_FAILED? NULL: (char*) result;
+
+    return base != NULL;
+}
+
+/**
+ * @brief makes at least the first bytes usable, growing the file to match
+ *
+ * The mapped part doubles so a growing storage is remapped a logarithmic
+ *      number of times. The new part goes over the reservation right after
+ *      the old part, nothing already mapped moves.
+ *
+ * @param bytes
+ * @return true -- the first bytes are mapped
+ */
+inline bool MappedStorage::grow(long bytes) {
+    lock_guard<mutex> lock(growing);
+    long oldSize = mapped, newSize = max(MAP_GRAIN, oldSize);
+    struct stat s;
+    void *result;
+
+    if (bytes <= oldSize) {
+        return true;
+    }
+
+    while (newSize < bytes) {
+        newSize *= 2;
+    }
+
+    if (newSize > MAP_RESERVE) {
+        return false;
+    }
+
+    if (fd < 0) {
+        // anonymous pages are zero until written, they only need to be made usable
+        if (mprotect(base + oldSize, newSize - oldSize, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+
+    } else {
+        if (fstat(fd, &s) != 0 || (s.st_size < newSize && ftruncate(fd, newSize) != 0)) {
+            return false;
+        }
+
+        result = mmap(base + oldSize, newSize - oldSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, oldSize);
+
+        if (result == MAP_FAILED) {
+            return false;
+        }
+    }
+
+    mapped = newSize;
+    return true;
+}
+
+inline bool MappedStorage::isOpen() {
+    return base != NULL;
+}
+
+inline string MappedStorage::getName() {
+    return "mmap";
+}
+
+/**
+ * @brief where offset lives in memory, good until the storage is deleted
+ *
+ * @return char* -- NULL past the mapped part
+ */
+inline char *MappedStorage::address(long offset) {
+    return offset >= 0 && offset < mapped? base + offset: NULL;
+}
+
+inline bool MappedStorage::read(long offset, char *dest, long bytes) {
+    long inMap = max(0L, min(bytes, (long) mapped - offset));
+
+    if (inMap > 0) {
+        memcpy(dest, base + offset, inMap);
+    }
+
+    memset(dest + inMap, 0, bytes - inMap);
+    return true;
+}
+
+inline bool MappedStorage::write(long offset, const char *src, long bytes) {
+    if (!grow(offset + bytes)) {
+        return false;
+    }
+
+    memcpy(base + offset, src, bytes);
+    grew(offset + bytes);
+    return true;
+}
+
+inline bool MappedStorage::sync() {
+    return syncMapping(false);
+}
+
+inline bool MappedStorage::syncData() {
+    return syncMapping(true);
+}
+
+inline bool MappedStorage::syncMapping(bool dataOnly) {
+    if (fd < 0 || mapped == 0) {
+        return true;
+    }
+
+    return msync(base, mapped, MS_SYNC) == 0 && (dataOnly? fdatasync(fd): fsync(fd)) == 0;
+}
+
+
+inline string MemoryStorage::getName() {
+    return "memory";
+}
+
+
+inline Durability::Durability(DurabilityMode mode, function<bool()> syncer, int intervalMs) {
+    this->mode = mode;
+    this->intervalMs = max(1, intervalMs);
+    this->syncer = syncer;
+    stopping = false;
+    syncing = false;
+    failed = false;
+    committed = 0;
+    durable = 0;
+    syncs = 0;
+    syncNanos = 0;
+    waitNanos = 0;
+    maxWaitNanos = 0;
+
+    if (mode == DURABILITY_ASYNC || mode == DURABILITY_BATCHED) {
+        flusher = thread(&Durability::flush, this);
+    }
+}
+
+/**
+ * @brief stops the flusher and syncs whatever was committed since its last round, except in DURABILITY_NONE
+ */
+inline Durability::~Durability() {
+    {
+        lock_guard<mutex> lock(latch);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+
+    if (mode != DURABILITY_NONE) {
+        unique_lock<mutex> lock(latch);
+        syncTo(lock, committed);
+    }
+}
+
+inline DurabilityMode Durability::getMode() {
+    return mode;
+}
+
+inline string Durability::getName() {
+    const char *names[] = {"none", "async", "batched", "commit"};
+
+    return names[mode];
+}
+
+inline int Durability::getInterval() {
+    return intervalMs;
+}
+
+inline long Durability::getCommits() {
+    lock_guard<mutex> lock(latch);
+    return committed;
+}
+
+inline long Durability::getSyncs() {
+    lock_guard<mutex> lock(latch);
+    return syncs;
+}
+
+/**
+ * @brief time spent in syncs, on whichever thread ran them
+ */
+inline long Durability::getSyncMicros() {
+    lock_guard<mutex> lock(latch);
+    return syncNanos / 1000;
+}
+
+/**
+ * @brief time commits spent waiting to be durable, added up over every commit
+ */
+inline long Durability::getWaitMicros() {
+    lock_guard<mutex> lock(latch);
+    return waitNanos / 1000;
+}
+
+inline long Durability::getMaxWaitMicros() {
+    lock_guard<mutex> lock(latch);
+    return maxWaitNanos / 1000;
+}
+
+/**
+ * @brief syncs until every commit up to target is durable
+ *
+ * One thread syncs at a time. It covers every commit made before it 
+ *      started, the others wait for it and only sync again if that did not
+ *      reach their target.
+ *
+ * @param lock -- holds latch, it is released during the sync
+ * @param target
+ * @return true -- no sync has ever failed
+ */
+inline bool Durability::syncTo(unique_lock<mutex> &lock, long target) {
+    while (durable < target && !failed) {
+        if (syncing) {
+            synced.wait(lock);
+            continue;
+        }
+
+        long covering = committed;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bool ok;
+
+        syncing = true;
+        lock.unlock();
+        ok = syncer();
+        lock.lock();
+        syncing = false;
+
+        syncs++;
+        syncNanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        failed = !ok;
+
+        if (ok) {
+            durable = covering;
+        }
+
+        synced.notify_all();
+    }
+
+    return !failed;
+}
+
+/**
+ * @brief the background thread, it syncs once an interval if anything was committed
+ */
+inline void Durability::flush() {
+    unique_lock<mutex> lock(latch);
+
+    while (!stopping) {
+        wake.wait_for(lock, chrono::milliseconds(intervalMs));
+
+        if (!stopping && durable < committed) {
+            syncTo(lock, committed);
+        }
+    }
+}
+
+/**
+ * @brief counts a commit and, depending on the mode, waits for it to be durable
+ *
+ * @return false -- a sync failed, this commit or an earlier one may not be durable
+ */
+inline bool Durability::commit() {
+    unique_lock<mutex> lock(latch);
+    long mine = ++committed;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool ok = !failed;
+    long waited;
+
+    if (mode == DURABILITY_COMMIT) {
+        ok = syncTo(lock, mine);
+    } else if (mode == DURABILITY_BATCHED) {
+        while (durable < mine && !failed) {
+            synced.wait(lock);
+        }
+
+        ok = !failed;
+    } else {
+        return ok;
+    }
+
+    waited = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    waitNanos += waited;
+    maxWaitNanos = max(maxWaitNanos, waited);
+
+    return ok;
+}
+
+/**
+ * @brief makes every commit so far durable now, whatever the mode
+ */
+inline bool Durability::sync() {
+    unique_lock<mutex> lock(latch);
+    return syncTo(lock, committed);
+}
+
+#endif
@@ -0,0 +1,230 @@
+/**
+ * @file BloomFilter.h
+ * @author James Halladay
+ *
+ * Class: Database Design
+ * Professor: Karl Castleton
+ *
+ * @brief A blocked Bloom filter that answers "not here" without reading a page
+ *
+ * @details
+ *      The filter is an array of 64 byte blocks, one cache line each. A key
+ *          picks one block from the high half of its hash and sets one bit
+ *          in each of the block's eight 32 bit words from the low half, so
+ *          a probe touches a single cache line. On x86 with AVX2 the eight
+ *          words are tested at once, the kernel is picked when the filter
+ *          is made, the same way Records.cpp picks its scan kernels.
+ *
+ *      With BLOOM_BITS_PER_KEY bits for every key the filter was sized
+ *          for about 1 in 100 absent keys gets through. Keys cannot be
+ *          removed, so a filter only ever answers "maybe" more often than
+ *          it has to. An owner that grows past getCapacity() rebuilds the
+ *          filter bigger from its own data.
+ *
+ *      The blocks are plain memory, data() and getBytes() are what an
+ *          owner writes to its file and reads back after setNumBlocks().
+ *
+ *      add and mayContain are for a filter one thread changes at a time.
+ *          addShared and mayContainShared can run together on any number
+ *          of threads, at the price of testing the words one at a time.
+ *
+ * @version 0.1
+ * @date 2023-04-27
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+const int BLOOM_BLOCK_WORDS = 8;        // 32 bit words in a block, a block is one 64 byte cache line
+const int BLOOM_BITS_PER_KEY = 12;      // about 1% false positives
+
+struct alignas(64) BloomBlock {
+    uint32_t words[BLOOM_BLOCK_WORDS];
+};
+
+typedef bool (*BloomProbe)(const BloomBlock &block, uint32_t key);
+
+class BloomFilter {
+    private:
+        vector<BloomBlock> blocks;
+        BloomProbe probe;
+
+        static unsigned long mix(unsigned long hash);
+        long blockFor(unsigned long hash) const;
+        static uint32_t bitFor(uint32_t key, int word);
+        static BloomProbe pickProbe();
+
+    public:
+        static bool probeScalar(const BloomBlock &block, uint32_t key);
+#if defined(__x86_64__) || defined(__i386__)
+        static bool probeAVX2(const BloomBlock &block, uint32_t key);
+#endif
+
+        BloomFilter(long expectedKeys = 0);
+
+        // getters
+        long getNumBlocks();
+        long getBytes();
+        long getCapacity();
+        char *data();
+
+        // setters
+        void setNumBlocks(long numBlocks);
+
+        // manipulation
+        void reset(long expectedKeys);
+        void add(unsigned long hash);
+        bool mayContain(unsigned long hash) const;
+        void addShared(unsigned long hash);
+        bool mayContainShared(unsigned long hash) const;
+};
+
+// odd multipliers that spread a key over the 32 bits of each word
+const uint32_t BLOOM_SALTS[BLOOM_BLOCK_WORDS] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d, 0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+};
+
+
+inline BloomFilter::BloomFilter(long expectedKeys) {
+    probe = pickProbe();
+    reset(expectedKeys);
+}
+
+/**
+ * @brief the 64 bit finalizer of MurmurHash3, so keys that differ only in a few bits,
+ *      or hashes with weak high bits, still land on unrelated blocks and bits
+ */
+inline unsigned long BloomFilter::mix(unsigned long hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53UL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/**
+ * @brief the block a mixed hash belongs to, from its high 32 bits
+ */
+inline long BloomFilter::blockFor(unsigned long hash) const {
+    return ((hash >> 32) * blocks.size()) >> 32;
+}
+
+inline uint32_t BloomFilter::bitFor(uint32_t key, int word) {
+    return 1U << ((key * BLOOM_SALTS[word]) >> 27);
+}
+
+inline bool BloomFilter::probeScalar(const BloomBlock &block, uint32_t key) {
+    uint32_t missing = 0;
+
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        missing |= bitFor(key, i) & ~block.words[i];
+    }
+
+    return missing == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+inline bool BloomFilter::probeAVX2(const BloomBlock &block, uint32_t key) {
+    const __m256i salts = _mm256_loadu_si256((const __m256i *) BLOOM_SALTS);
+    __m256i shifts = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(key), salts), 27);
+    __m256i bits = _mm256_sllv_epi32(_mm256_set1_epi32(1), shifts);
+
+    // every bit of the key is set in the block
+    return _mm256_testc_si256(_mm256_load_si256((const __m256i *) block.words), bits);
+}
+
+inline BloomProbe BloomFilter::pickProbe() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return probeAVX2;
+    return probeScalar;
+}
+#else
+inline BloomProbe BloomFilter::pickProbe() {
+    return probeScalar;
+}
+#endif
+
+inline long BloomFilter::getNumBlocks() {
+    return blocks.size();
+}
+
+inline long BloomFilter::getBytes() {
+    return blocks.size() * sizeof(BloomBlock);
+}
+
+/**
+ * @brief how many keys the filter was sized for
+ */
+inline long BloomFilter::getCapacity() {
+    return blocks.size() * BLOOM_BLOCK_WORDS * 32 / BLOOM_BITS_PER_KEY;
+}
+
+inline char *BloomFilter::data() {
+    return (char *) blocks.data();
+}
+
+/**
+ * @brief an empty filter of numBlocks blocks, ready to be read into through data()
+ */
+inline void BloomFilter::setNumBlocks(long numBlocks) {
+    blocks.assign(max(1L, numBlocks), BloomBlock());
+}
+
+/**
+ * @brief empties the filter and sizes it for expectedKeys
+ */
+inline void BloomFilter::reset(long expectedKeys) {
+    setNumBlocks((expectedKeys * BLOOM_BITS_PER_KEY + BLOOM_BLOCK_WORDS * 32 - 1) / (BLOOM_BLOCK_WORDS * 32));
+}
+
+inline void BloomFilter::add(unsigned long hash) {
+    BloomBlock &block = blocks[blockFor(hash = mix(hash))];
+
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        block.words[i] |= bitFor(hash, i);
+    }
+}
+
+/**
+ * @brief false when the key was never added, true when it may have been
+ */
+inline bool BloomFilter::mayContain(unsigned long hash) const {
+    hash = mix(hash);
+    return probe(blocks[blockFor(hash)], hash);
+}
+
+inline void BloomFilter::addShared(unsigned long hash) {
+    BloomBlock &block = blocks[blockFor(hash = mix(hash))];
+
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        __atomic_fetch_or(&block.words[i], bitFor(hash, i), __ATOMIC_RELAXED);
+    }
+}
+
+inline bool BloomFilter::mayContainShared(unsigned long hash) const {
+    const BloomBlock &block = blocks[blockFor(hash = mix(hash))];
+    uint32_t missing = 0;
+
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        missing |= bitFor(hash, i) & ~__atomic_load_n(&block.words[i], __ATOMIC_RELAXED);
+    }
+
+    return missing == 0;
+}
+
+#endif
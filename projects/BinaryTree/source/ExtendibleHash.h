@@ -0,0 +1,842 @@
+/**
+ * @file ExtendibleHash.h
+ * @author James Halladay
+ *
+ * Class: Database Design
+ * Professor: Karl Castleton
+ *
+ * @brief An on-disk extendible hash index for exact match lookups
+ *
+ * @details
+ *      The file is a header page followed by bucket pages. The directory of
+ *          2^globalDepth bucket pages is kept in memory, so a lookup reads
+ *          exactly one bucket page. A full bucket is split on its own, only
+ *          its entries move, and the directory doubles in memory when the
+ *          bucket was already as deep as the directory. There is never a
+ *          rehash of the whole file.
+ *
+ *      The directory is written after the last bucket when the hash is
+ *          closed. While it is open the header is marked not clean, and a
+ *          hash that was not closed rebuilds its directory from the depth
+ *          and hash bits stored in every bucket.
+ *
+ *      A Bloom filter of every key sits in memory and is written after the
+ *          directory on close, so find answers for most absent keys without
+ *          reading a bucket. It is rebuilt from the buckets when the file
+ *          was not closed, and twice as big whenever the hash outgrows it,
+ *          which also forgets the keys that were erased since.
+ *
+ *      Keys must be plain fixed size data with no padding (a long, or
+ *          a struct of char arrays) and have an operator ==. The same key
+ *          may be stored with several values, find returns the smallest.
+ *          Buckets are not merged when entries are removed.
+ *
+ *      No split can separate entries that share one hash, so a full bucket
+ *          at least half taken by the hash being inserted (or a bucket at
+ *          HASH_MAX_DEPTH) takes overflow pages instead. An overflow page
+ *          has a localDepth of HASH_OVERFLOW and the bucket it belongs to
+ *          in bits. The chains are listed after the filter on close and
+ *          found again by their marks when the file was not closed. When
+ *          a bucket with a chain splits, the chain goes with its hash.
+ *
+ *      This header does not depend on main.h or Records.cpp, so it reports
+ *          failures by returning false and leaves throwing to the caller.
+ *
+ * @version 0.1
+ * @date 2023-04-18
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef EXTENDIBLE_HASH_H
+#define EXTENDIBLE_HASH_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <sys/stat.h>
+#include "BloomFilter.h"
+
+using namespace std;
+
+const int HASH_PAGE_SIZE = 4096;
+const int HASH_MAX_DEPTH = 30;                  // a directory never grows past 2^30 buckets
+const long HASH_MAGIC = 0x4853414845585445;     // "ETXEHASH"
+const int HASH_OVERFLOW = -1;                   // the localDepth of an overflow page
+
+struct HashHeader {
+    long magic;
+    long clean;         // 1 only while the file is closed and the directory after the buckets is current
+    long globalDepth;
+    long numPages;      // the header plus every bucket page
+    long count;
+    long keySize;
+    long tag;           // left for the owner of the hash, e.g. to tie it to the state of a table
+    long filterBlocks;  // blocks of the Bloom filter after the directory, 0 if there is none
+    long overflowPages; // (bucket, overflow page) pairs after the filter
+};
+
+template <class Key>
+class ExtendibleHash {
+    private:
+        struct Entry {
+            Key key;
+            long value;
+        };
+
+        struct Bucket {
+            int localDepth;
+            int count;
+            unsigned long bits;     // the low localDepth bits every hash in this bucket shares
+        };
+
+        static const int CAPACITY = (HASH_PAGE_SIZE - sizeof(Bucket)) / sizeof(Entry);
+
+        string fileName;
+        fstream file;
+        HashHeader header;
+        vector<long> directory;
+        map<long, vector<long>> chains;     // overflow pages of each bucket that has them
+        char page[HASH_PAGE_SIZE];
+        long pageReads;
+        long pageWrites;
+        long filterSkips;
+        bool wasClean;
+        BloomFilter filter;
+
+        static unsigned long hashOf(const Key &key);
+        Bucket *bucket();
+        Entry *entries();
+        bool readPage(long pageId);
+        bool writePage(long pageId);
+        bool writeHeader();
+        bool rebuildDirectory();
+        bool rebuildFilter(long expectedKeys);
+        bool filterAdd(unsigned long hash);
+        bool chainHash(long pageId, unsigned long &hash);
+        bool canSplit(long pageId, unsigned long hash);
+        bool split(long pageId);
+        bool insertOverflow(long pageId, const Key &key, long value);
+
+    public:
+        ExtendibleHash();
+        ~ExtendibleHash();
+
+        // getters
+        bool isOpen();
+        bool openedClean();
+        long size();
+        int getGlobalDepth();
+        long getNumPages();
+        long getPageReads();
+        long getPageWrites();
+        long getFilterSkips();
+        long getFilterBytes();
+        long getTag();
+
+        // setters
+        void setTag(long tag);
+
+        // manipulation
+        bool open(string fileName);
+        bool close();
+        bool clear();
+        bool insert(const Key &key, long value);
+        bool find(const Key &key, long &value);
+        bool erase(const Key &key, long value);
+};
+
+
+template <class Key>
+ExtendibleHash<Key>::ExtendibleHash() {
+    pageReads = 0;
+    pageWrites = 0;
+    filterSkips = 0;
+    wasClean = false;
+    memset(&header, 0, sizeof(header));
+}
+
+template <class Key>
+ExtendibleHash<Key>::~ExtendibleHash() {
+    if (file.is_open()) {
+        close();
+    }
+}
+
+template <class Key>
+bool ExtendibleHash<Key>::isOpen() {
+    return file.is_open();
+}
+
+template <class Key>
+bool ExtendibleHash<Key>::openedClean() {
+    return wasClean;
+}
+
+template <class Key>
+long ExtendibleHash<Key>::size() {
+    return header.count;
+}
+
+template <class Key>
+int ExtendibleHash<Key>::getGlobalDepth() {
+    return header.globalDepth;
+}
+
+template <class Key>
+long ExtendibleHash<Key>::getNumPages() {
+    return header.numPages;
+}
+
+template <class Key>
+long ExtendibleHash<Key>::getPageReads() {
+    return pageReads;
+}
+
+template <class Key>
+long ExtendibleHash<Key>::getPageWrites() {
+    return pageWrites;
+}
+
+/**
+ * @brief finds the Bloom filter answered without reading a bucket
+ */
+template <class Key>
+long ExtendibleHash<Key>::getFilterSkips() {
+    return filterSkips;
+}
+
+template <class Key>
+long ExtendibleHash<Key>::getFilterBytes() {
+    return filter.getBytes();
+}
+
+template <class Key>
+long ExtendibleHash<Key>::getTag() {
+    return header.tag;
+}
+
+template <class Key>
+void ExtendibleHash<Key>::setTag(long tag) {
+    header.tag = tag;
+}
+
+/**
+ * @brief 64 bit FNV-1a over the bytes of the key
+ */
+template <class Key>
+unsigned long ExtendibleHash<Key>::hashOf(const Key &key) {
+    const unsigned char *bytes = (const unsigned char *) &key;
+    unsigned long hash = 14695981039346656037UL;
+
+    for (size_t i = 0; i < sizeof(Key); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211UL;
+    }
+
+    return hash;
+}
+
+template <class Key>
+typename ExtendibleHash<Key>::Bucket *ExtendibleHash<Key>::bucket() {
+    return (Bucket *) page;
+}
+
+template <class Key>
+typename ExtendibleHash<Key>::Entry *ExtendibleHash<Key>::entries() {
+    return (Entry *) (page + sizeof(Bucket));
+}
+
+template <class Key>
+bool ExtendibleHash<Key>::readPage(long pageId) {
+    file.clear();
+    file.seekg(pageId * HASH_PAGE_SIZE);
+    file.read(page, HASH_PAGE_SIZE);
+    pageReads++;
+
+    return file.good();
+}
+
+template <class Key>
+bool ExtendibleHash<Key>::writePage(long pageId) {
+    file.clear();
+    file.seekp(pageId * HASH_PAGE_SIZE);
+    file.write(page, HASH_PAGE_SIZE);
+    pageWrites++;
+
+    return file.good();
+}
+
+template <class Key>
+bool ExtendibleHash<Key>::writeHeader() {
+    file.clear();
+    file.seekp(0);
+    file.write((char *) &header, sizeof(header));
+
+    return file.good();
+}
+
+/**
+ * @brief opens the hash file, creating it with one empty bucket if it does not exist
+ *
+ * @param fileName
+ * @return true -- the file is open and its directory loaded
+ */
+template <class Key>
+bool ExtendibleHash<Key>::open(string fileName) {
+    struct stat s;
+
+    this->fileName = fileName;
+    wasClean = false;
+
+    if (stat(fileName.c_str(), &s) != 0 || s.st_size == 0) {
+        ofstream t(fileName.c_str());
+        t.close();
+    }
+
+    file.open(fileName.c_str(), ios::in | ios::out | ios::binary);
+
+    if (!file.is_open()) {
+        return false;
+    }
+
+    file.read((char *) &header, sizeof(header));
+
+    if (!file) { // a new, empty file
+        return clear();
+    } else if (header.magic != HASH_MAGIC || header.keySize != (long) sizeof(Key)) {
+        file.close();
+        return false;
+    }
+
+    wasClean = header.clean == 1;
+
+    if (wasClean) {
+        directory.resize(1L << header.globalDepth);
+        file.seekg(header.numPages * HASH_PAGE_SIZE);
+        file.read((char *) directory.data(), directory.size() * sizeof(long));
+
+        if (header.filterBlocks > 0) {
+            filter.setNumBlocks(header.filterBlocks);
+            file.read(filter.data(), filter.getBytes());
+        }
+
+        if (header.overflowPages > 0) {
+            vector<long> pairs(2 * header.overflowPages);
+
+            file.read((char *) pairs.data(), pairs.size() * sizeof(long));
+
+            for (size_t i = 0; file && i < pairs.size(); i += 2) {
+                chains[pairs[i]].push_back(pairs[i + 1]);
+            }
+        }
+
+        if (!file) {
+            wasClean = false;
+        }
+    }
+
+    if (!wasClean && !rebuildDirectory()) {
+        return false;
+    }
+
+    // a hash closed before it had a filter gets one now
+    if ((!wasClean || header.filterBlocks == 0) && !rebuildFilter(header.count)) {
+        return false;
+    }
+
+    header.clean = 0;
+    return writeHeader();
+}
+
+/**
+ * @brief writes the directory, the filter and the overflow chains after the last bucket and marks the file clean
+ *
+ * @return true -- everything reached the file
+ */
+template <class Key>
+bool ExtendibleHash<Key>::close() {
+    vector<long> pairs;
+    bool result;
+
+    for (map<long, vector<long>>::iterator it = chains.begin(); it != chains.end(); it++) {
+        for (size_t i = 0; i < it->second.size(); i++) {
+            pairs.push_back(it->first);
+            pairs.push_back(it->second[i]);
+        }
+    }
+
+    file.clear();
+    file.seekp(header.numPages * HASH_PAGE_SIZE);
+    file.write((char *) directory.data(), directory.size() * sizeof(long));
+    file.write(filter.data(), filter.getBytes());
+    file.write((char *) pairs.data(), pairs.size() * sizeof(long));
+
+    header.clean = 1;
+    header.filterBlocks = filter.getNumBlocks();
+    header.overflowPages = pairs.size() / 2;
+    result = file.good() && writeHeader();
+    file.close();
+
+    return result;
+}
+
+/**
+ * @brief throws away every entry, leaving a single empty bucket
+ *
+ * @return true
+ */
+template <class Key>
+bool ExtendibleHash<Key>::clear() {
+    header.magic = HASH_MAGIC;
+    header.clean = 0;
+    header.globalDepth = 0;
+    header.numPages = 2;
+    header.count = 0;
+    header.keySize = sizeof(Key);
+    header.tag = 0;
+    header.filterBlocks = 0;
+    header.overflowPages = 0;
+
+    memset(page, 0, HASH_PAGE_SIZE);
+    directory.assign(1, 1);
+    chains.clear();
+    filter.reset(0);
+
+    return writePage(1) && writeHeader();
+}
+
+/**
+ * @brief rebuilds the directory from the buckets after the file was not closed
+ *
+ * Every bucket of local depth d owns the directory slots whose low d bits
+ *      match its bits, so visiting each bucket once fills the directory.
+ *      An overflow page names its bucket in bits instead.
+ *      The header is rewritten on every split so numPages is current, but
+ *      the entry count is not, so it is recounted on the way.
+ *
+ * A split writes its new bucket and the header before the bucket it splits,
+ *      so a crash in between leaves that bucket one level too shallow and
+ *      still holding the entries that moved. The shallower buckets are
+ *      filled in first so the deeper one keeps its slots, and the cut short
+ *      split is finished here. A chain that was moving with its hash goes
+ *      to the bucket that owns the hash now.
+ *
+ * @return true
+ */
+template <class Key>
+bool ExtendibleHash<Key>::rebuildDirectory() {
+    vector<Bucket> buckets(header.numPages);
+    int depth = 0;
+
+    header.count = 0;
+    chains.clear();
+
+    for (long p = 1; p < header.numPages; p++) {
+        if (!readPage(p)) {
+            return false;
+        }
+
+        buckets[p] = *bucket();
+        depth = max(depth, bucket()->localDepth);
+    }
+
+    header.globalDepth = depth;
+    directory.assign(1L << depth, -1);
+
+    for (int d = 0; d <= depth; d++) {
+        for (long p = 1; p < header.numPages; p++) {
+            if (buckets[p].localDepth != d) {
+                continue;
+            }
+
+            for (long i = buckets[p].bits; i < (long) directory.size(); i += 1L << d) {
+                directory[i] = p;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < directory.size(); i++) {
+        if (directory[i] < 0) {
+            return false;
+        }
+    }
+
+    for (long p = 1; p < header.numPages; p++) {
+        int d = buckets[p].localDepth;
+
+        if (!readPage(p)) {
+            return false;
+        }
+
+        if (d == HASH_OVERFLOW) {
+            long owner = bucket()->count > 0 ? directory[hashOf(entries()[0].key) & (directory.size() - 1)] : bucket()->bits;
+
+            if (owner != (long) bucket()->bits) {
+                bucket()->bits = owner;
+
+                if (!writePage(p)) {
+                    return false;
+                }
+            }
+
+            chains[owner].push_back(p);
+        } else if (d < depth && directory[buckets[p].bits | (1UL << d)] != p) {
+            Entry *e = entries();
+
+            for (int i = 0; i < bucket()->count;) {
+                if (hashOf(e[i].key) & (1UL << d)) {
+                    e[i] = e[--bucket()->count];
+                } else {
+                    i++;
+                }
+            }
+
+            bucket()->localDepth = d + 1;
+
+            if (!writePage(p)) {
+                return false;
+            }
+        }
+
+        header.count += bucket()->count;
+    }
+
+    return true;
+}
+
+/**
+ * @brief refills the filter from every bucket, sized for expectedKeys
+ *
+ * @return true
+ */
+template <class Key>
+bool ExtendibleHash<Key>::rebuildFilter(long expectedKeys) {
+    filter.reset(expectedKeys);
+
+    for (long p = 1; p < header.numPages; p++) {
+        if (!readPage(p)) {
+            return false;
+        }
+
+        for (int i = 0; i < bucket()->count; i++) {
+            filter.add(hashOf(entries()[i].key));
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief adds a hash to the filter, rebuilding it twice as big once the hash outgrows it
+ *
+ * @return true
+ */
+template <class Key>
+bool ExtendibleHash<Key>::filterAdd(unsigned long hash) {
+    filter.add(hash);
+
+    // one pass over the buckets each time the hash doubles
+    return header.count <= filter.getCapacity() || rebuildFilter(2 * header.count);
+}
+
+/**
+ * @brief the hash every entry in the overflow chain of pageId shares
+ *
+ * @return false -- the bucket has no chain, or nothing is left in it
+ */
+template <class Key>
+bool ExtendibleHash<Key>::chainHash(long pageId, unsigned long &hash) {
+    map<long, vector<long>>::iterator chain = chains.find(pageId);
+
+    for (size_t i = 0; chain != chains.end() && i < chain->second.size(); i++) {
+        if (readPage(chain->second[i]) && bucket()->count > 0) {
+            hash = hashOf(entries()[0].key);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief whether splitting the full bucket in page would make room for a key with this hash
+ *
+ * Entries with the key's hash stay with it through every split, so once
+ *      they fill half the bucket splitting only grows the directory
+ *      chasing the few entries that share more bits with them. A chain
+ *      keeps the hash it was started for and moves with it.
+ *
+ * @return true -- split the bucket, false -- chain the key
+ */
+template <class Key>
+bool ExtendibleHash<Key>::canSplit(long pageId, unsigned long hash) {
+    unsigned long other;
+    int same = 0;
+
+    if (bucket()->localDepth >= HASH_MAX_DEPTH) {
+        return false;
+    }
+
+    for (int i = 0; i < bucket()->count; i++) {
+        same += hashOf(entries()[i].key) == hash;
+    }
+
+    if (chainHash(pageId, other)) {
+        return other != hash;
+    }
+
+    return 2 * same < CAPACITY;
+}
+
+/**
+ * @brief puts a pair in the first overflow page of pageId with room, or a new one
+ *
+ * @return true
+ */
+template <class Key>
+bool ExtendibleHash<Key>::insertOverflow(long pageId, const Key &key, long value) {
+    vector<long> &chain = chains[pageId];
+    long target = -1;
+
+    for (size_t i = 0; i < chain.size() && target < 0; i++) {
+        if (!readPage(chain[i])) {
+            return false;
+        }
+
+        if (bucket()->count < CAPACITY) {
+            target = chain[i];
+        }
+    }
+
+    if (target < 0) {
+        target = header.numPages++;
+        chain.push_back(target);
+
+        memset(page, 0, HASH_PAGE_SIZE);
+        bucket()->localDepth = HASH_OVERFLOW;
+        bucket()->bits = pageId;
+    }
+
+    entries()[bucket()->count].key = key;
+    entries()[bucket()->count].value = value;
+    bucket()->count++;
+    header.count++;
+
+    // the header has to know about every page in case the chains are rebuilt
+    return writePage(target) && writeHeader() && filterAdd(hashOf(key));
+}
+
+/**
+ * @brief splits the bucket at pageId into itself and a new bucket one bit deeper
+ *
+ * @return false -- the bucket is already at HASH_MAX_DEPTH
+ */
+template <class Key>
+bool ExtendibleHash<Key>::split(long pageId) {
+    char moved[HASH_PAGE_SIZE];
+    Bucket *stay, *move;
+    Entry *stayEntries, *moveEntries;
+    long newPage = header.numPages;
+    unsigned long chained;
+    bool chainMoves;
+    int depth;
+
+    readPage(pageId);
+    depth = bucket()->localDepth;
+
+    if (depth >= HASH_MAX_DEPTH) {
+        return false;
+    }
+
+    chainMoves = chainHash(pageId, chained) && (chained & (1UL << depth));
+    readPage(pageId);
+
+    // the directory doubles, each new slot points where its twin below does
+    if (depth == header.globalDepth) {
+        long oldSize = directory.size();
+
+        directory.resize(oldSize * 2);
+
+        for (long i = 0; i < oldSize; i++) {
+            directory[oldSize + i] = directory[i];
+        }
+
+        header.globalDepth++;
+    }
+
+    stay = bucket();
+    stayEntries = entries();
+    move = (Bucket *) moved;
+    moveEntries = (Entry *) (moved + sizeof(Bucket));
+
+    memset(moved, 0, HASH_PAGE_SIZE);
+    move->localDepth = depth + 1;
+    move->bits = stay->bits | (1UL << depth);
+    move->count = 0;
+
+    stay->localDepth = depth + 1;
+
+    for (int i = 0; i < stay->count;) {
+        if (hashOf(stayEntries[i].key) & (1UL << depth)) {
+            moveEntries[move->count++] = stayEntries[i];
+            stayEntries[i] = stayEntries[--stay->count];
+        } else {
+            i++;
+        }
+    }
+
+    for (long i = move->bits; i < (long) directory.size(); i += 1L << (depth + 1)) {
+        directory[i] = newPage;
+    }
+
+    header.numPages++;
+
+    // the new bucket and the header that knows about it go first, see rebuildDirectory
+    swap_ranges(page, page + HASH_PAGE_SIZE, moved);
+
+    if (!writePage(newPage) || !writeHeader()) {
+        return false;
+    }
+
+    swap_ranges(page, page + HASH_PAGE_SIZE, moved);
+
+    if (!writePage(pageId)) {
+        return false;
+    }
+
+    if (chainMoves) {
+        chains[newPage].swap(chains[pageId]);
+        chains.erase(pageId);
+
+        for (size_t i = 0; i < chains[newPage].size(); i++) {
+            if (!readPage(chains[newPage][i])) {
+                return false;
+            }
+
+            bucket()->bits = newPage;
+
+            if (!writePage(chains[newPage][i])) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief adds a key value pair, splitting buckets until it fits, or chaining it when no split can help
+ *
+ * @return false -- the pair could not be written
+ */
+template <class Key>
+bool ExtendibleHash<Key>::insert(const Key &key, long value) {
+    unsigned long hash = hashOf(key);
+
+    while (true) {
+        long pageId = directory[hash & ((1UL << header.globalDepth) - 1)];
+
+        if (!readPage(pageId)) {
+            return false;
+        }
+
+        if (bucket()->count < CAPACITY) {
+            entries()[bucket()->count].key = key;
+            entries()[bucket()->count].value = value;
+            bucket()->count++;
+            header.count++;
+
+            return writePage(pageId) && filterAdd(hash);
+        }
+
+        if (!canSplit(pageId, hash)) {
+            return insertOverflow(pageId, key, value);
+        }
+
+        if (!split(pageId)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * @brief finds the smallest value stored with key, reading one bucket page 
+ *      unless the filter knows the key is not there
+ *
+ * @return true -- the key is in the hash
+ */
+template <class Key>
+bool ExtendibleHash<Key>::find(const Key &key, long &value) {
+    unsigned long hash = hashOf(key);
+    long pageId = directory[hash & ((1UL << header.globalDepth) - 1)];
+    bool found = false;
+
+    if (!filter.mayContain(hash)) {
+        filterSkips++;
+        return false;
+    }
+
+    if (!readPage(pageId)) {
+        return false;
+    }
+
+    for (int i = 0; i < bucket()->count; i++) {
+        if (entries()[i].key == key && (!found || entries()[i].value < value)) {
+            value = entries()[i].value;
+            found = true;
+        }
+    }
+
+    if (!chains.empty() && chains.count(pageId)) {
+        vector<long> &chain = chains[pageId];
+
+        for (size_t c = 0; c < chain.size() && readPage(chain[c]); c++) {
+            for (int i = 0; i < bucket()->count; i++) {
+                if (entries()[i].key == key && (!found || entries()[i].value < value)) {
+                    value = entries()[i].value;
+                    found = true;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+/**
+ * @brief removes one key value pair
+ *
+ * @return true -- the pair was in the hash
+ */
+template <class Key>
+bool ExtendibleHash<Key>::erase(const Key &key, long value) {
+    long pageId = directory[hashOf(key) & ((1UL << header.globalDepth) - 1)];
+    vector<long> pages(1, pageId);
+
+    if (chains.count(pageId)) {
+        pages.insert(pages.end(), chains[pageId].begin(), chains[pageId].end());
+    }
+
+    for (size_t p = 0; p < pages.size(); p++) {
+        if (!readPage(pages[p])) {
+            return false;
+        }
+
+        for (int i = 0; i < bucket()->count; i++) {
+            if (entries()[i].key == key && entries()[i].value == value) {
+                entries()[i] = entries()[--bucket()->count];
+                header.count--;
+
+                return writePage(pages[p]);
+            }
+        }
+    }
+
+    return false;
+}
+
+#endif
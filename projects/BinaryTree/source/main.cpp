@@ -13,8 +13,23 @@
  *          the key for a database along with the location of the record
  *          in the database file.
  * 
- *      We will use a binary tree to store the key and a linked list to 
- *          store the location of free space in the index file.
+ *      The blocks of an index file belong to a MemoryManager, which reads
+ *          and writes them on any BlockStorage, directly or through a
+ *          BufferPool of pages. A bitmap BlockAllocator keeps track of the
+ *          free blocks, and a WriteAheadLog makes a group of block writes
+ *          one transaction that survives a crash.
+ * 
+ *      On top of it sits a binary tree of TreeNodes, plain or kept balanced
+ *          as an AVL tree, with a TreeCursor for range scans. The FreeListNode
+ *          of the first version is still here, as a stack of locations.
+ * 
+ *      IntIndex and LsmIndex are the KeyIndex engines an index is opened
+ *          with. IntIndex is a B+tree in pages of its own file, LsmIndex a
+ *          log structured merge tree of sorted runs. Both turn away most
+ *          absent keys with a BloomFilter. HashIndex, the ExtendibleHash of
+ *          long keys, answers exact lookups in one page read.
+ * 
+ *      Running the program runs the test of every part.
  * 
  * @version 0.1
  * @date 2023-03-14
@@ -28,18 +43,30 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <climits>
+#include <random>
+#include <thread>
 #include <sys/stat.h>
 #include "main.h"
 
 using namespace std;
 
 bool TreeNodeTest();
+bool BalancedTreeNodeTest();
+bool TreeCursorTest();
+bool MappedMemoryManagerTest();
+bool HashIndexTest();
+bool WriteAheadLogTest();
 bool FreeListNodeTest();
+bool BlockStorageTest();
+bool AsyncIOTest();
+bool BufferPoolTest();
+bool BlockAllocatorTest();
 bool IntIndexTest();
+bool LsmIndexTest();
 bool MemoryManagerTest();
 
-MemoryManager *mm;
-
 
 DBException::DBException(string msg) {
     cerr << highlightRed("DBException: " + msg);
@@ -50,23 +77,23 @@ string DBException::message() {
     return errorMessage;
 }
 
-void FreeListNode::init(long memLocation, long nextLocation = -1) {
+void FreeListNode::init(MemoryManager *mm, long memLocation, long nextLocation = -1) {
     type = FREE;
     location = memLocation;
     this->nextLocation = nextLocation;
     mm->writeAt(location, *this);
 }
 
-void FreeListNode::push(int newLocation) {
+void FreeListNode::push(MemoryManager *mm, int newLocation) {
     FreeListNode newNode;
-    newNode.init(newLocation, nextLocation);
+    newNode.init(mm, newLocation, nextLocation);
     nextLocation = newLocation;
     mm->writeAt(newLocation, newNode);
     mm->writeAt(location, *this);
 }
 
 
-int FreeListNode::pop() {
+int FreeListNode::pop(MemoryManager *mm) {
     IndexRecord newNode;
     int result = nextLocation;
 
@@ -93,19 +120,20 @@ long FreeListNode::getNextLocation() {
     return nextLocation;
 };
 
-void TreeNode::init(long memLocation, bool root = true) {
+void TreeNode::init(MemoryManager *mm, long memLocation, bool root = true) {
     type = INVALID;
     location = memLocation;
+    height = 0;
     key = -1;
     value = -1;
     leftLocation = -1;
     rightLocation = -1;
 
-    save();
+    save(mm);
     setRoot(root);
 }   
 
-void TreeNode::init(long memLocation, long key, long value, long left = -1, long right = -1) {
+void TreeNode::init(MemoryManager *mm, long memLocation, long key, long value, long left = -1, long right = -1) {
     if (memLocation < 0) {
         throw DBException("Cannot initialize node at negative location");
     } else if (memLocation == 0) {
@@ -113,6 +141,8 @@ void TreeNode::init(long memLocation, long key, long value, long left = -1, long
     }
 
     type = OCCUPIED;
+    root = false;
+    height = 1;
     this->key = key;
     this->value = value;
     
@@ -138,7 +168,7 @@ bool TreeNode::isLeaf() {
     return leftLocation < 0 && rightLocation < 0;
 }
 
-void TreeNode::save() {
+void TreeNode::save(MemoryManager *mm) {
     mm->writeAt(location, *this);
 }
 
@@ -158,12 +188,17 @@ long TreeNode::getRightLocation() {
     return rightLocation;
 }
 
+int TreeNode::getHeight() {
+    return height;
+}
+
 bool TreeNode::isValid() {
     return type == OCCUPIED;
 }
 
-void TreeNode::invalidate() {
+void TreeNode::invalidate(MemoryManager *mm) {
     type = INVALID;
+    height = 0;
     key = -1;
     value = -1;
     leftLocation = -1;
@@ -177,198 +212,144 @@ void TreeNode::copy(TreeNode &node) {
     key = node.getKey();
     value = node.getValue();
     type = node.type;
+    height = node.height;
     leftLocation = node.getLeftLocation();
     rightLocation = node.getRightLocation();
     // leaf = node.isLeaf();
 
     // cout << "Copied node " << key << " from " << node.getKey() << endl;
-
-    save();
-    // cout << "Copied node " << key << " from " << node.getKey() << endl;
 }
 
-void TreeNode::freeNode() {
+void TreeNode::freeNode(MemoryManager *mm) {
     if (root) {
-        invalidate();
+        invalidate(mm);
     } else {
         mm->freeLocation(location);
     }
 }
 
-void TreeNode::from(long memLocation) {
+void TreeNode::from(MemoryManager *mm, long memLocation) {
     mm->readAt(memLocation, *this);
 }
 
 /**
  * @brief Add a new key value pair to the tree
  * 
+ * Walks down from this node without writing anything. Only the node that
+ *      changes is saved, so an update is one block write and an insert is
+ *      two, the new leaf and its parent, whatever the depth.
+ * 
  * @param newKey 
  * @param newValue 
  */
-void TreeNode::add(long newKey, long newValue) {
+void TreeNode::add(MemoryManager *mm, long newKey, long newValue) {
+    IndexRecord current;
+    TreeNode *at = this;
+
     if (!isValid() && root) {
         key = newKey;
         value = newValue;
         type = OCCUPIED;
-        save();
+        save(mm);
+        return;
+    }
 
-    } else if (key == newKey) {
-        value = newValue;
-        save();        
+    while (at->key != newKey) {
+        long *child = at->key > newKey? &at->leftLocation: &at->rightLocation;
 
-    } else if (key > newKey) {
-        if (leftLocation < 0) {
-            leftLocation = mm->getNextFreeLocation();
+        if (*child < 0) {
             TreeNode newNode;
-            newNode.init(leftLocation, newKey, newValue);
-            // leaf = false;
-        } else {
-            IndexRecord newNode;
-            mm->readAt(leftLocation, newNode);
-            newNode.treeNode.add(newKey, newValue);
-        }
 
-        save();        
-        
-    } else if (key < newKey) {
-        if (rightLocation < 0) {
-            rightLocation = mm->getNextFreeLocation();
-            TreeNode newNode;
-            newNode.init(rightLocation, newKey, newValue);
-            // leaf = false;
-        } else {
-            IndexRecord newNode;
-            mm->readAt(rightLocation, newNode);
-            newNode.treeNode.add(newKey, newValue);
+            *child = mm->getNextFreeLocation(at->location);
+            newNode.init(mm, *child, newKey, newValue);
+            at->save(mm);
+            return;
         }
 
-        save();
+        mm->readAt(*child, current);
+        at = &current.treeNode;
     }
+
+    at->value = newValue;
+    at->save(mm);
 }
 
 
 /**
  * @brief Function will add a tree node and its children to the current node
  * 
+ * The walk down to where node belongs writes nothing. Every node below 
+ *      this one that changes is saved, this node is left for the caller,
+ *      which may have changed it too and can then save it once.
+ * 
  * @param node 
+ * @return true -- this node changed and has not been saved
  */
-void TreeNode::addNode(TreeNode &node) {
-    
+bool TreeNode::addNode(MemoryManager *mm, TreeNode &node) {
+    IndexRecord current;
+    TreeNode *at = this;
+
     // Case 1: empty tree and current node is root
     if (!isValid() && root) { 
         copy(node);
-        node.freeNode();
-
-
-    // Case 2: key already exists and node is a leaf
-    } else if (key == node.getKey() && node.getLeftLocation() < 0 && node.getRightLocation() < 0) {  
-        value = node.getValue();
-
-        node.freeNode();
-
-    // Case 3: key already exists and input node has a right child
-    } else if (key == node.getKey() && node.getLeftLocation() < 0) { 
-        // set current nodes values to input node, except for children locations
-        value = node.getValue();
-
-        // now we check to see if the current node has a right child
-        if (rightLocation < 0) { // if not, we just set the right child to the input nodes right child
-            rightLocation = node.getRightLocation();
-
-        } else { // if so, we add the input nodes right child to the current nodes right child
-            IndexRecord nodeRight, currentRight;
-
-            mm->readAt(node.getRightLocation(), nodeRight);
-            mm->readAt(rightLocation, currentRight);
-
-            currentRight.treeNode.addNode(nodeRight.treeNode);
-            node.freeNode();
-        }
-        
-    // Case 4: key already exists and input node has a left child
-    } else if (key == node.getKey() && node.getRightLocation() < 0) { 
-        // set current nodes values to input node, except for children locations
-        value = node.getValue();
-
-        // now we check to see if the current node has a left child
-        if (leftLocation < 0) { // if not, we just set the left child to the input nodes left child
-            leftLocation = node.getLeftLocation();
-
-        } else { // if so, we add the input nodes left child to the current nodes left child
-            IndexRecord nodeLeft, currentLeft;
+        node.freeNode(mm);
+        return true;
+    }
 
-            mm->readAt(node.getLeftLocation(), nodeLeft);
-            mm->readAt(leftLocation, currentLeft);
+    // Case 6 and 7: the input node goes on the left or right side, follow that side down until it is free
+    while (at->key != node.getKey()) {
+        long *child = at->key > node.getKey()? &at->leftLocation: &at->rightLocation;
 
-            currentLeft.treeNode.addNode(nodeLeft.treeNode);
-            node.freeNode();
+        if (*child < 0) {
+            *child = node.getLocation();
+            break;
         }
 
+        mm->readAt(*child, current);
+        at = &current.treeNode;
+    }
 
-    // Case 5: key already exists and input node has both children
-    } else if (key == node.getKey()) { 
-        // set current nodes values to input node, except for children locations
-        value = node.getValue();
+    // Case 2 to 5: key already exists, take its value and merge each of its subtrees into ours
+    if (at->key == node.getKey()) {
+        at->value = node.getValue();
 
-        // now we check to see if the current node has a left child
-        if (leftLocation < 0) {
-            leftLocation = node.getLeftLocation();
+        if (node.getLeftLocation() >= 0 && at->leftLocation < 0) {
+            at->leftLocation = node.getLeftLocation();
 
-        } else {
+        } else if (node.getLeftLocation() >= 0) {
             IndexRecord nodeLeft, currentLeft;
 
             mm->readAt(node.getLeftLocation(), nodeLeft);
-            mm->readAt(leftLocation, currentLeft);
+            mm->readAt(at->leftLocation, currentLeft);
 
-            currentLeft.treeNode.addNode(nodeLeft.treeNode);
-            node.freeNode();
+            if (currentLeft.treeNode.addNode(mm, nodeLeft.treeNode)) {
+                currentLeft.treeNode.save(mm);
+            }
         }
 
-        // now we check to see if the current node has a right child
-        if (rightLocation < 0) {
-            rightLocation = node.getRightLocation();
+        if (node.getRightLocation() >= 0 && at->rightLocation < 0) {
+            at->rightLocation = node.getRightLocation();
 
-        } else {
+        } else if (node.getRightLocation() >= 0) {
             IndexRecord nodeRight, currentRight;
 
             mm->readAt(node.getRightLocation(), nodeRight);
-            mm->readAt(rightLocation, currentRight);
-
-            currentRight.treeNode.addNode(nodeRight.treeNode);
-            node.freeNode();
-        }
-
-    // Case 6: input node key is less than current node key, goes on left side
-    } else if (key > node.getKey()) { 
-    
-        if (leftLocation < 0) {
-            leftLocation = node.getLocation();
-            // leaf = false;
-
-        } else {
-            IndexRecord newNode;
+            mm->readAt(at->rightLocation, currentRight);
 
-            mm->readAt(leftLocation, newNode);
-            
-            newNode.treeNode.addNode(node);
+            if (currentRight.treeNode.addNode(mm, nodeRight.treeNode)) {
+                currentRight.treeNode.save(mm);
+            }
         }
 
-    // Case 7: input node key is greater than current node key, goes on right side
-    } else if (key < node.getKey()) { 
-
-        if (rightLocation < 0) {
-            rightLocation = node.getLocation();
-            // leaf = false;
-        } else {
-            IndexRecord newNode;
-
-            mm->readAt(rightLocation, newNode);
+        node.freeNode(mm);
+    }
 
-            newNode.treeNode.addNode(node);
-        }
+    if (at != this) {
+        at->save(mm);
+        return false;
     }
 
-    save();
+    return true;
 }
 
 /**
@@ -377,911 +358,7859 @@ void TreeNode::addNode(TreeNode &node) {
  * Note: if a non-root node is deleted, we will give the location 
  *          back to the free list
  *        if a root node is deleted, we will invalidate it
- *        
+ * 
+ * Walks down from this node without writing anything, then saves only 
+ *      the nodes the delete changed, one or two blocks whatever the depth.
  * 
  * @param key 
  * @return true -- only if key == this->key and this node is a leaf 
  */
-bool TreeNode::del(long key) {
-    bool result = false; 
+bool TreeNode::del(MemoryManager *mm, long key) {
+    IndexRecord parentRecord, current;
+    TreeNode *parent = NULL, *at = this;
 
-    // cout << "Delete\tkey: " << key << " from node: " << location << " with key: " << this->key << endl;
+    while (at->key != key) {
+        long child = key < at->key? at->leftLocation: at->rightLocation;
 
-    if (this->key == key) {
-        
-        // Case 1: root node with no children
-        if (leftLocation < 0 && rightLocation < 0 && root) { 
-            // cout << "Case 1: root node with no children" << endl;
+        if (child < 0 && key < at->key) {
+            throw DBException("Cannot delete key from node with no left child, key does not exist");
+        } else if (child < 0) {
+            throw DBException("Cannot delete key from node with no right child, key does not exist");
+        }
 
-            freeNode();
-            result = true;
-            
-        // Case 2: non-root node with no children
-        } else if (leftLocation < 0 && rightLocation < 0) { 
-            // cout << "Case 2: non-root node with no children" << endl;
+        if (at == this) {
+            parent = this;
+        } else {
+            parentRecord = current;
+            parent = &parentRecord.treeNode;
+        }
 
-            freeNode();
-            result = true;
+        mm->readAt(child, current);
+        at = &current.treeNode;
+    }
 
-        // Case 3: current node only has right child
-        } else if (leftLocation < 0) { 
-            IndexRecord rightNode;
-            // cout << "Case 3: current node only has right child" << endl;
+    // Case 1 and 2: no children, a root is invalidated and anything else goes back to the free list
+    if (at->leftLocation < 0 && at->rightLocation < 0) { 
+        at->freeNode(mm);
 
-            rightNode.treeNode.from(rightLocation);
-            copy(rightNode.treeNode);
+        if (parent != NULL) {
+            if (parent->leftLocation == at->location) {
+                parent->leftLocation = -1;
+            } else {
+                parent->rightLocation = -1;
+            }
 
-            rightNode.treeNode.freeNode();
-            save();
-            
-        // Case 4: current node only has left child
-        } else if (rightLocation < 0) { 
-            IndexRecord leftNode;
-            // cout << "Case 4: current node only has left child" << endl;
+            parent->save(mm);
+        }
 
-            leftNode.treeNode.from(leftLocation);
-            copy(leftNode.treeNode);
+        return at == this;
 
-            leftNode.treeNode.freeNode();
-            save();
+    // Case 3 and 4: one child, which takes this node's place
+    } else if (at->leftLocation < 0 || at->rightLocation < 0) { 
+        IndexRecord child;
 
-        // Case 5: current node has two children
-        } else { 
-            IndexRecord leftNode, rightNode;
-            // cout << "Case 5: current node has two children" << endl;
+        child.treeNode.from(mm, at->leftLocation < 0? at->rightLocation: at->leftLocation);
+        at->copy(child.treeNode);
+        at->save(mm);
+        child.treeNode.freeNode(mm);
 
-            leftNode.treeNode.from(leftLocation);
-            rightNode.treeNode.from(rightLocation);
+    // Case 5: two children, the left child takes this node's place and the right subtree hangs under it
+    } else { 
+        IndexRecord leftNode, rightNode;
 
-            leftNode.treeNode.addNode(rightNode.treeNode);
-            copy(leftNode.treeNode);
-            save();
-        }
+        leftNode.treeNode.from(mm, at->leftLocation);
+        rightNode.treeNode.from(mm, at->rightLocation);
 
-    } else if (key < this->key) {
-        // cout << "Case 6: current node key > input key" << endl;
+        at->copy(leftNode.treeNode);
+        leftNode.treeNode.freeNode(mm);
+        at->addNode(mm, rightNode.treeNode);
+        at->save(mm);
+    }
 
-        // case 1: current node has no left child
-        if (leftLocation < 0) { 
-            throw DBException("Cannot delete key from node with no left child, key does not exist");
-        
-        // case 2: current node has left child
-        } else {
+    return false;
+}
 
-            IndexRecord leftNode;
-            bool tempResult = false;
-            mm->readAt(leftLocation, leftNode);
 
-            tempResult = leftNode.treeNode.del(key);
+/**
+ * @brief reads the AVL height of the node at location, a missing child has height 0
+ * 
+ * @param location 
+ * @return int 
+ */
+int TreeNode::heightAt(MemoryManager *mm, long location) {
+    TreeNode node;
 
-            if(tempResult) {
-                this->leftLocation = -1;
-            }
-            
-            save();
-        }
-        
-    } else if (key > this->key) {
-        // cout << "Case 7: current node key < input key" << endl;
+    if (location < 0) {
+        return 0;
+    }
 
-        // case 1: current node has no right child
-        if (rightLocation < 0) { 
-            throw DBException("Cannot delete key from node with no right child, key does not exist");
-        
-        // case 2: current node has right child
-        } else {
+    mm->readAt(location, node);
+    return node.height;
+}
 
-            IndexRecord rightNode;
-            bool tempResult = false;
-            mm->readAt(rightLocation, rightNode);
+void TreeNode::updateHeight(MemoryManager *mm) {
+    height = 1 + max(heightAt(mm, leftLocation), heightAt(mm, rightLocation));
+}
 
-            tempResult = rightNode.treeNode.del(key);
+/**
+ * @brief rotates the subtree rooted here to the left
+ * 
+ * Rather than relinking the parent, the right child's contents move up into
+ *      this location and this node's contents move down into the right child's
+ *      location. The subtree keeps its location, so the parent (and the root 
+ *      at location 1) never has to be rewritten, and only two blocks change.
+ * 
+ *        A:x                 A:y
+ *       /   \               /   \
+ *      a    B:y     ->    B:x    c
+ *          /   \         /   \
+ *         b     c       a     b
+ */
+void TreeNode::rotateLeft(MemoryManager *mm) {
+    IndexRecord pivot, lowered;
+    long pivotLocation = rightLocation;
+
+    pivot.treeNode.from(mm, pivotLocation);
+
+    lowered.treeNode = *this;
+    lowered.treeNode.location = pivotLocation;
+    lowered.treeNode.root = false;
+    lowered.treeNode.rightLocation = pivot.treeNode.getLeftLocation();
+    lowered.treeNode.updateHeight(mm);
+    lowered.treeNode.save(mm);
+
+    key = pivot.treeNode.getKey();
+    value = pivot.treeNode.getValue();
+    leftLocation = pivotLocation;
+    rightLocation = pivot.treeNode.getRightLocation();
+    height = 1 + max((int) lowered.treeNode.height, heightAt(mm, rightLocation));
+    save(mm);
+}
 
-            if(tempResult) {
-                this->rightLocation = -1;
-            }
+/**
+ * @brief mirror image of rotateLeft
+ */
+void TreeNode::rotateRight(MemoryManager *mm) {
+    IndexRecord pivot, lowered;
+    long pivotLocation = leftLocation;
+
+    pivot.treeNode.from(mm, pivotLocation);
+
+    lowered.treeNode = *this;
+    lowered.treeNode.location = pivotLocation;
+    lowered.treeNode.root = false;
+    lowered.treeNode.leftLocation = pivot.treeNode.getRightLocation();
+    lowered.treeNode.updateHeight(mm);
+    lowered.treeNode.save(mm);
+
+    key = pivot.treeNode.getKey();
+    value = pivot.treeNode.getValue();
+    leftLocation = pivot.treeNode.getLeftLocation();
+    rightLocation = pivotLocation;
+    height = 1 + max(heightAt(mm, leftLocation), (int) lowered.treeNode.height);
+    save(mm);
+}
 
-            save();
-        }
-    }
+/**
+ * @brief restores the AVL property at this node after one of its subtrees changed height by one
+ */
+void TreeNode::rebalance(MemoryManager *mm) {
+    int leftHeight = heightAt(mm, leftLocation);
+    int rightHeight = heightAt(mm, rightLocation);
 
-    return result;
-}
+    if (leftHeight - rightHeight > 1) {
+        IndexRecord leftNode;
+        leftNode.treeNode.from(mm, leftLocation);
+
+        // left-right case, straighten the left subtree first
+        if (heightAt(mm, leftNode.treeNode.getLeftLocation()) < heightAt(mm, leftNode.treeNode.getRightLocation())) {
+            leftNode.treeNode.rotateLeft(mm);
+        }
 
+        rotateRight(mm);
 
-/* ************************ untested and uninspected code below ************************ */
-void TreeNode::destroy() {
+    } else if (rightHeight - leftHeight > 1) {
+        IndexRecord rightNode;
+        rightNode.treeNode.from(mm, rightLocation);
 
-}
+        // right-left case, straighten the right subtree first
+        if (heightAt(mm, rightNode.treeNode.getRightLocation()) < heightAt(mm, rightNode.treeNode.getLeftLocation())) {
+            rightNode.treeNode.rotateRight(mm);
+        }
 
+        rotateLeft(mm);
 
+    } else {
+        height = 1 + max(leftHeight, rightHeight);
+        save(mm);
+    }
+}
 
+/**
+ * @brief Add a key value pair to the tree, rotating on the way back up so the
+ *      tree stays AVL balanced
+ * 
+ * @param newKey 
+ * @param newValue 
+ */
+void TreeNode::addBalanced(MemoryManager *mm, long newKey, long newValue) {
+    if (!isValid() && root) {
+        key = newKey;
+        value = newValue;
+        type = OCCUPIED;
+        height = 1;
+        save(mm);
+        return;
 
+    } else if (key == newKey) {
+        value = newValue;
+        save(mm);
+        return;
+    }
 
-void MemoryManager::checkFile() {
-    cout << "Start\tMemoryManager::checkFile()" << endl;
+    long &childLocation = key > newKey? leftLocation: rightLocation;
 
-    if (file->is_open()) {
-        cout << "Check\tFile is open" << endl;
+    if (childLocation < 0) {
+        TreeNode newNode;
+        childLocation = mm->getNextFreeLocation(location);
+        newNode.init(mm, childLocation, newKey, newValue);
     } else {
-        cout << "Check\tFile is not open" << endl;
+        IndexRecord child;
+        mm->readAt(childLocation, child);
+        child.treeNode.addBalanced(mm, newKey, newValue);
     }
 
-    cout << "End\tMemoryManager::checkFile()" << endl;
+    rebalance(mm);
 }
 
-MemoryManager::MemoryManager(string fileName) {
-    struct stat s;
-    ofstream t;
-
-    this->fileName = fileName;
-    blockSize = sizeof(IndexRecord);
-    hasFreeListHead = false;
-    hasTreeRoot = false;
+/**
+ * @brief Delete a key value pair from an AVL balanced tree
+ * 
+ * A node with two children takes the key of its in-order successor, which is 
+ *      then deleted from the right subtree. A node with one child pulls that 
+ *      child up into its own location.
+ * 
+ * @param delKey 
+ * @return true -- only if this node's location was given up and the parent must drop its pointer
+ */
+bool TreeNode::delBalanced(MemoryManager *mm, long delKey) {
+    if (!isValid()) {
+        throw DBException("Cannot delete key from an empty tree, key does not exist");
+    }
 
-    cout << "Create\tMemory Manager" << endl;
+    if (delKey != key) {
+        long &childLocation = key > delKey? leftLocation: rightLocation;
+        IndexRecord child;
 
-    if (stat(fileName.c_str(), &s) != 0) {
-        cout << "Create\tfile: " << fileName << endl;
-        t.open(fileName.c_str());
-        t.close();
+        if (childLocation < 0) {
+            throw DBException("Cannot delete key " + to_string(delKey) + ", key does not exist");
+        }
 
-        file = new fstream;
-        file->open(fileName);
-        
-        checkFile();
+        mm->readAt(childLocation, child);
 
-    } else {
-        cout << "Opening file: " << fileName << endl;
-        file = new fstream(fileName.c_str());
-        file->open(fileName);
+        if (child.treeNode.delBalanced(mm, delKey)) {
+            childLocation = -1;
+        }
 
-        checkFile();
+        rebalance(mm);
+        return false;
     }
-}
 
+    // Case 1: no children
+    if (leftLocation < 0 && rightLocation < 0) {
+        freeNode(mm);
+        return true;
 
+    // Case 2: one child, which in an AVL tree is a leaf
+    } else if (leftLocation < 0 || rightLocation < 0) {
+        IndexRecord child;
 
-MemoryManager::~MemoryManager() {
-    cout << "Destroy\tMemory Manager" << endl;
-    file->close();
-    delete file;
-}
+        child.treeNode.from(mm, leftLocation < 0? rightLocation: leftLocation);
+        copy(child.treeNode);
+        save(mm);
+        child.treeNode.freeNode(mm);
 
-int MemoryManager::getBlockSize() {
-    return blockSize;
-}
+        return false;
 
-void MemoryManager::writeAt(int location, IndexRecord record) {
-    if (location >= 0) {
-        file->seekp(location * blockSize);
-        file->write((char*) (&record), blockSize);
+    // Case 3: two children
     } else {
-        throw DBException("Invalid location");
+        IndexRecord successor, rightNode;
+
+        successor.treeNode.from(mm, rightLocation);
+
+        while (successor.treeNode.getLeftLocation() >= 0) {
+            successor.treeNode.from(mm, successor.treeNode.getLeftLocation());
+        }
+
+        key = successor.treeNode.getKey();
+        value = successor.treeNode.getValue();
+
+        rightNode.treeNode.from(mm, rightLocation);
+
+        if (rightNode.treeNode.delBalanced(mm, key)) {
+            rightLocation = -1;
+        }
+
+        rebalance(mm);
+        return false;
     }
 }
 
-void MemoryManager::writeAt(int location, FreeListNode fln) {
-    if (location >= 0) {
-        file->seekp(location * blockSize);
-        file->write((char*) (&fln), blockSize);
-    } else {
-        throw DBException("Invalid location");
+/**
+ * @brief verifies ordering, stored heights and the AVL property below location
+ * 
+ * @return int -- the height of the subtree, or -1 if anything is wrong
+ */
+int TreeNode::checkSubtree(MemoryManager *mm, long location, long low, long high) {
+    TreeNode node;
+    int leftHeight, rightHeight;
+
+    if (location < 0) {
+        return 0;
     }
-}
 
-void MemoryManager::writeAt(int location, TreeNode tn) {
-    if (location >= 0) {
-        file->seekp(location * blockSize);
-        file->write((char*) (&tn), blockSize);
-    } else {
-        throw DBException("Invalid location");
+    mm->readAt(location, node);
+
+    if (!node.isValid() || node.key <= low || node.key >= high) {
+        return -1;
     }
-}
 
-void MemoryManager::readAt(int location, IndexRecord &record) {
-    if (location >= 0) {
-        file->seekg(location * blockSize);
-        file->read((char*) (&record), blockSize);
-    } else {
-        throw DBException("Invalid location");
+    leftHeight = checkSubtree(mm, node.leftLocation, low, node.key);
+    rightHeight = checkSubtree(mm, node.rightLocation, node.key, high);
+
+    if (leftHeight < 0 || rightHeight < 0 || abs(leftHeight - rightHeight) > 1) {
+        return -1;
+    } else if (node.height != 1 + max(leftHeight, rightHeight)) {
+        return -1;
     }
+
+    return node.height;
 }
 
-void MemoryManager::readAt(int location, FreeListNode &fln) {
-    if (location >= 0) {
-        file->seekg(location * blockSize);
-        file->read((char*) (&fln), sizeof(FreeListNode));
-        // file->read((char*) (&fln), blockSize);
-    } else {
-        throw DBException("Invalid location");
+bool TreeNode::isBalanced(MemoryManager *mm) {
+    if (!isValid()) {
+        return isLeaf();
     }
+
+    return checkSubtree(mm, location, LONG_MIN, LONG_MAX) == height;
 }
 
-void MemoryManager::readAt(int location, TreeNode &tn) {
-    if (location >= 0) {
-        file->seekg(location * blockSize);
-        file->read((char*) (&tn), sizeof(TreeNode));
-        // file->read((char*) (&tn), blockSize);
-    } else {
-        throw DBException("Invalid location");
+
+/**
+ * @brief finds the value stored under searchKey, walking down from this node
+ * 
+ * @param searchKey 
+ * @return long -- the value, or -1 if the key is not in the tree
+ */
+long TreeNode::findByKey(MemoryManager *mm, long searchKey) {
+    TreeNode copy = *this;
+    TreeNode *node = &copy;
+    bool mapped = mm->isMapped();
+    long next;
+
+    while (node->isValid()) {
+        if (node->key == searchKey) {
+            return node->value;
+        }
+
+        next = node->key > searchKey? node->leftLocation: node->rightLocation;
+
+        if (next < 0) {
+            break;
+        } else if (mapped) {
+            node = mm->nodeAt(next);    // straight into the mapping, nothing is copied
+        } else {
+            mm->readAt(next, copy);
+        }
     }
+
+    return -1;
 }
 
-void MemoryManager::FreeListInit() {
-    if (!hasFreeListHead) {
-        FreeListHead.freeNode.init(0);
-        hasFreeListHead = true;
-    } else {
-        throw DBException("Free List already initialized");
-    }
+
+TreeCursor::TreeCursor(MemoryManager *mm, long rootLocation) {
+    this->mm = mm;
+    this->rootLocation = rootLocation;
+    seek(LONG_MIN);
 }
 
-int MemoryManager::getSize() {
-    file->seekg(0, ios::end);
-    int size = file->tellg();
-    return size;
+bool TreeCursor::isValid() {
+    return !stack.empty();
 }
 
-int MemoryManager::getNumLocations() {
-    return getSize() / blockSize;
+long TreeCursor::getKey() {
+    if (stack.empty()) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    return stack.back().getKey();
 }
 
+long TreeCursor::getValue() {
+    if (stack.empty()) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    return stack.back().getValue();
+}
 
 /**
- * @brief returns the next free location in the file
- * 
- * Danger!! This function is destructive!!!!!!!!!!!!!
- * Do not use outside of the Binary Tree class
- * 
- * If the result is not used to write to the file, the location will be lost.
+ * @brief pushes location and its chain of left children, leaving the smallest key on top
  * 
- * @return long 
+ * @param location 
  */
-long MemoryManager::getNextFreeLocation() {
-    long result = -1;
+void TreeCursor::pushLeft(long location) {
+    TreeNode node;
 
-    if (FreeListHead.freeNode.isEmpty()) {
-        result = getNumLocations();
-    } else {
-        result = FreeListHead.freeNode.pop();
+    while (location >= 0) {
+        mm->readAt(location, node);
+        stack.push_back(node);
+        location = node.getLeftLocation();
     }
+}
 
-    if (result < 0) {
-        throw DBException("Memory Manager gave invalid location");
+/**
+ * @brief prefetches the right children of the next few nodes on the stack,
+ *      those are the blocks the cursor moves into after each of them
+ */
+void TreeCursor::readAhead() {
+    int depth = stack.size();
+    vector<long> locations;
+
+    for (int i = depth - 1; i >= 0 && i >= depth - READ_AHEAD; i--) {
+        locations.push_back(stack[i].getRightLocation());
     }
 
-    return result;
+    mm->prefetch(locations);
 }
 
 /**
- * @brief function will free a location in the file
- * 
- * Danger!! This function is destructive!!!!!!!!!!!!!
- * Do not use outside of the Binary Tree class
+ * @brief positions the cursor on the smallest key >= lowKey
  * 
- * if the result passed in is already in the free list or is currently being used by
- *      the tree, undefined behavior will occur
+ * Every node on the path down whose key is >= lowKey is still to be 
+ *      visited, so it goes on the stack. The rest are skipped with 
+ *      their left subtrees.
  * 
- * @param location 
+ * @param lowKey 
  */
-void MemoryManager::freeLocation(long location) {
-    if (location == 0 && hasFreeListHead) {
-        throw DBException("Cannot free head node of the free list");
-    } else if (location == 1 && hasFreeListHead) {
-        throw DBException("Cannot free root node of the tree");
-    } else if (location < 0) {
-        throw DBException("Cannot free invalid location");
+void TreeCursor::seek(long lowKey) {
+    TreeNode node;
+    long location = rootLocation;
+
+    stack.clear();
+
+    while (location >= 0) {
+        mm->readAt(location, node);
+
+        if (!node.isValid()) { // an empty root
+            break;
+        } else if (node.getKey() >= lowKey) {
+            stack.push_back(node);
+            location = node.getLeftLocation();
+        } else {
+            location = node.getRightLocation();
+        }
     }
 
-    FreeListHead.freeNode.push(location);
+    readAhead();
 }
 
+/**
+ * @brief moves the cursor to the next key in order
+ */
+void TreeCursor::next() {
+    long right;
 
-/* ***************************************************** */
-/*                          Main                        */
-/* ***************************************************** */
+    if (stack.empty()) {
+        throw DBException("Cursor is past the last key");
+    }
 
-int main(int argc, char const *argv[]) {
-    string fileName = "IntIndex.idx";
+    right = stack.back().getRightLocation();
+    stack.pop_back();
+    pushLeft(right);
+    readAhead();
+}
 
-    if (argc > 1) {
-        fileName = argv[1];
-    }
+
+/* ************************ untested and uninspected code below ************************ */
+void TreeNode::destroy() {
+
+}
+
+
+
+
+
+void MemoryManager::checkFile() {
+    cout << "Start\tMemoryManager::checkFile()" << endl;
+
+    if (storage != NULL) {
+        cout << "Check\tFile is open on " << storage->getName() << endl;
+    } else {
+        cout << "Check\tFile is not open" << endl;
+    }
+
+    cout << "End\tMemoryManager::checkFile()" << endl;
+}
+
+AsyncIO::AsyncIO(int fd, int depth) {
+    if (depth <= 0) {
+        throw DBException("Async I/O needs a positive queue depth");
+    }
+
+    this->fd = fd;
+    this->depth = depth;
+    inFlight = 0;
+    maxInFlight = 0;
+    submitted = 0;
+}
+
+AsyncIO::~AsyncIO() {
+}
+
+int AsyncIO::getDepth() {
+    return depth;
+}
+
+int AsyncIO::getMaxInFlight() {
+    return maxInFlight;
+}
+
+long AsyncIO::getSubmitted() {
+    return submitted;
+}
+
+void AsyncIO::started() {
+    inFlight++;
+    submitted++;
+    maxInFlight = max(maxInFlight, inFlight);
+}
+
+/**
+ * @brief puts every request in flight, as many at once as the depth allows, and waits for them all
+ * 
+ * A read may come back short at the end of the file, a write has to move 
+ *      every byte. The first request that failed is reported once the 
+ *      whole batch is back.
+ * 
+ * @param requests 
+ */
+void AsyncIO::run(vector<IORequest> &requests) {
+    size_t next = 0, finished = 0;
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        requests[i].done = false;
+    }
+
+    while (finished < requests.size()) {
+        while (next < requests.size() && inFlight < depth) {
+            submit(&requests[next++]);
+        }
+
+        finished += reap(true);
+    }
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        IORequest &request = requests[i];
+
+        if (request.result < 0 || (request.write && request.result != request.bytes)) {
+            throw DBException(string("Could not ") + (request.write? "write": "read") + " " + to_string(request.bytes) 
+                + " bytes at " + to_string(request.offset) + ": " + (request.result < 0? strerror(-request.result): "short write"));
+        }
+    }
+}
+
+/**
+ * @brief makes the AsyncIO for fd, IO_AUTO falls back to the thread pool when io_uring cannot be set up
+ * 
+ * @param fd 
+ * @param backend 
+ * @param depth 
+ * @return AsyncIO* -- the caller deletes it
+ */
+AsyncIO *AsyncIO::open(int fd, IOBackend backend, int depth) {
+    if (backend == IO_THREAD_POOL) {
+        return new ThreadPoolIO(fd, depth);
+    }
+
+    try {
+        return new UringIO(fd, depth);
+    } catch (DBException &e) {
+        if (backend == IO_URING) {
+            throw;
+        }
+    }
+
+    return new ThreadPoolIO(fd, depth);
+}
+
+UringIO::UringIO(int fd, int depth): AsyncIO(fd, depth) {
+    io_uring_params params;
+    void *ring;
+
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, depth, &params);
+
+    if (ringFd < 0) {
+        throw DBException(string("Could not set up an io_uring: ") + strerror(errno));
+    }
+
+    // the kernel rounds the depth up to a power of two, the completion ring is twice that
+    this->depth = min((unsigned) depth, params.sq_entries);
+    pending = 0;
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = sqRing;
+    sqes = (io_uring_sqe*) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+    if (sqRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    }
+
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        string reason = strerror(errno);
+
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+
+        close(ringFd);
+        throw DBException("Could not map the io_uring: " + reason);
+    }
+
+    ring = sqRing;
+    sqTail = (unsigned*) ((char*) ring + params.sq_off.tail);
+    sqMask = (unsigned*) ((char*) ring + params.sq_off.ring_mask);
+    sqArray = (unsigned*) ((char*) ring + params.sq_off.array);
+
+    ring = cqRing;
+    cqHead = (unsigned*) ((char*) ring + params.cq_off.head);
+    cqTail = (unsigned*) ((char*) ring + params.cq_off.tail);
+    cqMask = (unsigned*) ((char*) ring + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*) ((char*) ring + params.cq_off.cqes);
+}
+
+UringIO::~UringIO() {
+    while (inFlight > 0) {
+        reap(true);
+    }
+
+    munmap(sqes, sqesSize);
+
+    if (cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+
+    munmap(sqRing, sqRingSize);
+    close(ringFd);
+}
+
+string UringIO::getName() {
+    return "io_uring";
+}
+
+void UringIO::submit(IORequest *request) {
+    unsigned tail, index;
+    io_uring_sqe *sqe;
+
+    while (inFlight >= depth) {
+        reap(true);
+    }
+
+    tail = *sqTail;
+    index = tail & *sqMask;
+    sqe = &sqes[index];
+
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = request->write? IORING_OP_WRITE: IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) request->buffer;
+    sqe->len = request->bytes;
+    sqe->off = request->offset;
+    sqe->user_data = (unsigned long) request;
+
+    request->done = false;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    pending++;
+    started();
+}
+
+/**
+ * @brief hands the queued requests to the kernel and collects whatever has completed
+ * 
+ * @param wait -- block until at least one request completes, if any are in flight
+ * @return int -- how many requests completed
+ */
+int UringIO::reap(bool wait) {
+    unsigned head, tail, flags;
+    int reaped = 0;
+
+    wait = wait && inFlight > 0;
+    flags = wait? IORING_ENTER_GETEVENTS: 0;
+
+    while (pending > 0 || wait) {
+        int result = syscall(__NR_io_uring_enter, ringFd, pending, wait? 1: 0, flags, NULL, 0);
+
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0) {
+            throw DBException(string("io_uring_enter failed: ") + strerror(errno));
+        }
+
+        pending -= result;
+        break;
+    }
+
+    head = *cqHead;
+    tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        io_uring_cqe *cqe = &cqes[head & *cqMask];
+        IORequest *request = (IORequest*) cqe->user_data;
+
+        request->result = cqe->res;
+        request->done = true;
+        head++;
+        reaped++;
+    }
+
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    inFlight -= reaped;
+
+    return reaped;
+}
+
+ThreadPoolIO::ThreadPoolIO(int fd, int depth, int threads): AsyncIO(fd, depth) {
+    stopping = false;
+
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(thread(&ThreadPoolIO::work, this));
+    }
+}
+
+ThreadPoolIO::~ThreadPoolIO() {
+    {
+        lock_guard<mutex> lock(latch);
+        stopping = true;
+    }
+
+    queued.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+string ThreadPoolIO::getName() {
+    return "thread pool";
+}
+
+/**
+ * @brief a worker, runs queued requests to completion until the pool stops
+ */
+void ThreadPoolIO::work() {
+    unique_lock<mutex> lock(latch);
+
+    while (true) {
+        queued.wait(lock, [this]() { return stopping || !queue.empty(); });
+
+        if (queue.empty()) {
+            return;
+        }
+
+        IORequest *request = queue.front();
+        long moved = 0, result = 0;
+
+        queue.pop_front();
+        lock.unlock();
+
+        // pread and pwrite may move fewer bytes than asked, keep going until the end of the file
+        while (moved < request->bytes) {
+            if (request->write) {
+                result = pwrite(fd, request->buffer + moved, request->bytes - moved, request->offset + moved);
+            } else {
+                result = pread(fd, request->buffer + moved, request->bytes - moved, request->offset + moved);
+            }
+
+            if (result < 0 && errno == EINTR) {
+                continue;
+            } else if (result <= 0) {
+                break;
+            }
+
+            moved += result;
+        }
+
+        lock.lock();
+        request->result = result < 0? -errno: moved;
+        completed.push_back(request);
+        finished.notify_one();
+    }
+}
+
+void ThreadPoolIO::submit(IORequest *request) {
+    while (inFlight >= depth) {
+        reap(true);
+    }
+
+    request->done = false;
+
+    {
+        lock_guard<mutex> lock(latch);
+        queue.push_back(request);
+    }
+
+    queued.notify_one();
+    started();
+}
+
+int ThreadPoolIO::reap(bool wait) {
+    unique_lock<mutex> lock(latch);
+    int reaped;
+
+    if (wait && inFlight > 0) {
+        finished.wait(lock, [this]() { return !completed.empty(); });
+    }
+
+    for (size_t i = 0; i < completed.size(); i++) {
+        completed[i]->done = true;
+    }
+
+    reaped = completed.size();
+    completed.clear();
+    inFlight -= reaped;
+
+    return reaped;
+}
+
+BufferPool::BufferPool(string fileName, int pageSize, int numFrames, IOBackend backend) {
+    struct stat s;
+
+    if (pageSize <= 0 || numFrames <= 0) {
+        throw DBException("Buffer pool needs a positive page size and frame count");
+    }
+
+    fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0 || fstat(fd, &s) != 0) {
+        throw DBException("Buffer pool could not open " + fileName);
+    }
+
+    io = AsyncIO::open(fd, backend);
+    this->pageSize = pageSize;
+    this->numFrames = numFrames;
+    fileSize = s.st_size;
+    clockHand = 0;
+
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    pageWrites = 0;
+    prefetches = 0;
+
+    frames = new Frame[numFrames];
+
+    for (int i = 0; i < numFrames; i++) {
+        frames[i].pageId = -1;
+        frames[i].pinCount = 0;
+        frames[i].dirty = false;
+        frames[i].referenced = false;
+        frames[i].loading = false;
+        frames[i].data = new char[pageSize];
+    }
+}
+
+BufferPool::~BufferPool() {
+    flushAll();
+
+    for (int i = 0; i < numFrames; i++) {
+        delete [] frames[i].data;
+    }
+
+    delete [] frames;
+    delete io;
+    close(fd);
+}
+
+int BufferPool::getPageSize() {
+    return pageSize;
+}
+
+int BufferPool::getNumFrames() {
+    return numFrames;
+}
+
+long BufferPool::getFileSize() {
+    lock_guard<mutex> lock(latch);
+    return fileSize;
+}
+
+long BufferPool::getHits() {
+    lock_guard<mutex> lock(latch);
+    return hits;
+}
+
+long BufferPool::getMisses() {
+    lock_guard<mutex> lock(latch);
+    return misses;
+}
+
+long BufferPool::getEvictions() {
+    lock_guard<mutex> lock(latch);
+    return evictions;
+}
+
+long BufferPool::getPageWrites() {
+    lock_guard<mutex> lock(latch);
+    return pageWrites;
+}
+
+long BufferPool::getPrefetches() {
+    lock_guard<mutex> lock(latch);
+    return prefetches;
+}
+
+AsyncIO *BufferPool::getIO() {
+    return io;
+}
+
+bool BufferPool::isCached(long pageId) {
+    lock_guard<mutex> lock(latch);
+    return pageTable.count(pageId) > 0;
+}
+
+void BufferPool::extend(long newSize) {
+    lock_guard<mutex> lock(latch);
+
+    if (newSize > fileSize) {
+        fileSize = newSize;
+    }
+}
+
+/**
+ * @brief hook is called before any dirty page is written back
+ * 
+ * A log that does not sync every commit uses it to make its records 
+ *      durable before the pages they describe reach the file.
+ * 
+ * @param hook 
+ */
+void BufferPool::setWriteBackHook(function<void()> hook) {
+    lock_guard<mutex> lock(latch);
+    beforeWriteBack = hook;
+}
+
+/**
+ * @brief loads the frame's page from the file, anything past the end of the file reads as zeros
+ * 
+ * @param frame 
+ */
+void BufferPool::readPage(Frame &frame) {
+    long done = 0;
+
+    memset(frame.data, 0, pageSize);
+
+    // pread and not the AsyncIO, which takes one thread at a time and this runs without the latch
+    while (done < pageSize) {
+        ssize_t bytes = pread(fd, frame.data + done, pageSize - done, frame.pageId * pageSize + done);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0) {
+            throw DBException("Buffer pool could not read page " + to_string(frame.pageId));
+        } else if (bytes == 0) {
+            break;  // the end of the file
+        }
+
+        done += bytes;
+    }
+}
+
+/**
+ * @brief writes the frame's page back to the file, stopping at the logical end of the file
+ * 
+ * @param frame 
+ */
+void BufferPool::writePage(Frame &frame) {
+    vector<int> dirty(1, &frame - frames);
+
+    writeBack(dirty);
+}
+
+/**
+ * @brief the write that puts the frame's page back, stopping at the logical end of the file
+ * 
+ * @param frame 
+ * @return IORequest -- moves no bytes when the page is past the end of the file
+ */
+IORequest BufferPool::writeRequest(Frame &frame) {
+    IORequest request;
+    long start = frame.pageId * pageSize;
+
+    request.write = true;
+    request.buffer = frame.data;
+    request.bytes = max(0L, min((long) pageSize, fileSize - start));
+    request.offset = start;
+
+    return request;
+}
+
+/**
+ * @brief writes the pages of the given frames back all at once and marks them clean
+ * 
+ * @param dirty -- indexes of the frames
+ */
+void BufferPool::writeBack(vector<int> &dirty) {
+    vector<IORequest> writes;
+
+    for (size_t i = 0; i < dirty.size(); i++) {
+        IORequest request = writeRequest(frames[dirty[i]]);
+
+        if (request.bytes > 0) {
+            writes.push_back(request);
+        }
+    }
+
+    if (!writes.empty() && beforeWriteBack) {
+        beforeWriteBack();
+    }
+
+    io->run(writes);
+    pageWrites += writes.size();
+
+    for (size_t i = 0; i < dirty.size(); i++) {
+        frames[dirty[i]].dirty = false;
+    }
+}
+
+/**
+ * @brief picks the frame to reuse with the CLOCK algorithm
+ * 
+ * The hand sweeps the frames, skipping pinned ones and giving recently
+ *      referenced ones a second chance. Two full sweeps without a
+ *      victim means every frame is pinned.
+ * 
+ * @return int index of the frame, or -1 if every frame is pinned
+ */
+int BufferPool::findVictim() {
+    for (int i = 0; i < 2 * numFrames; i++) {
+        Frame &frame = frames[clockHand];
+        int current = clockHand;
+
+        clockHand = (clockHand + 1) % numFrames;
+
+        if (frame.pinCount > 0) {
+            continue;
+        } else if (frame.referenced) {
+            frame.referenced = false;
+        } else {
+            return current;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief gives a page that is not cached a victim frame, pinned and marked loading
+ * 
+ * The victim's old page is written back if it is dirty. The new page is
+ *      in the page table from here on, so a second pin of it waits for
+ *      the read instead of starting its own.
+ * 
+ * @param pageId 
+ * @return int index of the frame, or -1 if every frame is pinned
+ */
+int BufferPool::reserve(long pageId) {
+    int index = findVictim();
+
+    if (index < 0) {
+        return -1;
+    }
+
+    Frame &victim = frames[index];
+
+    if (victim.pageId >= 0) {
+        if (victim.dirty) {
+            writePage(victim);
+        }
+
+        pageTable.erase(victim.pageId);
+        evictions++;
+    }
+
+    victim.pageId = pageId;
+    victim.dirty = false;
+    victim.loading = true;
+    victim.pinCount = 1;
+    victim.referenced = true;
+    pageTable[pageId] = index;
+
+    return index;
+}
+
+/**
+ * @brief pins a page into memory and returns a pointer to its bytes
+ * 
+ * The pointer stays valid until the matching unpin. A miss reserves its 
+ *      frame under the latch and reads the page without it.
+ * 
+ * @param pageId 
+ * @return char* 
+ */
+char *BufferPool::pin(long pageId) {
+    unique_lock<mutex> lock(latch);
+    unordered_map<long, int>::iterator it;
+    int index;
+
+    if (pageId < 0) {
+        throw DBException("Invalid page");
+    }
+
+    while ((it = pageTable.find(pageId)) != pageTable.end()) {
+        Frame &frame = frames[it->second];
+
+        if (frame.loading) {   // another miss is reading it
+            loaded.wait(lock);
+            continue;
+        }
+
+        hits++;
+        frame.pinCount++;
+        frame.referenced = true;
+
+        return frame.data;
+    }
+
+    misses++;
+    index = reserve(pageId);
+
+    if (index < 0) {
+        throw DBException("All buffer pool frames are pinned");
+    }
+
+    lock.unlock();
+
+    try {
+        readPage(frames[index]);
+    } catch (...) {
+        lock.lock();
+        pageTable.erase(pageId);
+        frames[index].pageId = -1;
+        frames[index].pinCount = 0;
+        frames[index].loading = false;
+        loaded.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    frames[index].loading = false;
+    loaded.notify_all();
+
+    return frames[index].data;
+}
+
+/**
+ * @brief reads a page into the pool ahead of the pin that will need it
+ * 
+ * The page is left unreferenced, so if nobody pins it before the clock
+ *      hand comes around it is the first thing evicted. A prefetch that 
+ *      finds every frame pinned is dropped, it is only a hint.
+ * 
+ * @param pageId 
+ */
+void BufferPool::prefetch(long pageId) {
+    vector<long> pageIds(1, pageId);
+
+    prefetch(pageIds);
+}
+
+/**
+ * @brief reads a batch of pages into the pool with all of them in flight at once
+ * 
+ * Victims for the whole batch are picked first and pinned so the batch 
+ *      cannot evict its own pages. The dirty ones go back to the file 
+ *      together, then every read is handed to the AsyncIO together.
+ *      Pages that are cached, past the end of the file or have no
+ *      frame left for them are skipped.
+ * 
+ * @param pageIds 
+ */
+void BufferPool::prefetch(vector<long> &pageIds) {
+    lock_guard<mutex> lock(latch);
+    vector<int> targets, dirty;
+    vector<long> wanted;
+    vector<IORequest> reads;
+    int index;
+
+    for (size_t i = 0; i < pageIds.size(); i++) {
+        long pageId = pageIds[i];
+
+        if (pageId < 0 || pageId * pageSize >= fileSize || pageTable.count(pageId) > 0 
+                || find(wanted.begin(), wanted.end(), pageId) != wanted.end()) {
+            continue;
+        } else if ((index = findVictim()) < 0) {
+            break;
+        }
+
+        frames[index].pinCount++;
+        targets.push_back(index);
+        wanted.push_back(pageId);
+
+        if (frames[index].pageId >= 0 && frames[index].dirty) {
+            dirty.push_back(index);
+        }
+    }
+
+    try {
+        writeBack(dirty);
+    } catch (...) {
+        for (size_t i = 0; i < targets.size(); i++) {
+            frames[targets[i]].pinCount--;
+        }
+
+        throw;
+    }
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        Frame &frame = frames[targets[i]];
+        IORequest read;
+
+        if (frame.pageId >= 0) {
+            pageTable.erase(frame.pageId);
+            evictions++;
+        }
+
+        frame.pageId = wanted[i];
+        pageTable[frame.pageId] = targets[i];
+        memset(frame.data, 0, pageSize);
+
+        read.write = false;
+        read.buffer = frame.data;
+        read.bytes = pageSize;
+        read.offset = frame.pageId * pageSize;
+        reads.push_back(read);
+    }
+
+    try {
+        io->run(reads);
+    } catch (...) {
+        // the frames hold nothing trustworthy, forget them
+        for (size_t i = 0; i < targets.size(); i++) {
+            pageTable.erase(frames[targets[i]].pageId);
+            frames[targets[i]].pageId = -1;
+            frames[targets[i]].pinCount--;
+        }
+
+        throw;
+    }
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        frames[targets[i]].pinCount--;
+        frames[targets[i]].referenced = false;
+        prefetches++;
+    }
+}
+
+void BufferPool::unpin(long pageId, bool dirty) {
+    lock_guard<mutex> lock(latch);
+    unordered_map<long, int>::iterator it = pageTable.find(pageId);
+
+    if (it == pageTable.end() || frames[it->second].pinCount <= 0) {
+        throw DBException("Cannot unpin page that is not pinned");
+    }
+
+    frames[it->second].pinCount--;
+    frames[it->second].dirty = frames[it->second].dirty || dirty;
+}
+
+/**
+ * @brief drops an unpinned page from the pool without writing it, even if it is dirty
+ * 
+ * @param pageId 
+ */
+void BufferPool::discard(long pageId) {
+    lock_guard<mutex> lock(latch);
+    unordered_map<long, int>::iterator it = pageTable.find(pageId);
+
+    if (it == pageTable.end()) {
+        return;
+    } else if (frames[it->second].pinCount > 0) {
+        throw DBException("Cannot discard a pinned page");
+    }
+
+    frames[it->second].pageId = -1;
+    frames[it->second].dirty = false;
+    frames[it->second].referenced = false;
+    pageTable.erase(it);
+}
+
+void BufferPool::flush(long pageId) {
+    lock_guard<mutex> lock(latch);
+    unordered_map<long, int>::iterator it = pageTable.find(pageId);
+
+    if (it != pageTable.end() && frames[it->second].dirty) {
+        writePage(frames[it->second]);
+    }
+}
+
+/**
+ * @brief writes every dirty page back, all of them in flight at once
+ */
+void BufferPool::flushAll() {
+    lock_guard<mutex> lock(latch);
+    vector<int> dirty;
+
+    for (int i = 0; i < numFrames; i++) {
+        if (frames[i].pageId >= 0 && frames[i].dirty) {
+            dirty.push_back(i);
+        }
+    }
+
+    writeBack(dirty);
+}
+
+
+
+BlockAllocator::BlockAllocator(string fileName, long fileBlocks) {
+    struct stat s;
+
+    this->fileName = fileName;
+
+    if (!load(fileBlocks)) {
+        if (stat(fileName.c_str(), &s) == 0) {
+            cout << "Discard\tfree space map: " << fileName << endl;
+        }
+
+        words.clear();
+        numBlocks = 0;
+        freeBlocks = 0;
+    }
+
+    writeHeader(false);
+}
+
+/**
+ * @brief reads a map left behind by a clean close
+ * 
+ * @param fileBlocks -- blocks in the file the map is for, a map covering more is not for this file
+ * @return true -- the map can be trusted
+ */
+bool BlockAllocator::load(long fileBlocks) {
+    AllocatorHeader header;
+    ifstream in(fileName.c_str(), ios::binary);
+
+    if (!in.read((char*) &header, sizeof(AllocatorHeader))
+        || header.magic != ALLOCATOR_MAGIC
+        || header.clean != 1
+        || header.numBlocks < 0
+        || header.numBlocks > fileBlocks) {
+        return false;
+    }
+
+    words.resize((header.numBlocks + 63) / 64);
+
+    if (!words.empty() && !in.read((char*) words.data(), words.size() * sizeof(unsigned long))) {
+        return false;
+    }
+
+    numBlocks = header.numBlocks;
+    freeBlocks = header.freeBlocks;
+    return true;
+}
+
+void BlockAllocator::writeHeader(bool clean) {
+    AllocatorHeader header;
+    fstream out(fileName.c_str(), ios::in | ios::out | ios::binary);
+
+    if (!out.is_open()) {
+        out.open(fileName.c_str(), ios::out | ios::binary);
+    }
+
+    header.magic = ALLOCATOR_MAGIC;
+    header.numBlocks = numBlocks;
+    header.freeBlocks = freeBlocks;
+    header.clean = clean;
+
+    if (!out.write((char*) &header, sizeof(AllocatorHeader))) {
+        throw DBException("Could not write free space map " + fileName);
+    }
+}
+
+/**
+ * @brief writes the whole map out and marks it clean
+ */
+void BlockAllocator::close() {
+    AllocatorHeader header;
+    ofstream out(fileName.c_str(), ios::out | ios::binary | ios::trunc);
+
+    header.magic = ALLOCATOR_MAGIC;
+    header.numBlocks = numBlocks;
+    header.freeBlocks = freeBlocks;
+    header.clean = 1;
+
+    if (!out.write((char*) &header, sizeof(AllocatorHeader))
+        || (!words.empty() && !out.write((char*) words.data(), words.size() * sizeof(unsigned long)))) {
+        throw DBException("Could not write free space map " + fileName);
+    }
+}
+
+long BlockAllocator::getNumBlocks() {
+    return numBlocks;
+}
+
+long BlockAllocator::getFreeBlocks() {
+    return freeBlocks;
+}
+
+bool BlockAllocator::isFree(long location) {
+    return location >= 0 && location < numBlocks && (words[location / 64] >> (location % 64) & 1);
+}
+
+void BlockAllocator::setRun(long location, long count, bool free) {
+    if (location + count > numBlocks) {
+        numBlocks = location + count;
+        words.resize((numBlocks + 63) / 64, 0);
+    }
+
+    for (long b = location; b < location + count; b++) {
+        if (free) {
+            words[b / 64] |= 1UL << (b % 64);
+        } else {
+            words[b / 64] &= ~(1UL << (b % 64));
+        }
+    }
+
+    freeBlocks += free? count: -count;
+}
+
+/**
+ * @brief finds the first run of count free blocks starting in [from, to)
+ * 
+ * @return long -- the first block of the run, -1 if there is none
+ */
+long BlockAllocator::findRun(long count, long from, long to) {
+    long run = 0;
+
+    for (long b = from; b < to && b < numBlocks; b++) {
+        unsigned long word = words[b / 64] >> (b % 64);
+
+        if (run == 0) {
+            // skip straight to the next free block, a whole word at a time
+            if (word == 0) {
+                b = b / 64 * 64 + 63;
+                continue;
+            }
+
+            b += __builtin_ctzl(word);
+
+            if (b >= to || b >= numBlocks) {
+                break;
+            }
+
+            run = 1;
+        } else if (word & 1) {
+            run++;
+        } else {
+            run = 0;
+            continue;
+        }
+
+        if (run == count) {
+            return b - count + 1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief takes count contiguous free blocks, the first run at or after hint 
+ *      wrapping around to the start of the file
+ * 
+ * Without a big enough run the blocks come from the end of the file, 
+ *      starting early if the file already ends in free blocks. Blocks past 
+ *      the end of the file are taken by writing to them, so until then the
+ *      same location is handed out again.
+ * 
+ * @param count 
+ * @param hint -- a block the caller would like the run close to, -1 for none
+ * @param endOfFile -- blocks currently in the file
+ * @return long -- the first block of the run
+ */
+long BlockAllocator::allocate(long count, long hint, long endOfFile) {
+    long result;
+
+    if (count <= 0) {
+        throw DBException("Cannot allocate " + to_string(count) + " blocks");
+    }
+
+    if (hint < 0 || hint >= numBlocks) {
+        hint = 0;
+    }
+
+    result = findRun(count, hint, numBlocks);
+
+    if (result < 0 && hint > 0) {
+        result = findRun(count, 0, hint + count - 1);
+    }
+
+    if (result < 0) {
+        result = endOfFile;
+
+        while (result > 0 && endOfFile - result < count && isFree(result - 1)) {
+            result--;
+        }
+    }
+
+    if (result < numBlocks) {
+        setRun(result, min(count, numBlocks - result), false);
+    }
+
+    return result;
+}
+
+/**
+ * @brief gives count blocks starting at location back to the map
+ */
+void BlockAllocator::release(long location, long count) {
+    if (location < 0 || count <= 0) {
+        throw DBException("Cannot free " + to_string(count) + " blocks at " + to_string(location));
+    }
+
+    for (long b = location; b < location + count; b++) {
+        if (isFree(b)) {
+            throw DBException("Block " + to_string(b) + " is already free");
+        }
+    }
+
+    setRun(location, count, true);
+}
+
+
+WriteAheadLog::WriteAheadLog(string fileName, DurabilityMode mode, int intervalMs) {
+    struct stat s;
+
+    this->fileName = fileName;
+    fd = open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0) {
+        throw DBException("Could not open log file " + fileName);
+    }
+
+    fstat(fd, &s);
+    logSize = s.st_size;
+
+    nextLSN = 1;
+    durableLSN = 0;
+    flushing = false;
+    syncs = 0;
+    commits = 0;
+
+    durability = new Durability(mode, [this]() {
+        try {
+            flush();
+        } catch (DBException &e) {
+            return false;
+        }
+
+        return true;
+    }, intervalMs);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    delete durability;  // stops its flusher before the file goes away
+
+    try {
+        flushTo(nextLSN - 1);
+    } catch (DBException &e) {
+        // nothing left to tell, the records that did not get out were never durable
+    }
+
+    close(fd);
+}
+
+Durability *WriteAheadLog::getDurability() {
+    return durability;
+}
+
+long WriteAheadLog::getDurableLSN() {
+    lock_guard<mutex> lock(latch);
+    return durableLSN;
+}
+
+long WriteAheadLog::getSize() {
+    lock_guard<mutex> lock(latch);
+    return logSize + buffer.size();
+}
+
+long WriteAheadLog::getSyncs() {
+    lock_guard<mutex> lock(latch);
+    return syncs;
+}
+
+long WriteAheadLog::getCommits() {
+    lock_guard<mutex> lock(latch);
+    return commits;
+}
+
+/**
+ * @brief 64 bit FNV-1a over the record, with its checksum field zeroed, and the data after it
+ */
+unsigned long WriteAheadLog::checksum(LogRecord &record, const char *data) {
+    unsigned long hash = 14695981039346656037UL;
+    unsigned long saved = record.checksum;
+    const unsigned char *bytes = (const unsigned char *) &record;
+
+    record.checksum = 0;
+
+    for (size_t i = 0; i < sizeof(LogRecord); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211UL;
+    }
+
+    for (int i = 0; i < record.length; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211UL;
+    }
+
+    record.checksum = saved;
+
+    return hash;
+}
+
+/**
+ * @brief adds a record to the log buffer, it is not durable until a flushTo covers its lsn
+ * 
+ * @return long -- the lsn of the record
+ */
+long WriteAheadLog::append(long txn, LogRecordType type, long location, const char *data, int length) {
+    LogRecord record;
+    lock_guard<mutex> lock(latch);
+
+    memset(&record, 0, sizeof(record));
+    record.lsn = nextLSN++;
+    record.txn = txn;
+    record.type = type;
+    record.length = length;
+    record.location = location;
+    record.checksum = checksum(record, data);
+
+    buffer.insert(buffer.end(), (char *) &record, (char *) &record + sizeof(record));
+    buffer.insert(buffer.end(), data, data + length);
+
+    return record.lsn;
+}
+
+/**
+ * @brief appends the commit record for txn and, depending on the durability mode, waits until it is durable
+ * 
+ * @return long -- the lsn of the commit record
+ */
+long WriteAheadLog::commit(long txn) {
+    long lsn = append(txn, LOG_COMMIT, -1, NULL, 0);
+
+    if (!durability->commit()) {
+        throw DBException("Could not write log file " + fileName);
+    }
+
+    lock_guard<mutex> lock(latch);
+    commits++;
+
+    return lsn;
+}
+
+/**
+ * @brief blocks until every record up to lsn is on disk
+ * 
+ * The first thread to find no flush in progress becomes the leader. It 
+ *      takes the whole buffer, which holds the records of every commit that 
+ *      queued up while the last sync ran, writes and syncs it with the
+ *      latch released, then wakes everyone it covered. Threads whose 
+ *      records came in after the leader took the buffer wait for the next 
+ *      round. A batch that fails goes back in front of the buffer, so 
+ *      every later flush fails too until it gets out.
+ * 
+ * @param lsn 
+ */
+void WriteAheadLog::flushTo(long lsn) {
+    unique_lock<mutex> lock(latch);
+
+    while (durableLSN < lsn) {
+        if (flushing) {
+            flushed.wait(lock);
+            continue;
+        }
+
+        vector<char> batch;
+        long batchLSN = nextLSN - 1;
+        ssize_t written = 0;
+
+        batch.swap(buffer);
+        flushing = true;
+        lock.unlock();
+
+        while (written < (ssize_t) batch.size()) {
+            ssize_t bytes = pwrite(fd, batch.data() + written, batch.size() - written, logSize + written);
+
+            if (bytes < 0) {
+                break;
+            }
+
+            written += bytes;
+        }
+
+        bool ok = written == (ssize_t) batch.size() && fdatasync(fd) == 0;
+
+        lock.lock();
+        flushing = false;
+        flushed.notify_all();
+
+        if (!ok) {
+            // the next flush writes the batch again over whatever part of it got out
+            buffer.insert(buffer.begin(), batch.begin(), batch.end());
+            throw DBException("Could not write log file " + fileName);
+        }
+
+        logSize += batch.size();
+        durableLSN = batchLSN;
+        syncs++;
+    }
+}
+
+/**
+ * @brief blocks until every record appended so far is on disk
+ */
+void WriteAheadLog::flush() {
+    long lsn;
+
+    {
+        lock_guard<mutex> lock(latch);
+        lsn = nextLSN - 1;
+    }
+
+    flushTo(lsn);
+}
+
+/**
+ * @brief replays the block images of every committed transaction in the log, in log order,
+ *      then puts back the blocks of transactions that never committed, newest first
+ * 
+ * Reading stops at the first record that is cut short or fails its checksum,
+ *      that is where the process died mid write. Pages of an open transaction
+ *      may reach the file once the log is durable, the images logged before
+ *      it changed each block undo them.
+ * 
+ * @param apply -- called with the location and image of each block to redo or undo
+ * @return long -- the number of blocks redone or undone
+ */
+long WriteAheadLog::recover(function<void(long location, const char *data, int length)> apply) {
+    vector<char> log(logSize);
+    set<long> committed;
+    vector<size_t> undo;
+    size_t offset = 0, end = 0;
+    long applied = 0;
+
+    if (pread(fd, log.data(), logSize, 0) != logSize) {
+        throw DBException("Could not read log file " + fileName);
+    }
+
+    // first pass finds the committed transactions and the end of the intact log
+    while (offset + sizeof(LogRecord) <= log.size()) {
+        LogRecord record;
+        memcpy(&record, log.data() + offset, sizeof(LogRecord));
+
+        if (record.length < 0 || offset + sizeof(LogRecord) + record.length > log.size()
+            || checksum(record, log.data() + offset + sizeof(LogRecord)) != record.checksum) {
+            break;
+        }
+
+        if (record.type == LOG_COMMIT) {
+            committed.insert(record.txn);
+        }
+
+        nextLSN = record.lsn + 1;
+        offset += sizeof(LogRecord) + record.length;
+    }
+
+    end = offset;
+    offset = 0;
+
+    while (offset < end) {
+        LogRecord record;
+        memcpy(&record, log.data() + offset, sizeof(LogRecord));
+
+        if (record.type == LOG_UPDATE && committed.count(record.txn) > 0) {
+            apply(record.location, log.data() + offset + sizeof(LogRecord), record.length);
+            applied++;
+        } else if (record.type == LOG_UNDO && committed.count(record.txn) == 0) {
+            undo.push_back(offset);
+        }
+
+        offset += sizeof(LogRecord) + record.length;
+    }
+
+    for (size_t i = undo.size(); i-- > 0; ) {
+        LogRecord record;
+        memcpy(&record, log.data() + undo[i], sizeof(LogRecord));
+
+        apply(record.location, log.data() + undo[i] + sizeof(LogRecord), record.length);
+        applied++;
+    }
+
+    durableLSN = nextLSN - 1;
+
+    return applied;
+}
+
+/**
+ * @brief empties the log, only safe once every block it describes is durable in the data file
+ */
+void WriteAheadLog::truncate() {
+    lock_guard<mutex> lock(latch);
+
+    if (flushing || !buffer.empty()) {
+        throw DBException("Cannot truncate a log with records that are not durable");
+    }
+
+    if (ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+        throw DBException("Could not truncate log file " + fileName);
+    }
+
+    logSize = 0;
+}
+
+
+
+MemoryManager::MemoryManager(string fileName, int poolFrames, StorageKind kind) {
+    struct stat s;
+
+    this->fileName = fileName;
+    this->kind = kind;
+    pool = NULL;
+    blockSize = sizeof(IndexRecord);
+    blocksPerPage = max(1, PAGE_SIZE / blockSize); // blocks never straddle two pages
+    wal = NULL;
+    currentTxn = 0;
+    nextTxn = 1;
+    blockWrites = 0;
+    durabilityMode = DURABILITY_COMMIT;
+    durabilityInterval = DURABILITY_INTERVAL;
+    hasFreeListHead = false;
+    hasTreeRoot = false;
+
+    cout << "Create\tMemory Manager" << endl;
+
+    if (kind != STORAGE_MEMORY && stat(fileName.c_str(), &s) != 0) {
+        cout << "Create\tfile: " << fileName << endl;
+    } else if (kind != STORAGE_MEMORY) {
+        cout << "Opening file: " << fileName << endl;
+    }
+
+    storage = BlockStorage::open(kind, fileName);
+    checkFile();
+
+    if (storage == NULL) {
+        throw DBException("Could not open " + fileName);
+    }
+
+    if (kind == STORAGE_PREAD && poolFrames > 0) {
+        pool = new BufferPool(fileName, blocksPerPage * blockSize, poolFrames);
+
+        // a page must never reach the file ahead of the log records that describe it
+        pool->setWriteBackHook([this]() {
+            if (wal != NULL) {
+                wal->flush();
+            }
+        });
+    }
+
+    allocator = new BlockAllocator(fileName + ".map", getNumLocations());
+
+    // a log left behind means we did not shut down cleanly, redo what was committed
+    if (stat((fileName + ".wal").c_str(), &s) == 0 && s.st_size > 0) {
+        long redone;
+
+        wal = new WriteAheadLog(fileName + ".wal", durabilityMode, durabilityInterval);
+        redone = wal->recover([this](long location, const char *data, int length) {
+            writeBlock(location, data, length);
+        });
+
+        cout << "Recover\t" << redone << " blocks from " << fileName << ".wal" << endl;
+        checkpoint();
+    }
+}
+
+
+
+MemoryManager::~MemoryManager() {
+    cout << "Destroy\tMemory Manager" << endl;
+
+    if (currentTxn > 0) {
+        // drop what the unfinished transaction has in the pool, the next open redoes 
+        //      anything committed on the same pages and undoes what reached the file
+        for (set<long>::iterator it = txnPages.begin(); it != txnPages.end(); it++) {
+            pool->discard(*it);
+        }
+
+        delete wal;
+        wal = NULL;
+
+    } else if (wal != NULL) {
+        checkpoint();
+        delete wal;
+        wal = NULL;
+    }
+
+    delete pool; // flushes any dirty pages
+    delete storage;
+
+    // an unfinished transaction may have taken or freed blocks, leave the map unclean so it is not trusted
+    if (currentTxn == 0) {
+        allocator->close();
+    }
+
+    delete allocator;
+}
+
+int MemoryManager::getBlockSize() {
+    return blockSize;
+}
+
+/**
+ * @brief every block written through writeBlock so far, logged or not, pooled or not
+ * 
+ * Tree code measures its write volume with it, the difference across 
+ *      one add or del is how many blocks that operation persisted.
+ */
+long MemoryManager::getBlockWrites() {
+    return blockWrites;
+}
+
+/**
+ * @brief true when the blocks lie in memory and nodeAt can hand them out
+ */
+bool MemoryManager::isMapped() {
+    return pool == NULL && (kind == STORAGE_MAPPED || kind == STORAGE_MEMORY);
+}
+
+BlockStorage *MemoryManager::getStorage() {
+    return storage;
+}
+
+BufferPool *MemoryManager::getPool() {
+    return pool;
+}
+
+/**
+ * @brief the node at location, in place in the mapping
+ * 
+ * Nothing is copied, so reading through the pointer is free and writing 
+ *      through it writes the file.
+ * 
+ * @param location 
+ * @return TreeNode* 
+ */
+TreeNode *MemoryManager::nodeAt(long location) {
+    if (!isMapped()) {
+        throw DBException("Only a mapped Memory Manager hands out nodes in place");
+    } else if (location < 0 || location >= getNumLocations()) {
+        throw DBException("Invalid location");
+    }
+
+    return (TreeNode*) storage->address(location * blockSize);
+}
+
+BlockAllocator *MemoryManager::getAllocator() {
+    return allocator;
+}
+
+/**
+ * @brief asks the buffer pool to bring in the page holding location before it is read
+ * 
+ * @param location 
+ */
+void MemoryManager::prefetch(long location) {
+    if (location >= 0 && pool != NULL) {
+        pool->prefetch(location / blocksPerPage);
+    }
+}
+
+/**
+ * @brief asks the buffer pool for the pages holding several locations in one batch
+ * 
+ * @param locations 
+ */
+void MemoryManager::prefetch(vector<long> &locations) {
+    vector<long> pageIds;
+
+    if (pool == NULL) {
+        return; // only the pool has anywhere to warm
+    }
+
+    for (size_t i = 0; i < locations.size(); i++) {
+        if (locations[i] >= 0) {
+            pageIds.push_back(locations[i] / blocksPerPage);
+        }
+    }
+
+    pool->prefetch(pageIds);
+}
+
+void MemoryManager::flush() {
+    if (currentTxn > 0) {
+        throw DBException("Cannot flush in the middle of a transaction");
+    }
+
+    if (pool != NULL) {
+        pool->flushAll();
+    } else if (!storage->flush()) {
+        throw DBException("Could not flush " + fileName);
+    }
+}
+
+WriteAheadLog *MemoryManager::getLog() {
+    return wal;
+}
+
+/**
+ * @brief picks how the log makes commits durable, see DURABILITY_NONE and the rest in BlockStorage.h
+ * 
+ * The log is checkpointed and reopened in the new mode. Writes outside
+ *      a transaction are not logged, they are durable at the next 
+ *      checkpoint whatever the mode.
+ * 
+ * @param mode 
+ * @param intervalMs -- between background syncs in DURABILITY_ASYNC and DURABILITY_BATCHED
+ */
+void MemoryManager::setDurability(DurabilityMode mode, int intervalMs) {
+    if (currentTxn > 0) {
+        throw DBException("Cannot change durability in the middle of a transaction");
+    }
+
+    durabilityMode = mode;
+    durabilityInterval = intervalMs;
+
+    if (wal != NULL) {
+        checkpoint();
+        delete wal;
+        wal = NULL;
+    }
+}
+
+bool MemoryManager::inTransaction() {
+    return currentTxn > 0;
+}
+
+/**
+ * @brief starts a transaction, every block written until commit is logged
+ * 
+ * Pages changed by the transaction are not pinned, the pool may write 
+ *      them back before it commits. The write back hook makes the log 
+ *      durable first, and the log holds the image of every block from
+ *      before the transaction changed it, so recovery can undo them.
+ */
+void MemoryManager::begin() {
+    if (currentTxn > 0) {
+        throw DBException("A transaction is already open");
+    } else if (pool == NULL) {
+        throw DBException("Only a pooled Memory Manager can run transactions");
+    }
+
+    if (wal == NULL) {
+        wal = new WriteAheadLog(fileName + ".wal", durabilityMode, durabilityInterval);
+    }
+
+    currentTxn = nextTxn++;
+}
+
+/**
+ * @brief makes the open transaction durable and releases its pages
+ */
+void MemoryManager::commit() {
+    if (currentTxn == 0) {
+        throw DBException("No transaction to commit");
+    }
+
+    wal->commit(currentTxn);
+
+    txnPages.clear();
+    txnBlocks.clear();
+    currentTxn = 0;
+
+    if (wal->getSize() > WAL_CHECKPOINT_BYTES) {
+        checkpoint();
+    }
+}
+
+/**
+ * @brief writes every dirty page, syncs the data file and empties the log
+ */
+void MemoryManager::checkpoint() {
+    if (currentTxn > 0) {
+        throw DBException("Cannot checkpoint in the middle of a transaction");
+    }
+
+    if (wal != NULL) {
+        wal->flush();   // the log goes first, see the write back hook
+    }
+
+    if (pool != NULL) {
+        pool->flushAll();
+    }
+
+    syncFile();
+
+    if (wal != NULL) {
+        wal->truncate();
+    }
+}
+
+/**
+ * @brief makes everything written to the data file durable, the pool writes through its own descriptor but they share the file
+ */
+void MemoryManager::syncFile() {
+    if (!storage->sync()) {
+        throw DBException("Could not sync " + fileName);
+    }
+}
+
+void MemoryManager::readBlock(long location, char *dest, int bytes) {
+    long pageId = location / blocksPerPage;
+    char *page;
+
+    if (location < 0) {
+        throw DBException("Invalid location");
+    }
+
+    // past the end of the file reads as zeros, on the storage and through the pool
+    if (pool == NULL) {
+        if (!storage->read(location * blockSize, dest, bytes)) {
+            throw DBException("Could not read " + fileName);
+        }
+
+        return;
+    }
+
+    page = pool->pin(pageId);
+    memcpy(dest, page + (location % blocksPerPage) * blockSize, bytes);
+    pool->unpin(pageId, false);
+}
+
+void MemoryManager::writeBlock(long location, const char *src, int bytes) {
+    long pageId = location / blocksPerPage;
+    char *page, *block;
+
+    if (location < 0) {
+        throw DBException("Invalid location");
+    }
+
+    blockWrites++;
+
+    if (pool == NULL) {
+        char padded[sizeof(IndexRecord)];
+
+        memcpy(padded, src, bytes);
+        memset(padded + bytes, 0, blockSize - bytes);
+
+        if (!storage->write(location * blockSize, padded, blockSize)) {
+            throw DBException("Could not write " + fileName);
+        }
+
+        return;
+    }
+
+    page = pool->pin(pageId);
+    block = page + (location % blocksPerPage) * blockSize;
+
+    if (currentTxn > 0 && txnBlocks.insert(location).second) {
+        wal->append(currentTxn, LOG_UNDO, location, block, blockSize);
+    }
+
+    memcpy(block, src, bytes);
+    memset(block + bytes, 0, blockSize - bytes);
+
+    if (currentTxn > 0) {
+        wal->append(currentTxn, LOG_UPDATE, location, block, blockSize);
+        txnPages.insert(pageId);
+    }
+
+    pool->extend((location + 1) * blockSize);
+    pool->unpin(pageId, true);
+}
+
+void MemoryManager::writeAt(int location, IndexRecord record) {
+    writeBlock(location, (char*) (&record), blockSize);
+}
+
+void MemoryManager::writeAt(int location, FreeListNode fln) {
+    writeBlock(location, (char*) (&fln), sizeof(FreeListNode));
+}
+
+void MemoryManager::writeAt(int location, TreeNode tn) {
+    writeBlock(location, (char*) (&tn), sizeof(TreeNode));
+}
+
+void MemoryManager::readAt(int location, IndexRecord &record) {
+    readBlock(location, (char*) (&record), blockSize);
+}
+
+void MemoryManager::readAt(int location, FreeListNode &fln) {
+    readBlock(location, (char*) (&fln), sizeof(FreeListNode));
+}
+
+void MemoryManager::readAt(int location, TreeNode &tn) {
+    readBlock(location, (char*) (&tn), sizeof(TreeNode));
+}
+
+/**
+ * @brief reserves location 0 for the free list head
+ * 
+ * Free locations are tracked by the free space map, the head only keeps its 
+ *      place so files keep the tree root at location 1.
+ */
+void MemoryManager::FreeListInit() {
+    if (!hasFreeListHead) {
+        FreeListHead.freeNode.init(this, 0);
+        hasFreeListHead = true;
+    } else {
+        throw DBException("Free List already initialized");
+    }
+}
+
+int MemoryManager::getSize() {
+    return pool != NULL? pool->getFileSize(): storage->getSize();
+}
+
+int MemoryManager::getNumLocations() {
+    return getSize() / blockSize;
+}
+
+
+/**
+ * @brief returns the next free location in the file
+ * 
+ * Danger!! This function is destructive!!!!!!!!!!!!!
+ * Do not use outside of the Binary Tree class
+ * 
+ * If the result is not used to write to the file, the location will be lost.
+ * 
+ * @param hint -- a location the caller would like the result close to, 
+ *      usually the node that will point at it
+ * @return long 
+ */
+long MemoryManager::getNextFreeLocation(long hint) {
+    return getFreeExtent(1, hint);
+}
+
+/**
+ * @brief returns the first of count contiguous free locations in the file
+ * 
+ * Danger!! This function is destructive!!!!!!!!!!!!!
+ * 
+ * Free locations come from the free space map without touching the file,
+ *      past the end of the file they are only taken once they are written.
+ * 
+ * @param count 
+ * @param hint -- a location the caller would like the result close to
+ * @return long 
+ */
+long MemoryManager::getFreeExtent(long count, long hint) {
+    long result = allocator->allocate(count, hint, getNumLocations());
+
+    if (result < 0) {
+        throw DBException("Memory Manager gave invalid location");
+    }
+
+    return result;
+}
+
+/**
+ * @brief function will free a location in the file
+ * 
+ * Danger!! This function is destructive!!!!!!!!!!!!!
+ * Do not use outside of the Binary Tree class
+ * 
+ * if the result passed in is currently being used by the tree, undefined 
+ *      behavior will occur
+ * 
+ * @param location 
+ * @param count -- contiguous locations to free starting at location
+ */
+void MemoryManager::freeLocation(long location, long count) {
+    if (location <= 0 && location + count > 0 && hasFreeListHead) {
+        throw DBException("Cannot free head node of the free list");
+    } else if (location <= 1 && location + count > 1 && hasFreeListHead) {
+        throw DBException("Cannot free root node of the tree");
+    } else if (location < 0) {
+        throw DBException("Cannot free invalid location");
+    }
+
+    allocator->release(location, count);
+}
+
+
+KeyIndex::~KeyIndex() {
+}
+
+/**
+ * @brief opens fileName as an index on the given engine, creating it if it is not there
+ * 
+ * @param engine 
+ * @param fileName 
+ * @return KeyIndex* -- the caller deletes it
+ */
+KeyIndex *KeyIndex::open(IndexEngine engine, string fileName) {
+    if (engine == ENGINE_LSM) {
+        return new LsmIndex(fileName);
+    }
+
+    return new IntIndex(fileName);
+}
+
+
+IntIndex::IntIndex(string fileName, int poolFrames) {
+    struct stat s;
+    bool isNew = stat(fileName.c_str(), &s) != 0 || s.st_size == 0;
+
+    this->fileName = fileName;
+    pageReads = 0;
+    pageWrites = 0;
+    pendingPage = -1;
+    filterSaved = false;
+    filterSkips = 0;
+
+    pool = new BufferPool(fileName, PAGE_SIZE, poolFrames);
+
+    if (isNew) {
+        IndexPage root;
+
+        meta.magic = INDEX_MAGIC;
+        meta.rootPage = 1;
+        meta.freePage = -1;
+        meta.numPages = 2;
+        meta.numKeys = 0;
+        meta.height = 1;
+
+        root.type = OCCUPIED;
+        root.leaf = true;
+        root.numKeys = 0;
+        root.next = -1;
+        root.prev = -1;
+
+        writePage(meta.rootPage, root);
+        saveMeta();
+        remove(filterName().c_str());   // left by an index that was deleted
+
+    } else {
+        char *page = pool->pin(0);
+        memcpy(&meta, page, sizeof(IndexMeta));
+        pool->unpin(0, false);
+
+        if (meta.magic != INDEX_MAGIC) {
+            throw DBException(fileName + " is not an IntIndex file");
+        }
+
+        if (!loadFilter()) {
+            rebuildFilter(2 * meta.numKeys);
+        }
+    }
+}
+
+IntIndex::~IntIndex() {
+    saveMeta();
+    delete pool; // flushes any dirty pages
+    saveFilter();
+}
+
+string IntIndex::getEngine() {
+    return "btree";
+}
+
+long IntIndex::size() {
+    shared_lock<shared_mutex> tree(treeLatch);
+    lock_guard<mutex> lock(metaLatch);
+    return meta.numKeys;
+}
+
+int IntIndex::getHeight() {
+    shared_lock<shared_mutex> tree(treeLatch);
+    shared_lock<shared_mutex> root(rootLatch);
+    return meta.height;
+}
+
+long IntIndex::getNumPages() {
+    shared_lock<shared_mutex> tree(treeLatch);
+    lock_guard<mutex> lock(metaLatch);
+    return meta.numPages;
+}
+
+long IntIndex::getPageReads() {
+    return pageReads;
+}
+
+long IntIndex::getPageWrites() {
+    return pageWrites;
+}
+
+/**
+ * @brief finds the filter answered without reading a page
+ */
+long IntIndex::getFilterSkips() {
+    return filterSkips;
+}
+
+long IntIndex::getFilterBytes() {
+    shared_lock<shared_mutex> tree(treeLatch);
+    return filter.getBytes();
+}
+
+BufferPool *IntIndex::getPool() {
+    return pool;
+}
+
+void IntIndex::flush() {
+    unique_lock<shared_mutex> tree(treeLatch);
+
+    saveMeta();
+    pool->flushAll();
+    saveFilter();
+}
+
+string IntIndex::filterName() {
+    return fileName + ".bloom";
+}
+
+/**
+ * @brief reads the filter flush saved, if it is there and was saved with the tree as it is
+ * 
+ * @return true -- the filter is loaded
+ */
+bool IntIndex::loadFilter() {
+    ifstream in(filterName().c_str(), ios::binary);
+    long header[3];     // INDEX_FILTER_MAGIC, numKeys, blocks
+
+    if (!in.read((char*) header, sizeof(header)) || header[0] != INDEX_FILTER_MAGIC || header[1] != meta.numKeys) {
+        return false;
+    }
+
+    filter.setNumBlocks(header[2]);
+
+    if (!in.read(filter.data(), filter.getBytes())) {
+        return false;
+    }
+
+    filterSaved = true;
+    return true;
+}
+
+/**
+ * @brief writes the filter to <index>.bloom, called after the pages are flushed with the whole tree held
+ */
+void IntIndex::saveFilter() {
+    ofstream out;
+    long header[3] = {INDEX_FILTER_MAGIC, meta.numKeys, filter.getNumBlocks()};
+
+    if (filterSaved) {
+        return;
+    }
+
+    out.open(filterName().c_str(), ios::binary | ios::trunc);
+    out.write((char*) header, sizeof(header));
+    out.write(filter.data(), filter.getBytes());
+    out.close();
+
+    filterSaved = !out.fail();
+}
+
+/**
+ * @brief refills the filter from the leaves, sized for expectedKeys, with the whole tree held
+ * 
+ * @param expectedKeys 
+ */
+void IntIndex::rebuildFilter(long expectedKeys) {
+    IndexPage node;
+
+    filter.reset(expectedKeys);
+    readPage(meta.rootPage, node);
+
+    while (!node.leaf) {
+        readPage(node.children[0], node);
+    }
+
+    while (true) {
+        for (int i = 0; i < node.numKeys; i++) {
+            filter.add(node.keys[i]);
+        }
+
+        if (node.next < 0) {
+            break;
+        }
+
+        readPage(node.next, node);
+    }
+}
+
+/**
+ * @brief removes the saved filter before a key it does not have goes into the tree
+ */
+void IntIndex::filterChanged() {
+    if (filterSaved) {
+        lock_guard<mutex> lock(filterLatch);
+
+        if (filterSaved) {
+            remove(filterName().c_str());
+            filterSaved = false;
+        }
+    }
+}
+
+/**
+ * @brief the tree holds more keys than the filter was sized for
+ */
+bool IntIndex::filterFull() {
+    lock_guard<mutex> lock(metaLatch);
+    return meta.numKeys > filter.getCapacity();
+}
+
+void IntIndex::readPage(long page, IndexPage &node) {
+    char *data = pool->pin(page);
+    memcpy(&node, data, sizeof(IndexPage));
+    pool->unpin(page, false);
+    pageReads++;
+}
+
+void IntIndex::writePage(long page, IndexPage &node) {
+    char *data = pool->pin(page);
+    pageWrites++;
+    memcpy(data, &node, sizeof(IndexPage));
+    pool->extend((page + 1) * PAGE_SIZE);
+    pool->unpin(page, true);
+}
+
+void IntIndex::saveMeta() {
+    lock_guard<mutex> lock(metaLatch);
+    char *data = pool->pin(0);
+    memcpy(data, &meta, sizeof(IndexMeta));
+    pool->extend(PAGE_SIZE);
+    pool->unpin(0, true);
+}
+
+/**
+ * @brief takes a page off the free page list, or grows the file by one page
+ * 
+ * @return long 
+ */
+long IntIndex::allocatePage() {
+    lock_guard<mutex> lock(metaLatch);
+    long result = meta.freePage;
+
+    if (result < 0) {
+        result = meta.numPages++;
+    } else {
+        IndexPage node;
+        readPage(result, node);
+        meta.freePage = node.next;
+    }
+
+    return result;
+}
+
+void IntIndex::freePage(long page) {
+    lock_guard<mutex> lock(metaLatch);
+    IndexPage node;
+
+    if (page <= 0) {
+        throw DBException("Cannot free the index meta page");
+    }
+
+    node.type = FREE;
+    node.leaf = false;
+    node.numKeys = 0;
+    node.next = meta.freePage;
+    node.prev = -1;
+    writePage(page, node);
+
+    meta.freePage = page;
+}
+
+void IntIndex::countKeys(long delta) {
+    lock_guard<mutex> lock(metaLatch);
+    meta.numKeys += delta;
+}
+
+shared_mutex &LatchTable::get(long page) {
+    Shard &shard = shards[page % SHARDS];
+    lock_guard<mutex> lock(shard.lock);
+    unique_ptr<shared_mutex> &latch = shard.latches[page];
+
+    if (!latch) {
+        latch.reset(new shared_mutex());
+    }
+
+    return *latch;
+}
+
+/**
+ * @brief latches its way down to key's leaf, holding no more than a page and its child at once
+ * 
+ * @param key 
+ * @param node -- gets a copy of the leaf
+ * @return long -- the leaf, still latched shared
+ */
+long IntIndex::latchLeaf(long key, IndexPage &node) {
+    shared_lock<shared_mutex> root(rootLatch);
+    long page = meta.rootPage;
+    long child;
+
+    latches.get(page).lock_shared();
+    root.unlock();
+    readPage(page, node);
+
+    while (!node.leaf) {
+        child = node.children[upper_bound(node.keys, node.keys + node.numKeys, key) - node.keys];
+        latches.get(child).lock_shared();
+        latches.get(page).unlock_shared();
+        page = child;
+        readPage(page, node);
+    }
+
+    return page;
+}
+
+/**
+ * @brief latches the path from the root to key's leaf exclusively for a writer
+ * 
+ * A page is safe when the change cannot reach the page above it: it has 
+ *      room for one more key when inserting, or a key to spare when 
+ *      deleting. Latching a safe page lets go of every page above it,
+ *      and of the root latch once the root itself is safe.
+ * 
+ * @param key 
+ * @param inserting 
+ * @param held -- gets the pages still latched, top first
+ * @param root -- holds the root latch on the way in
+ */
+void IntIndex::latchPath(long key, bool inserting, vector<long> &held, unique_lock<shared_mutex> &root) {
+    IndexPage node;
+    long page = meta.rootPage;
+    bool safe;
+
+    while (true) {
+        latches.get(page).lock();
+        readPage(page, node);
+
+        if (inserting) {
+            safe = node.numKeys < BTREE_MAX_KEYS;
+        } else if (held.empty() && root.owns_lock()) { // the root
+            safe = node.leaf || node.numKeys > 1;
+        } else {
+            safe = node.numKeys > BTREE_MIN_KEYS;
+        }
+
+        if (safe) {
+            unlatchPath(held);
+
+            if (root.owns_lock()) {
+                root.unlock();
+            }
+        }
+
+        held.push_back(page);
+
+        if (node.leaf) {
+            return;
+        }
+
+        page = node.children[upper_bound(node.keys, node.keys + node.numKeys, key) - node.keys];
+    }
+}
+
+void IntIndex::unlatchPath(vector<long> &held) {
+    for (size_t i = 0; i < held.size(); i++) {
+        latches.get(held[i]).unlock();
+    }
+
+    held.clear();
+}
+
+/**
+ * @brief Add a key value pair to the index, overwriting the value if the key exists
+ * 
+ * @param key 
+ * @param value 
+ */
+void IntIndex::add(long key, long value) {
+    shared_lock<shared_mutex> tree(treeLatch);
+    unique_lock<shared_mutex> rootLock(rootLatch);
+    vector<long> held;
+    long upKey, upPage;
+
+    filterChanged();
+    filter.addShared(key);
+
+    try {
+        latchPath(key, true, held, rootLock);
+
+        // only a root that was not safe can split, so rootLock is still held
+        if (insertInto(held[0], key, value, upKey, upPage)) {
+            IndexPage root;
+            long rootPage = allocatePage();
+            unique_lock<shared_mutex> fresh(latches.get(rootPage));
+
+            root.type = OCCUPIED;
+            root.leaf = false;
+            root.numKeys = 1;
+            root.next = -1;
+            root.prev = -1;
+            root.keys[0] = upKey;
+            root.children[0] = meta.rootPage;
+            root.children[1] = upPage;
+
+            writePage(rootPage, root);
+            meta.rootPage = rootPage;
+            meta.height++;
+        }
+
+    } catch (...) {
+        unlatchPath(held);
+        throw;
+    }
+
+    unlatchPath(held);
+
+    // one pass over the leaves each time the index doubles
+    if (filterFull()) {
+        if (rootLock.owns_lock()) {
+            rootLock.unlock();
+        }
+
+        tree.unlock();
+        unique_lock<shared_mutex> whole(treeLatch);
+
+        if (filterFull()) {
+            rebuildFilter(2 * meta.numKeys);
+        }
+    }
+}
+
+/**
+ * @brief inserts into the subtree at page
+ * 
+ * @return true -- the page split, upKey and upPage describe the new right 
+ *      sibling the parent has to link in
+ */
+bool IntIndex::insertInto(long page, long key, long value, long &upKey, long &upPage) {
+    IndexPage node;
+    int pos;
+
+    readPage(page, node);
+
+    if (node.leaf) {
+        pos = lower_bound(node.keys, node.keys + node.numKeys, key) - node.keys;
+
+        if (pos < node.numKeys && node.keys[pos] == key) {
+            node.children[pos] = value;
+            writePage(page, node);
+            return false;
+        }
+
+        for (int i = node.numKeys; i > pos; i--) {
+            node.keys[i] = node.keys[i - 1];
+            node.children[i] = node.children[i - 1];
+        }
+
+        node.keys[pos] = key;
+        node.children[pos] = value;
+        node.numKeys++;
+        countKeys(1);
+
+    } else {
+        long childKey, childPage;
+
+        pos = upper_bound(node.keys, node.keys + node.numKeys, key) - node.keys;
+
+        if (!insertInto(node.children[pos], key, value, childKey, childPage)) {
+            return false;
+        }
+
+        for (int i = node.numKeys; i > pos; i--) {
+            node.keys[i] = node.keys[i - 1];
+            node.children[i + 1] = node.children[i];
+        }
+
+        node.keys[pos] = childKey;
+        node.children[pos + 1] = childPage;
+        node.numKeys++;
+    }
+
+    if (node.numKeys <= BTREE_MAX_KEYS) {
+        writePage(page, node);
+        return false;
+    }
+
+    // the page overflowed, move the upper half into a new right sibling
+    IndexPage right;
+    int mid = node.numKeys / 2;
+
+    right.type = OCCUPIED;
+    right.leaf = node.leaf;
+    right.next = -1;
+    right.prev = -1;
+    upPage = allocatePage();
+
+    // nobody can reach the new page before we write the parent, but a cursor on a stale copy still might
+    unique_lock<shared_mutex> fresh(latches.get(upPage));
+
+    if (node.leaf) {
+        right.numKeys = node.numKeys - mid;
+
+        for (int i = 0; i < right.numKeys; i++) {
+            right.keys[i] = node.keys[mid + i];
+            right.children[i] = node.children[mid + i];
+        }
+
+        right.next = node.next;
+        right.prev = page;
+        node.next = upPage;
+
+        if (right.next >= 0) {
+            unique_lock<shared_mutex> latch(latches.get(right.next));
+            IndexPage after;
+
+            readPage(right.next, after);
+            after.prev = upPage;
+            writePage(right.next, after);
+        }
+
+        upKey = right.keys[0];
+
+    } else {
+        // the middle key moves up, it does not stay in either half
+        right.numKeys = node.numKeys - mid - 1;
+
+        for (int i = 0; i < right.numKeys; i++) {
+            right.keys[i] = node.keys[mid + 1 + i];
+            right.children[i] = node.children[mid + 1 + i];
+        }
+
+        right.children[right.numKeys] = node.children[node.numKeys];
+        upKey = node.keys[mid];
+    }
+
+    node.numKeys = mid;
+
+    writePage(page, node);
+    writePage(upPage, right);
+
+    return true;
+}
+
+/**
+ * @brief Delete a key from the index
+ * 
+ * @param key 
+ * @return true -- the key was in the index
+ */
+bool IntIndex::del(long key) {
+    shared_lock<shared_mutex> tree(treeLatch);
+    unique_lock<shared_mutex> rootLock(rootLatch);
+    vector<long> held;
+    bool result;
+
+    try {
+        latchPath(key, false, held, rootLock);
+        result = removeFrom(held[0], key);
+
+        // an internal root left with a single child hands the root to that child
+        if (rootLock.owns_lock()) {
+            IndexPage root;
+
+            readPage(meta.rootPage, root);
+
+            if (!root.leaf && root.numKeys == 0) {
+                long oldRoot = meta.rootPage;
+
+                meta.rootPage = root.children[0];
+                meta.height--;
+                freePage(oldRoot);
+            }
+        }
+
+    } catch (...) {
+        unlatchPath(held);
+        throw;
+    }
+
+    unlatchPath(held);
+
+    return result;
+}
+
+bool IntIndex::removeFrom(long page, long key) {
+    IndexPage node;
+    int pos;
+    bool result;
+
+    readPage(page, node);
+
+    if (node.leaf) {
+        pos = lower_bound(node.keys, node.keys + node.numKeys, key) - node.keys;
+
+        if (pos >= node.numKeys || node.keys[pos] != key) {
+            return false;
+        }
+
+        for (int i = pos; i < node.numKeys - 1; i++) {
+            node.keys[i] = node.keys[i + 1];
+            node.children[i] = node.children[i + 1];
+        }
+
+        node.numKeys--;
+        countKeys(-1);
+        writePage(page, node);
+
+        return true;
+    }
+
+    pos = upper_bound(node.keys, node.keys + node.numKeys, key) - node.keys;
+    result = removeFrom(node.children[pos], key);
+
+    if (result) {
+        fixUnderflow(node, pos);
+        writePage(page, node);
+    }
+
+    return result;
+}
+
+/**
+ * @brief refills parent.children[childIndex] if it dropped below BTREE_MIN_KEYS
+ * 
+ * The child first tries to borrow a key from a sibling, if both siblings 
+ *      are at the minimum it is merged with one of them and the parent
+ *      loses a key. The caller saves the parent and holds it and the 
+ *      child latched, the siblings are latched here.
+ * 
+ * @param parent 
+ * @param childIndex 
+ */
+void IntIndex::fixUnderflow(IndexPage &parent, int childIndex) {
+    IndexPage child, left, right;
+    unique_lock<shared_mutex> leftLatch, rightLatch;
+    long childPage = parent.children[childIndex];
+    bool hasLeft = childIndex > 0;
+    bool hasRight = childIndex < parent.numKeys;
+
+    readPage(childPage, child);
+
+    if (child.numKeys >= BTREE_MIN_KEYS) {
+        return;
+    }
+
+    if (hasLeft) {
+        leftLatch = unique_lock<shared_mutex>(latches.get(parent.children[childIndex - 1]));
+        readPage(parent.children[childIndex - 1], left);
+    }
+
+    if (hasRight) {
+        rightLatch = unique_lock<shared_mutex>(latches.get(parent.children[childIndex + 1]));
+        readPage(parent.children[childIndex + 1], right);
+    }
+
+    // borrow the last entry of the left sibling
+    if (hasLeft && left.numKeys > BTREE_MIN_KEYS) {
+        for (int i = child.numKeys; i > 0; i--) {
+            child.keys[i] = child.keys[i - 1];
+        }
+
+        for (int i = child.numKeys + (child.leaf? 0: 1); i > 0; i--) {
+            child.children[i] = child.children[i - 1];
+        }
+
+        if (child.leaf) {
+            child.keys[0] = left.keys[left.numKeys - 1];
+            child.children[0] = left.children[left.numKeys - 1];
+            parent.keys[childIndex - 1] = child.keys[0];
+        } else {
+            child.keys[0] = parent.keys[childIndex - 1];
+            child.children[0] = left.children[left.numKeys];
+            parent.keys[childIndex - 1] = left.keys[left.numKeys - 1];
+        }
+
+        child.numKeys++;
+        left.numKeys--;
+
+        writePage(parent.children[childIndex - 1], left);
+        writePage(childPage, child);
+
+    // borrow the first entry of the right sibling
+    } else if (hasRight && right.numKeys > BTREE_MIN_KEYS) {
+        if (child.leaf) {
+            child.keys[child.numKeys] = right.keys[0];
+            child.children[child.numKeys] = right.children[0];
+        } else {
+            child.keys[child.numKeys] = parent.keys[childIndex];
+            child.children[child.numKeys + 1] = right.children[0];
+            parent.keys[childIndex] = right.keys[0];
+        }
+
+        for (int i = 0; i < right.numKeys - 1; i++) {
+            right.keys[i] = right.keys[i + 1];
+        }
+
+        for (int i = 0; i < right.numKeys - (right.leaf? 1: 0); i++) {
+            right.children[i] = right.children[i + 1];
+        }
+
+        child.numKeys++;
+        right.numKeys--;
+
+        if (child.leaf) {
+            parent.keys[childIndex] = right.keys[0];
+        }
+
+        writePage(parent.children[childIndex + 1], right);
+        writePage(childPage, child);
+
+    // merge with a sibling, the right page of the pair is freed
+    } else {
+        int sep = hasLeft? childIndex - 1: childIndex;
+        long leftPage = parent.children[sep];
+        long rightPage = parent.children[sep + 1];
+        IndexPage &into = hasLeft? left: child;
+        IndexPage &from = hasLeft? child: right;
+
+        if (into.leaf) {
+            for (int i = 0; i < from.numKeys; i++) {
+                into.keys[into.numKeys + i] = from.keys[i];
+                into.children[into.numKeys + i] = from.children[i];
+            }
+
+            into.numKeys += from.numKeys;
+            into.next = from.next;
+
+            if (from.next >= 0) {
+                unique_lock<shared_mutex> latch;
+                IndexPage after;
+
+                // merging into the left sibling, the page after us is the right sibling we already hold
+                if (!rightLatch.owns_lock() || from.next != parent.children[childIndex + 1]) {
+                    latch = unique_lock<shared_mutex>(latches.get(from.next));
+                }
+
+                readPage(from.next, after);
+                after.prev = leftPage;
+                writePage(from.next, after);
+            }
+
+        } else {
+            into.keys[into.numKeys] = parent.keys[sep];
+
+            for (int i = 0; i < from.numKeys; i++) {
+                into.keys[into.numKeys + 1 + i] = from.keys[i];
+            }
+
+            for (int i = 0; i <= from.numKeys; i++) {
+                into.children[into.numKeys + 1 + i] = from.children[i];
+            }
+
+            into.numKeys += from.numKeys + 1;
+        }
+
+        for (int i = sep; i < parent.numKeys - 1; i++) {
+            parent.keys[i] = parent.keys[i + 1];
+            parent.children[i + 1] = parent.children[i + 2];
+        }
+
+        parent.numKeys--;
+
+        writePage(leftPage, into);
+        freePage(rightPage);
+    }
+}
+
+/**
+ * @brief finds the value stored under key
+ * 
+ * @param key 
+ * @return long -- the value, or -1 if the key is not in the index
+ */
+long IntIndex::findByKey(long key) {
+    shared_lock<shared_mutex> tree(treeLatch);
+    IndexPage node;
+    int pos;
+
+    if (!filter.mayContainShared(key)) {
+        filterSkips++;
+        return -1;
+    }
+
+    latches.get(latchLeaf(key, node)).unlock_shared();
+
+    pos = lower_bound(node.keys, node.keys + node.numKeys, key) - node.keys;
+
+    if (pos < node.numKeys && node.keys[pos] == key) {
+        return node.children[pos];
+    }
+
+    return -1;
+}
+
+/**
+ * @brief sorts key value pairs by key if they are not sorted already, 
+ *      a repeated key keeps the last value it was given
+ * 
+ * @param entries 
+ */
+void IntIndex::sortEntries(vector<pair<long, long>> &entries) {
+    size_t count = 0;
+    auto byKey = [](const pair<long, long> &a, const pair<long, long> &b) {
+        return a.first < b.first;
+    };
+
+    if (!is_sorted(entries.begin(), entries.end(), byKey)) {
+        stable_sort(entries.begin(), entries.end(), byKey);
+    }
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (count > 0 && entries[count - 1].first == entries[i].first) {
+            entries[count - 1] = entries[i];
+        } else {
+            entries[count++] = entries[i];
+        }
+    }
+
+    entries.resize(count);
+}
+
+/**
+ * @brief how many pages a level of `entries` entries needs when each page takes
+ *      up to `fill` of them, without any page dropping below `minEntries`
+ */
+long IntIndex::numPagesFor(long entries, int fill, int minEntries) {
+    long pages = (entries + fill - 1) / fill;
+
+    return max(1L, min(pages, entries / minEntries));
+}
+
+/**
+ * @brief Builds the index bottom up from a list of key value pairs
+ * 
+ * The pairs are sorted if they are not already, a repeated key keeps its 
+ *      last value. Leaves are written left to right into consecutive pages,
+ *      then each level of internal pages is written after the level below
+ *      it, so the whole build is one sequential pass over the file and 
+ *      every leaf ends up at the same depth.
+ * 
+ * @param entries 
+ * @param fill -- keys per leaf to aim for, between BTREE_MIN_KEYS and BTREE_MAX_KEYS
+ */
+void IntIndex::bulkLoad(vector<pair<long, long>> &entries, int fill) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    vector<pair<long, long>> level, above; // (smallest key below, page) for each page of a level
+    long count, numLeaves, nextPage;
+    IndexPage node;
+
+    if (meta.numKeys != 0) {
+        throw DBException("Bulk load needs an empty index");
+    } else if (fill < BTREE_MIN_KEYS || fill > BTREE_MAX_KEYS) {
+        throw DBException("Bulk load fill must be between " + to_string(BTREE_MIN_KEYS) + " and " + to_string(BTREE_MAX_KEYS));
+    }
+
+    sortEntries(entries);
+    count = entries.size();
+
+    // an empty index owns no pages but its root, so the file is laid out from page 1 again
+    meta.freePage = -1;
+    meta.numPages = 1;
+    meta.height = 1;
+    nextPage = 1;
+
+    node.type = OCCUPIED;
+    node.leaf = true;
+
+    numLeaves = numPagesFor(count, fill, BTREE_MIN_KEYS);
+
+    for (long i = 0, start = 0; i < numLeaves; i++) {
+        long end = count * (i + 1) / numLeaves; // spread the keys evenly over the leaves
+
+        node.numKeys = end - start;
+        node.prev = i == 0? -1: nextPage - 1;
+        node.next = i == numLeaves - 1? -1: nextPage + 1;
+
+        for (long j = start; j < end; j++) {
+            node.keys[j - start] = entries[j].first;
+            node.children[j - start] = entries[j].second;
+        }
+
+        level.push_back(make_pair(node.numKeys > 0? node.keys[0]: LONG_MIN, nextPage));
+        writePage(nextPage++, node);
+        start = end;
+    }
+
+    node.leaf = false;
+    node.next = -1;
+    node.prev = -1;
+
+    while (level.size() > 1) {
+        long numPages = numPagesFor(level.size(), fill + 1, BTREE_MIN_KEYS + 1);
+
+        above.clear();
+
+        for (long i = 0, start = 0; i < numPages; i++) {
+            long end = level.size() * (i + 1) / numPages;
+
+            node.numKeys = end - start - 1;
+
+            for (long j = start; j < end; j++) {
+                node.children[j - start] = level[j].second;
+
+                if (j > start) {
+                    node.keys[j - start - 1] = level[j].first;
+                }
+            }
+
+            above.push_back(make_pair(level[start].first, nextPage));
+            writePage(nextPage++, node);
+            start = end;
+        }
+
+        level.swap(above);
+        meta.height++;
+    }
+
+    meta.rootPage = level[0].second;
+    meta.numPages = nextPage;
+    meta.numKeys = count;
+    saveMeta();
+
+    filterChanged();
+    filter.reset(2 * count);
+
+    for (long i = 0; i < count; i++) {
+        filter.add(entries[i].first);
+    }
+}
+
+/**
+ * @brief returns a cursor on the smallest key >= lowKey
+ * 
+ * @param lowKey 
+ * @return IndexCursor 
+ */
+IndexCursor IntIndex::seek(long lowKey) {
+    return IndexCursor(this, lowKey);
+}
+
+
+IndexCursor::IndexCursor(IntIndex *index, long lowKey) {
+    this->index = index;
+    low = lowKey;
+
+    reseek();
+    skipEmpty();
+    readAhead();
+}
+
+bool IndexCursor::isValid() {
+    return pageId >= 0;
+}
+
+long IndexCursor::getKey() {
+    if (pageId < 0) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    return page.keys[position];
+}
+
+long IndexCursor::getValue() {
+    if (pageId < 0) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    return page.children[position];
+}
+
+/**
+ * @brief follows the leaf chain until position points at a key, or off the end
+ */
+void IndexCursor::skipEmpty() {
+    while (pageId >= 0 && position >= page.numKeys) {
+        long from = pageId;
+
+        if (page.numKeys > 0 && page.keys[page.numKeys - 1] == LONG_MAX) {
+            pageId = -1;
+            return;
+        } else if (page.numKeys > 0) {
+            low = max(low, page.keys[page.numKeys - 1] + 1);
+        }
+
+        pageId = page.next;
+
+        if (pageId < 0) {
+            return;
+        }
+
+        {
+            shared_lock<shared_mutex> tree(index->treeLatch);
+            shared_lock<shared_mutex> latch(index->latches.get(pageId));
+
+            index->readPage(pageId, page);
+        }
+
+        // the leaf we copied was split, merged or freed since, find our place from the root
+        if (page.type != OCCUPIED || !page.leaf || page.prev != from) {
+            reseek();
+        } else {
+            position = lower_bound(page.keys, page.keys + page.numKeys, low) - page.keys;
+        }
+
+        readAhead();
+    }
+}
+
+/**
+ * @brief copies the leaf the smallest key >= low is in, or would be in
+ */
+void IndexCursor::reseek() {
+    shared_lock<shared_mutex> tree(index->treeLatch);
+
+    pageId = index->latchLeaf(low, page);
+    index->latches.get(pageId).unlock_shared();
+    position = lower_bound(page.keys, page.keys + page.numKeys, low) - page.keys;
+}
+
+/**
+ * @brief prefetches the next leaf and the pages after it
+ * 
+ * Only the next leaf is known for certain, but leaves written by bulkLoad
+ *      or split in key order sit in consecutive pages, so the pages right 
+ *      after it are a good guess.
+ */
+void IndexCursor::readAhead() {
+    if (pageId < 0 || page.next < 0) {
+        return;
+    }
+
+    vector<long> pageIds;
+
+    for (int i = 0; i < READ_AHEAD; i++) {
+        pageIds.push_back(page.next + i);
+    }
+
+    index->pool->prefetch(pageIds);
+}
+
+/**
+ * @brief moves the cursor to the next key in order
+ */
+void IndexCursor::next() {
+    if (pageId < 0) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    position++;
+    skipEmpty();
+}
+
+/**
+ * @brief Adds a batch of key value pairs in a single descent of the tree
+ * 
+ * The batch is sorted, then each internal page hands every child the 
+ *      slice of the batch that falls between its separators. A leaf merges
+ *      its slice in and, if that is too much for one page, spreads the 
+ *      result evenly over as many new right siblings as it needs. An 
+ *      internal page does the same with the separators its children send
+ *      back. Every page the batch touches is read once and written once.
+ * 
+ * @param entries -- sorted in place, a repeated key keeps its last value
+ */
+void IntIndex::addBatch(vector<pair<long, long>> &entries) {
+    unique_lock<shared_mutex> tree(treeLatch);
+    vector<pair<long, long>> promoted; // (separator, new page) for each new sibling of the root
+
+    sortEntries(entries);
+
+    if (entries.empty()) {
+        return;
+    }
+
+    filterChanged();
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        filter.add(entries[i].first);
+    }
+
+    insertBatch(meta.rootPage, entries, 0, entries.size(), promoted);
+    flushPendingPrev();
+
+    // the root split, grow new levels until everything hangs off one page
+    while (!promoted.empty()) {
+        vector<long> keys, children(1, meta.rootPage);
+        IndexPage root;
+
+        for (size_t i = 0; i < promoted.size(); i++) {
+            keys.push_back(promoted[i].first);
+            children.push_back(promoted[i].second);
+        }
+
+        promoted.clear();
+        meta.rootPage = allocatePage();
+        meta.height++;
+
+        root.type = OCCUPIED;
+        root.leaf = false;
+        root.next = -1;
+        root.prev = -1;
+
+        writeInternal(meta.rootPage, root, keys, children, promoted);
+    }
+
+    if (filterFull()) {
+        rebuildFilter(2 * meta.numKeys);
+    }
+}
+
+/**
+ * @brief inserts entries[begin, end) into the subtree at page
+ * 
+ * @param promoted -- gets (separator, page) for every new right sibling of page, in key order
+ */
+void IntIndex::insertBatch(long page, vector<pair<long, long>> &entries, size_t begin, size_t end, vector<pair<long, long>> &promoted) {
+    IndexPage node;
+
+    readPage(page, node);
+
+    if (node.leaf) {
+        vector<long> keys, values;
+        size_t i = begin;
+        int j = 0;
+
+        keys.reserve(node.numKeys + end - begin);
+        values.reserve(node.numKeys + end - begin);
+
+        while (i < end || j < node.numKeys) {
+            if (j >= node.numKeys || (i < end && entries[i].first < node.keys[j])) {
+                keys.push_back(entries[i].first);
+                values.push_back(entries[i].second);
+                countKeys(1);
+                i++;
+            } else if (i < end && entries[i].first == node.keys[j]) {
+                keys.push_back(entries[i].first);
+                values.push_back(entries[i].second);
+                i++;
+                j++;
+            } else {
+                keys.push_back(node.keys[j]);
+                values.push_back(node.children[j]);
+                j++;
+            }
+        }
+
+        writeLeaf(page, node, keys, values, promoted);
+        return;
+    }
+
+    vector<long> keys, children;
+    size_t start = begin;
+
+    for (int c = 0; c <= node.numKeys; c++) {
+        size_t stop = c == node.numKeys? end:
+            lower_bound(entries.begin() + start, entries.begin() + end, make_pair(node.keys[c], LONG_MIN)) - entries.begin();
+
+        if (c > 0) {
+            keys.push_back(node.keys[c - 1]);
+        }
+
+        children.push_back(node.children[c]);
+
+        if (stop > start) {
+            vector<pair<long, long>> childPromoted;
+
+            insertBatch(node.children[c], entries, start, stop, childPromoted);
+
+            for (size_t p = 0; p < childPromoted.size(); p++) {
+                keys.push_back(childPromoted[p].first);
+                children.push_back(childPromoted[p].second);
+            }
+        }
+
+        start = stop;
+    }
+
+    writeInternal(page, node, keys, children, promoted);
+}
+
+/**
+ * @brief writes a leaf's merged keys back, splitting them evenly over new right siblings if they do not fit
+ */
+void IntIndex::writeLeaf(long page, IndexPage &node, vector<long> &keys, vector<long> &values, vector<pair<long, long>> &promoted) {
+    long total = keys.size();
+    long pieces = (total + BTREE_MAX_KEYS - 1) / BTREE_MAX_KEYS;
+    long oldNext = node.next;
+    vector<long> pages(1, page);
+
+    for (long i = 1; i < pieces; i++) {
+        pages.push_back(allocatePage());
+    }
+
+    // a split leaf before us may have left this page a new prev
+    if (pendingPage == page) {
+        node.prev = pendingPrev;
+        pendingPage = -1;
+    } else {
+        flushPendingPrev();
+    }
+
+    for (long i = 0, start = 0; i < pieces; i++) {
+        long stop = total * (i + 1) / pieces;
+        IndexPage &out = node;
+
+        out.numKeys = stop - start;
+
+        for (long k = start; k < stop; k++) {
+            out.keys[k - start] = keys[k];
+            out.children[k - start] = values[k];
+        }
+
+        if (i > 0) {
+            out.prev = pages[i - 1];
+            promoted.push_back(make_pair(keys[start], pages[i]));
+        }
+
+        out.next = i == pieces - 1? oldNext: pages[i + 1];
+        writePage(pages[i], out);
+        start = stop;
+    }
+
+    // the old right neighbour now follows our last piece, fix it when we get to it or at the end
+    if (pieces > 1 && oldNext >= 0) {
+        pendingPage = oldNext;
+        pendingPrev = pages.back();
+    }
+}
+
+/**
+ * @brief writes an internal page's keys and children back, splitting them evenly if they do not fit
+ * 
+ * Between two pieces the key that separated them moves up into promoted
+ *      rather than staying in either piece.
+ */
+void IntIndex::writeInternal(long page, IndexPage &node, vector<long> &keys, vector<long> &children, vector<pair<long, long>> &promoted) {
+    long total = children.size();
+    long pieces = (total + BTREE_MAX_KEYS) / (BTREE_MAX_KEYS + 1);
+
+    for (long i = 0, start = 0; i < pieces; i++) {
+        long stop = total * (i + 1) / pieces;
+        long target = i == 0? page: allocatePage();
+
+        node.numKeys = stop - start - 1;
+
+        for (long c = start; c < stop; c++) {
+            node.children[c - start] = children[c];
+
+            if (c > start) {
+                node.keys[c - start - 1] = keys[c - 1];
+            }
+        }
+
+        if (i > 0) {
+            promoted.push_back(make_pair(keys[start - 1], target));
+        }
+
+        writePage(target, node);
+        start = stop;
+    }
+}
+
+/**
+ * @brief applies a prev link left over from a leaf split whose neighbour the batch never reached
+ */
+void IntIndex::flushPendingPrev() {
+    if (pendingPage >= 0) {
+        IndexPage node;
+        long page = pendingPage;
+
+        pendingPage = -1;
+        readPage(page, node);
+        node.prev = pendingPrev;
+        writePage(page, node);
+    }
+}
+
+/**
+ * @brief walks the whole tree checking ordering, occupancy, depth and the leaf chain
+ * 
+ * @return true -- the tree is well formed
+ */
+bool IntIndex::check() {
+    unique_lock<shared_mutex> tree(treeLatch);
+    long leaves = 0, count = 0, page, prev = -1;
+    IndexPage node;
+
+    if (!checkPage(meta.rootPage, 1, LONG_MIN, LONG_MAX, leaves)) {
+        return false;
+    }
+
+    // find the leftmost leaf, then make sure the chain visits every key in order
+    page = meta.rootPage;
+    readPage(page, node);
+
+    while (!node.leaf) {
+        page = node.children[0];
+        readPage(page, node);
+    }
+
+    while (page >= 0) {
+        readPage(page, node);
+
+        if (node.prev != prev) {
+            return false;
+        }
+
+        count += node.numKeys;
+        prev = page;
+        page = node.next;
+        leaves--;
+    }
+
+    return leaves == 0 && count == meta.numKeys;
+}
+
+bool IntIndex::checkPage(long page, int depth, long low, long high, long &leaves) {
+    IndexPage node;
+
+    readPage(page, node);
+
+    if (node.type != OCCUPIED || node.numKeys > BTREE_MAX_KEYS) {
+        return false;
+    } else if (page != meta.rootPage && node.numKeys < BTREE_MIN_KEYS) {
+        return false;
+    }
+
+    for (int i = 0; i < node.numKeys; i++) {
+        if (node.keys[i] < low || node.keys[i] >= high || (i > 0 && node.keys[i - 1] >= node.keys[i])) {
+            return false;
+        }
+    }
+
+    if (node.leaf) {
+        leaves++;
+        return depth == meta.height;
+    }
+
+    for (int i = 0; i <= node.numKeys; i++) {
+        long childLow = i == 0? low: node.keys[i - 1];
+        long childHigh = i == node.numKeys? high: node.keys[i];
+
+        if (!checkPage(node.children[i], depth + 1, childLow, childHigh, leaves)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+LsmRun::LsmRun(string fileName, long id) {
+    long trailer[6];    // count, pages, minKey, maxKey, filter blocks, LSM_MAGIC
+    long size, fenceBytes;
+
+    this->fileName = fileName;
+    this->id = id;
+    storage = BlockStorage::open(STORAGE_PREAD, fileName);
+
+    if (storage == NULL) {
+        throw DBException("Could not open run " + fileName);
+    }
+
+    size = storage->getSize();
+
+    if (size < (long) sizeof(trailer) || !storage->read(size - sizeof(trailer), (char*) trailer, sizeof(trailer)) || trailer[5] != LSM_MAGIC) {
+        delete storage;
+        throw DBException(fileName + " is not a complete run");
+    }
+
+    count = trailer[0];
+    minKey = trailer[2];
+    maxKey = trailer[3];
+    fences.resize(trailer[1]);
+    fenceBytes = fences.size() * sizeof(long);
+    filter.setNumBlocks(trailer[4]);
+
+    if (!storage->read(size - sizeof(trailer) - filter.getBytes(), filter.data(), filter.getBytes())
+     || !storage->read(size - sizeof(trailer) - filter.getBytes() - fenceBytes, (char*) fences.data(), fenceBytes)) {
+        delete storage;
+        throw DBException("Could not read run " + fileName);
+    }
+}
+
+LsmRun::~LsmRun() {
+    delete storage;
+}
+
+string LsmRun::getFileName() {
+    return fileName;
+}
+
+long LsmRun::getId() {
+    return id;
+}
+
+long LsmRun::getCount() {
+    return count;
+}
+
+long LsmRun::getNumPages() {
+    return fences.size();
+}
+
+long LsmRun::getMinKey() {
+    return minKey;
+}
+
+long LsmRun::getMaxKey() {
+    return maxKey;
+}
+
+long LsmRun::getBytes() {
+    return storage->getSize();
+}
+
+/**
+ * @brief the page the first key at or after key is on, or the page past the last
+ */
+long LsmRun::pageFor(long key) {
+    long page = upper_bound(fences.begin(), fences.end(), key) - fences.begin() - 1;
+
+    return max(0L, page);
+}
+
+void LsmRun::readPage(long page, vector<LsmEntry> &entries) {
+    long first = page * LSM_PAGE_ENTRIES;
+    long numEntries = max(0L, min((long) LSM_PAGE_ENTRIES, count - first));
+
+    entries.resize(numEntries);
+
+    if (!storage->read(page * PAGE_SIZE, (char*) entries.data(), numEntries * sizeof(LsmEntry))) {
+        throw DBException("Could not read run " + fileName);
+    }
+}
+
+/**
+ * @brief false when the run certainly does not hold key, then find reads nothing
+ */
+bool LsmRun::mayContain(long key) {
+    return count > 0 && key >= minKey && key <= maxKey && filter.mayContain(key);
+}
+
+/**
+ * @brief finds key in one page read, or none if the key is outside the run or its filter
+ * 
+ * @param key 
+ * @param value -- set when found, LSM_TOMBSTONE if the key was deleted
+ * @return true -- the run holds the key
+ */
+bool LsmRun::find(long key, long &value) {
+    vector<LsmEntry> entries;
+    vector<LsmEntry>::iterator it;
+
+    if (!mayContain(key)) {
+        return false;
+    }
+
+    readPage(pageFor(key), entries);
+    it = lower_bound(entries.begin(), entries.end(), key, [](const LsmEntry &entry, long key) {
+        return entry.key < key;
+    });
+
+    if (it == entries.end() || it->key != key) {
+        return false;
+    }
+
+    value = it->value;
+    return true;
+}
+
+/**
+ * @brief every page starts with its fence key, and the keys of the whole run strictly increase
+ */
+bool LsmRun::check() {
+    vector<LsmEntry> entries;
+    long seen = 0, last = 0;
+
+    for (long page = 0; page < getNumPages(); page++) {
+        readPage(page, entries);
+
+        if (entries.empty() || entries[0].key != fences[page]) {
+            return false;
+        }
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (seen > 0 && entries[i].key <= last) {
+                return false;
+            }
+
+            last = entries[i].key;
+            seen++;
+        }
+    }
+
+    return seen == count && (count == 0 || (fences[0] == minKey && last == maxKey));
+}
+
+
+/**
+ * @brief starts a run in fileName, replacing any run a compaction left half written there
+ * 
+ * @param fileName 
+ * @param expectedKeys -- what the filter is sized for, more is allowed but lets more absent keys through
+ */
+LsmRunWriter::LsmRunWriter(string fileName, long expectedKeys) {
+    remove(fileName.c_str());
+
+    this->fileName = fileName;
+    storage = BlockStorage::open(STORAGE_PREAD, fileName);
+
+    if (storage == NULL) {
+        throw DBException("Could not create run " + fileName);
+    }
+
+    count = 0;
+    offset = 0;
+    minKey = LONG_MAX;
+    maxKey = LONG_MIN;
+    filter.reset(expectedKeys);
+    pending.reserve(LSM_WRITE_PAGES * LSM_PAGE_ENTRIES);
+}
+
+LsmRunWriter::~LsmRunWriter() {
+    delete storage;
+}
+
+long LsmRunWriter::getCount() {
+    return count;
+}
+
+void LsmRunWriter::add(long key, long value) {
+    LsmEntry entry;
+
+    if (count > 0 && key <= maxKey) {
+        throw DBException("Keys must be added to a run in increasing order");
+    }
+
+    if (count % LSM_PAGE_ENTRIES == 0) {
+        fences.push_back(key);
+    }
+
+    entry.key = key;
+    entry.value = value;
+    pending.push_back(entry);
+    filter.add(key);
+    count++;
+    minKey = min(minKey, key);
+    maxKey = key;
+
+    if ((int) pending.size() == LSM_WRITE_PAGES * LSM_PAGE_ENTRIES) {
+        writePending();
+    }
+}
+
+void LsmRunWriter::writePending() {
+    long bytes = pending.size() * sizeof(LsmEntry);
+
+    if (bytes > 0 && !storage->write(offset, (char*) pending.data(), bytes)) {
+        throw DBException("Could not write run " + fileName);
+    }
+
+    offset += bytes;
+    pending.clear();
+}
+
+/**
+ * @brief writes what is left, the fences, the filter and the trailer, and syncs the run
+ * 
+ * @return long -- bytes in the run
+ */
+long LsmRunWriter::finish() {
+    long trailer[6] = {count, (long) fences.size(), minKey, maxKey, filter.getNumBlocks(), LSM_MAGIC};
+    long fenceBytes = fences.size() * sizeof(long);
+
+    writePending();
+
+    if (!storage->write(offset, (char*) fences.data(), fenceBytes)
+     || !storage->write(offset + fenceBytes, filter.data(), filter.getBytes())
+     || !storage->write(offset + fenceBytes + filter.getBytes(), (char*) trailer, sizeof(trailer))
+     || !storage->syncData()) {
+        throw DBException("Could not write run " + fileName);
+    }
+
+    offset += fenceBytes + filter.getBytes() + sizeof(trailer);
+    return offset;
+}
+
+
+/**
+ * @brief adds a run as the next source, starting at its first key at or after lowKey
+ * 
+ * @param run 
+ * @param lowKey 
+ */
+void LsmMerge::addRun(shared_ptr<LsmRun> run, long lowKey) {
+    Source source;
+
+    source.run = run;
+    source.position = 0;
+    source.nextPage = run->pageFor(lowKey);
+
+    while (fill(source) && source.entries[source.position].key < lowKey) {
+        source.position++;
+    }
+
+    sources.push_back(source);
+}
+
+/**
+ * @brief adds sorted entries held in memory as the next source, they are moved out of entries
+ * 
+ * @param entries 
+ */
+void LsmMerge::addEntries(vector<LsmEntry> &entries) {
+    Source source;
+
+    source.position = 0;
+    source.nextPage = 0;
+    source.entries.swap(entries);
+    sources.push_back(source);
+}
+
+/**
+ * @brief reads the source's next page once it is through the one it has
+ * 
+ * @return true -- the source has an entry at its position
+ */
+bool LsmMerge::fill(Source &source) {
+    while (source.position >= source.entries.size()) {
+        if (source.run == NULL || source.nextPage >= source.run->getNumPages()) {
+            return false;
+        }
+
+        source.run->readPage(source.nextPage++, source.entries);
+        source.position = 0;
+    }
+
+    return true;
+}
+
+/**
+ * @brief the smallest key left in any source, with the value of the first source that holds it
+ * 
+ * @param entry 
+ * @return false -- every source is done
+ */
+bool LsmMerge::next(LsmEntry &entry) {
+    int best = -1;
+
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (fill(sources[i]) && (best < 0 || sources[i].entries[sources[i].position].key < entry.key)) {
+            best = i;
+            entry = sources[i].entries[sources[i].position];
+        }
+    }
+
+    if (best < 0) {
+        return false;
+    }
+
+    // older sources holding the same key are shadowed
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (fill(sources[i]) && sources[i].entries[sources[i].position].key == entry.key) {
+            sources[i].position++;
+        }
+    }
+
+    return true;
+}
+
+
+LsmCursor::LsmCursor(shared_ptr<LsmMerge> merge) {
+    this->merge = merge;
+    valid = true;
+    next();
+}
+
+bool LsmCursor::isValid() {
+    return valid;
+}
+
+long LsmCursor::getKey() {
+    if (!valid) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    return entry.key;
+}
+
+long LsmCursor::getValue() {
+    if (!valid) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    return entry.value;
+}
+
+void LsmCursor::next() {
+    if (!valid) {
+        throw DBException("Cursor is past the last key");
+    }
+
+    do {
+        valid = merge->next(entry);
+    } while (valid && entry.value == LSM_TOMBSTONE);
+}
+
+
+LsmIndex::LsmIndex(string fileName, int memtableEntries) {
+    this->fileName = fileName;
+    this->memtableEntries = max(1, memtableEntries);
+    nextRun = 1;
+    compacting = false;
+    stopping = false;
+    compactorRunning = true;
+    runsWritten = 0;
+    bytesWritten = 0;
+    compactions = 0;
+    runReads = 0;
+    levels.resize(1);
+
+    loadManifest();
+    compactor = thread(&LsmIndex::compact, this);
+}
+
+LsmIndex::~LsmIndex() {
+    flush();
+
+    {
+        lock_guard<mutex> lock(latch);
+        stopping = true;
+    }
+
+    changed.notify_all();
+    compactor.join();
+}
+
+string LsmIndex::getEngine() {
+    return "lsm";
+}
+
+string LsmIndex::runName(long id) {
+    return fileName + "." + to_string(id) + ".run";
+}
+
+/**
+ * @brief opens the runs listed in the manifest, or writes an empty manifest for a new index
+ */
+void LsmIndex::loadManifest() {
+    BlockStorage *manifest = BlockStorage::open(STORAGE_PREAD, fileName);
+    long header[3];     // LSM_MANIFEST_MAGIC, nextRun, number of runs
+    vector<long> runs;
+
+    if (manifest == NULL) {
+        throw DBException("Could not open index file " + fileName);
+    } else if (manifest->getSize() == 0) {
+        delete manifest;
+        saveManifest();
+        return;
+    }
+
+    if (!manifest->read(0, (char*) header, sizeof(header)) || header[0] != LSM_MANIFEST_MAGIC) {
+        delete manifest;
+        throw DBException(fileName + " is not an LsmIndex file");
+    }
+
+    nextRun = header[1];
+    runs.resize(2 * header[2]);     // level and id of each run
+
+    if (!manifest->read(sizeof(header), (char*) runs.data(), runs.size() * sizeof(long))) {
+        delete manifest;
+        throw DBException("Could not read index file " + fileName);
+    }
+
+    delete manifest;
+
+    for (size_t i = 0; i < runs.size(); i += 2) {
+        if (runs[i] >= (long) levels.size()) {
+            levels.resize(runs[i] + 1);
+        }
+
+        levels[runs[i]].push_back(make_shared<LsmRun>(runName(runs[i + 1]), runs[i + 1]));
+    }
+
+    // a higher id is a newer run
+    sort(levels[0].begin(), levels[0].end(), [](const shared_ptr<LsmRun> &a, const shared_ptr<LsmRun> &b) {
+        return a->getId() > b->getId();
+    });
+}
+
+/**
+ * @brief writes the list of runs to a new file and renames it over the manifest, so a crash leaves the old list or the new one
+ * 
+ * Called with latch held.
+ */
+void LsmIndex::saveManifest() {
+    string temp = fileName + ".tmp";
+    BlockStorage *manifest;
+    vector<long> data;
+
+    data.push_back(LSM_MANIFEST_MAGIC);
+    data.push_back(nextRun);
+    data.push_back(0);
+
+    for (size_t level = 0; level < levels.size(); level++) {
+        for (size_t i = 0; i < levels[level].size(); i++) {
+            data.push_back(level);
+            data.push_back(levels[level][i]->getId());
+            data[2]++;
+        }
+    }
+
+    remove(temp.c_str());
+    manifest = BlockStorage::open(STORAGE_PREAD, temp);
+
+    if (manifest == NULL || !manifest->write(0, (char*) data.data(), data.size() * sizeof(long)) || !manifest->syncData()) {
+        delete manifest;
+        throw DBException("Could not write index file " + fileName);
+    }
+
+    delete manifest;
+
+    if (rename(temp.c_str(), fileName.c_str()) != 0) {
+        throw DBException("Could not replace index file " + fileName);
+    }
+}
+
+/**
+ * @brief looks in the memtable and the one being written out, called with latch held
+ * 
+ * @return true -- the key is there, value may be LSM_TOMBSTONE
+ */
+bool LsmIndex::findInMemory(long key, long &value) {
+    map<long, long>::iterator it = memtable.find(key);
+
+    if (it != memtable.end()) {
+        value = it->second;
+        return true;
+    }
+
+    if (frozen != NULL) {
+        it = frozen->find(key);
+
+        if (it != frozen->end()) {
+            value = it->second;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief every run from newest to oldest, called with latch held
+ */
+vector<shared_ptr<LsmRun>> LsmIndex::allRuns() {
+    vector<shared_ptr<LsmRun>> runs;
+
+    for (size_t level = 0; level < levels.size(); level++) {
+        runs.insert(runs.end(), levels[level].begin(), levels[level].end());
+    }
+
+    return runs;
+}
+
+/**
+ * @brief writes the memtable out as the newest run of level 0
+ * 
+ * The memtable is frozen and a new one takes writes while the run is 
+ *      written with the latch released. One memtable is written at a time,
+ *      and none while level 0 is LSM_L0_STALL runs deep, so writers cannot
+ *      outrun compaction for long.
+ * 
+ * @param lock -- holds latch, it is released while the run is written
+ */
+void LsmIndex::flushMemtable(unique_lock<mutex> &lock) {
+    shared_ptr<map<long, long>> writing;
+    shared_ptr<LsmRun> run;
+    long id, bytes;
+
+    while (frozen != NULL || ((int) levels[0].size() >= LSM_L0_STALL && compactorRunning)) {
+        changed.wait(lock);
+    }
+
+    if (memtable.empty()) {
+        return;
+    }
+
+    frozen = make_shared<map<long, long>>();
+    frozen->swap(memtable);
+    writing = frozen;
+    id = nextRun++;
+    lock.unlock();
+
+    try {
+        LsmRunWriter writer(runName(id), writing->size());
+
+        for (map<long, long>::iterator it = writing->begin(); it != writing->end(); it++) {
+            writer.add(it->first, it->second);
+        }
+
+        bytes = writer.finish();
+        run = make_shared<LsmRun>(runName(id), id);
+
+    } catch (DBException &e) {
+        // keep the changes, anything written since is newer
+        lock.lock();
+        memtable.insert(frozen->begin(), frozen->end());
+        frozen.reset();
+        changed.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    levels[0].insert(levels[0].begin(), run);
+    frozen.reset();
+    saveManifest();
+    runsWritten++;
+    bytesWritten += bytes;
+    changed.notify_all();
+}
+
+/**
+ * @brief picks the next merge, called with latch held
+ * 
+ * @param inputs -- the runs to merge, newest first
+ * @param outputLevel -- where the merged run goes
+ * @return true -- there is work to do
+ */
+bool LsmIndex::pickCompaction(vector<shared_ptr<LsmRun>> &inputs, int &outputLevel) {
+    long capacity = memtableEntries;
+
+    inputs.clear();
+
+    if ((int) levels[0].size() >= LSM_L0_RUNS) {
+        inputs = levels[0];
+        outputLevel = 1;
+
+    } else {
+        for (size_t level = 1; level < levels.size() && inputs.empty(); level++) {
+            capacity *= LSM_FANOUT;
+
+            if (!levels[level].empty() && levels[level][0]->getCount() > capacity) {
+                inputs.push_back(levels[level][0]);
+                outputLevel = level + 1;
+            }
+        }
+    }
+
+    if (!inputs.empty() && outputLevel < (int) levels.size() && !levels[outputLevel].empty()) {
+        inputs.push_back(levels[outputLevel][0]);
+    }
+
+    return !inputs.empty();
+}
+
+/**
+ * @brief the compactor thread, it merges runs until the index is closed
+ * 
+ * The merge reads every input once in order and writes one new run 
+ *      sequentially, all with the latch released. Lookups and cursors 
+ *      that took the old runs keep reading them until they let go, the 
+ *      files are unlinked but stay open. A merge into the last level with
+ *      data drops the tombstones, nothing older is left for them to hide.
+ */
+void LsmIndex::compact() {
+    unique_lock<mutex> lock(latch);
+
+    while (!stopping) {
+        vector<shared_ptr<LsmRun>> inputs;
+        shared_ptr<LsmRun> output;
+        int outputLevel;
+        bool last = true;
+        long id, bytes;
+
+        if (!pickCompaction(inputs, outputLevel)) {
+            changed.wait(lock);
+            continue;
+        }
+
+        for (size_t level = outputLevel + 1; level < levels.size(); level++) {
+            last = last && levels[level].empty();
+        }
+
+        id = nextRun++;
+        compacting = true;
+        lock.unlock();
+
+        try {
+            LsmMerge merge;
+            LsmEntry entry;
+            long inputKeys = 0;
+
+            for (size_t i = 0; i < inputs.size(); i++) {
+                merge.addRun(inputs[i], LONG_MIN);
+                inputKeys += inputs[i]->getCount();
+            }
+
+            LsmRunWriter writer(runName(id), inputKeys);
+
+            while (merge.next(entry)) {
+                if (!last || entry.value != LSM_TOMBSTONE) {
+                    writer.add(entry.key, entry.value);
+                }
+            }
+
+            bytes = writer.finish();
+
+            if (writer.getCount() > 0) {
+                output = make_shared<LsmRun>(runName(id), id);
+            }
+
+        } catch (DBException &e) {
+            cerr << "Compaction of " << fileName << " stopped" << endl;
+            lock.lock();
+            compacting = false;
+            compactorRunning = false;
+            changed.notify_all();
+            return;
+        }
+
+        lock.lock();
+
+        for (size_t level = 0; level < levels.size(); level++) {
+            for (size_t i = 0; i < inputs.size(); i++) {
+                levels[level].erase(remove(levels[level].begin(), levels[level].end(), inputs[i]), levels[level].end());
+            }
+        }
+
+        if ((int) levels.size() <= outputLevel) {
+            levels.resize(outputLevel + 1);
+        }
+
+        if (output != NULL) {
+            levels[outputLevel].push_back(output);
+        }
+
+        saveManifest();
+
+        for (size_t i = 0; i < inputs.size(); i++) {
+            remove(inputs[i]->getFileName().c_str());
+        }
+
+        if (output == NULL) {
+            remove(runName(id).c_str());
+        }
+
+        runsWritten++;
+        bytesWritten += bytes;
+        compactions++;
+        compacting = false;
+        changed.notify_all();
+    }
+}
+
+/**
+ * @brief waits until no compaction is running or waiting to run
+ */
+void LsmIndex::waitForCompaction() {
+    unique_lock<mutex> lock(latch);
+    vector<shared_ptr<LsmRun>> inputs;
+    int outputLevel;
+
+    while (compactorRunning && (compacting || pickCompaction(inputs, outputLevel))) {
+        changed.wait(lock);
+    }
+}
+
+long LsmIndex::size() {
+    LsmCursor cursor = seek(LONG_MIN);
+    long keys = 0;
+
+    while (cursor.isValid()) {
+        keys++;
+        cursor.next();
+    }
+
+    return keys;
+}
+
+int LsmIndex::getNumLevels() {
+    lock_guard<mutex> lock(latch);
+    return levels.size();
+}
+
+int LsmIndex::getNumRuns(int level) {
+    lock_guard<mutex> lock(latch);
+    return level < (int) levels.size()? levels[level].size(): 0;
+}
+
+long LsmIndex::getRunsWritten() {
+    return runsWritten;
+}
+
+/**
+ * @brief bytes of every run written, by flushes and compactions, so write amplification is this over the bytes added
+ */
+long LsmIndex::getBytesWritten() {
+    return bytesWritten;
+}
+
+long LsmIndex::getCompactions() {
+    return compactions;
+}
+
+/**
+ * @brief run pages read by lookups
+ */
+long LsmIndex::getRunReads() {
+    return runReads;
+}
+
+/**
+ * @brief Add a key value pair to the index, overwriting the value if the key exists
+ * 
+ * @param key 
+ * @param value -- anything but LSM_TOMBSTONE
+ */
+void LsmIndex::add(long key, long value) {
+    unique_lock<mutex> lock(latch);
+
+    if (value == LSM_TOMBSTONE) {
+        throw DBException("LSM_TOMBSTONE cannot be stored as a value");
+    }
+
+    memtable[key] = value;
+
+    if ((int) memtable.size() >= memtableEntries) {
+        flushMemtable(lock);
+    }
+}
+
+/**
+ * @brief adds every pair in order, a repeated key keeps its last value
+ * 
+ * @param entries 
+ */
+void LsmIndex::addBatch(vector<pair<long, long>> &entries) {
+    unique_lock<mutex> lock(latch);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].second == LSM_TOMBSTONE) {
+            throw DBException("LSM_TOMBSTONE cannot be stored as a value");
+        }
+
+        memtable[entries[i].first] = entries[i].second;
+
+        if ((int) memtable.size() >= memtableEntries) {
+            flushMemtable(lock);
+        }
+    }
+}
+
+/**
+ * @brief Delete a key by writing a tombstone over it
+ * 
+ * @param key 
+ * @return true -- the key was in the index
+ */
+bool LsmIndex::del(long key) {
+    unique_lock<mutex> lock(latch);
+    long value = LSM_TOMBSTONE;
+
+    if (!findInMemory(key, value)) {
+        vector<shared_ptr<LsmRun>> runs = allRuns();
+
+        lock.unlock();
+
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (runs[i]->mayContain(key)) {
+                runReads++;
+
+                if (runs[i]->find(key, value)) {
+                    break;
+                }
+            }
+        }
+
+        lock.lock();
+        findInMemory(key, value);   // a change made while the runs were read is newer
+    }
+
+    if (value == LSM_TOMBSTONE) {
+        return false;
+    }
+
+    memtable[key] = LSM_TOMBSTONE;
+
+    if ((int) memtable.size() >= memtableEntries) {
+        flushMemtable(lock);
+    }
+
+    return true;
+}
+
+/**
+ * @brief the value of key, from the newest place that has it
+ * 
+ * @param key 
+ * @return long -- -1 if the key is not in the index
+ */
+long LsmIndex::findByKey(long key) {
+    vector<shared_ptr<LsmRun>> runs;
+    long value;
+
+    {
+        lock_guard<mutex> lock(latch);
+
+        if (findInMemory(key, value)) {
+            return value == LSM_TOMBSTONE? -1: value;
+        }
+
+        runs = allRuns();
+    }
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (runs[i]->mayContain(key)) {
+            runReads++;
+
+            if (runs[i]->find(key, value)) {
+                return value == LSM_TOMBSTONE? -1: value;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief takes what the cursor will walk, the memtables are copied from lowKey on and the runs are held
+ * 
+ * @param lowKey 
+ * @param merge 
+ */
+void LsmIndex::snapshot(long lowKey, LsmMerge &merge) {
+    vector<shared_ptr<LsmRun>> runs;
+    map<long, long> *tables[2];
+
+    {
+        lock_guard<mutex> lock(latch);
+
+        tables[0] = &memtable;
+        tables[1] = frozen.get();
+
+        for (int t = 0; t < 2; t++) {
+            vector<LsmEntry> entries;
+
+            if (tables[t] == NULL) {
+                continue;
+            }
+
+            for (map<long, long>::iterator it = tables[t]->lower_bound(lowKey); it != tables[t]->end(); it++) {
+                LsmEntry entry;
+
+                entry.key = it->first;
+                entry.value = it->second;
+                entries.push_back(entry);
+            }
+
+            merge.addEntries(entries);
+        }
+
+        runs = allRuns();
+    }
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        merge.addRun(runs[i], lowKey);
+    }
+}
+
+/**
+ * @brief a cursor on the first key at or after lowKey
+ * 
+ * @param lowKey 
+ * @return LsmCursor 
+ */
+LsmCursor LsmIndex::seek(long lowKey) {
+    shared_ptr<LsmMerge> merge = make_shared<LsmMerge>();
+
+    snapshot(lowKey, *merge);
+    return LsmCursor(merge);
+}
+
+/**
+ * @brief writes the memtable out, after this every change so far survives a crash
+ */
+void LsmIndex::flush() {
+    unique_lock<mutex> lock(latch);
+
+    flushMemtable(lock);
+
+    while (frozen != NULL) {
+        changed.wait(lock);
+    }
+}
+
+/**
+ * @brief every run is sorted and matches its fences, and the levels below 0 hold one run each
+ */
+bool LsmIndex::check() {
+    vector<shared_ptr<LsmRun>> runs;
+
+    {
+        lock_guard<mutex> lock(latch);
+
+        for (size_t level = 1; level < levels.size(); level++) {
+            if (levels[level].size() > 1) {
+                return false;
+            }
+        }
+
+        runs = allRuns();
+    }
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (!runs[i]->check()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+/* ***************************************************** */
+/*                          Main                        */
+/* ***************************************************** */
+
+int main(int argc, char const *argv[]) {
+    string fileName = "IntIndex.idx";
+
+    if (argc > 1) {
+        fileName = argv[1];
+    }
 
     basicTest();
+    BlockStorageTest();
+    AsyncIOTest();
+    BufferPoolTest();
+    BlockAllocatorTest();
     MemoryManagerTest();
     FreeListNodeTest();
     TreeNodeTest();
+    BalancedTreeNodeTest();
+    TreeCursorTest();
+    MappedMemoryManagerTest();
+    IntIndexTest();
+    LsmIndexTest();
+    HashIndexTest();
+    WriteAheadLogTest();
+}
+
+
+/* ***************************************************** */
+/*                          Tests                        */
+/* ***************************************************** */
+
+
+int basicTest() {
+    cout << "hello from test" << endl;
+    return 0;
+}
+
+
+
+bool BufferPool::test() {
+    const int tests = 7, numThreads = 4;
+    bool pass[tests], allPass = true;
+    struct stat s;
+    char *page;
+    int testNum = 0;
+    string message = "";
+
+    cout << "Start\tBufferPool::test()" << endl;
+
+    {   // We test that a dirty page stays in memory until it is evicted
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Dirty pages are not written on unpin: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        extend(numFrames * 2 * pageSize);
+        page = pin(0);
+        strcpy(page, "page zero");
+        unpin(0, true);
+        stat("PoolTest.idx", &s);
+
+        pass[testNum] = s.st_size == 0
+                     && getMisses() == 1
+                     && getPageWrites() == 0
+                     && isCached(0);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that pinning a cached page is a hit
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Pinning a cached page is a hit: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        page = pin(0);
+        pass[testNum] = strcmp(page, "page zero") == 0
+                     && getHits() == 1
+                     && getMisses() == 1;
+        unpin(0, false);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that filling the pool evicts the dirty page to the file
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Eviction writes the dirty page back: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        for (int i = 1; i <= numFrames; i++) {
+            pin(i);
+            unpin(i, false);
+        }
+
+        page = pin(0); // page 0 has to come back from the file
+        pass[testNum] = strcmp(page, "page zero") == 0
+                     && getEvictions() >= 1
+                     && getPageWrites() == 1;
+        unpin(0, false);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that a pool with every frame pinned refuses new pages
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Pinning with every frame pinned throws: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        for (int i = 0; i < numFrames; i++) {
+            pin(i);
+        }
+
+        try {
+            pin(numFrames);
+        } catch (DBException &e) {
+            cout << endl;
+            pass[testNum] = true;
+        }
+
+        for (int i = 0; i < numFrames; i++) {
+            unpin(i, false);
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that flushAll writes every dirty page, up to the logical end of the file
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": flushAll writes dirty pages: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        page = pin(1);
+        strcpy(page, "page one");
+        unpin(1, true);
+        flushAll();
+        stat("PoolTest.idx", &s);
+
+        pass[testNum] = s.st_size == 2 * pageSize
+                     && getPageWrites() == 2;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that a batch prefetch reads all of its pages at once
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A batch prefetch keeps every read in flight: ";
+        cout << highlightCyan(message) << endl;
+        vector<long> pageIds = {4, 5, 6, 7, 7, numFrames * 2};  // a repeat and a page past the end are skipped
+        long misses = getMisses();
+
+        // execute
+        prefetch(pageIds);
+        page = pin(7);
+        unpin(7, false);
+
+        pass[testNum] = getPrefetches() == numFrames
+                     && getMisses() == misses
+                     && io->getMaxInFlight() >= numFrames
+                     && isCached(4) && isCached(5) && isCached(6)
+                     && !isCached(0);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test misses on several threads, each reading its page without the latch
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Threads missing at once each get the right page: ";
+        cout << highlightCyan(message) << endl;
+        vector<thread> threads;
+        atomic<int> wrong(0);
+        long misses;
+
+        for (int p = 0; p < numFrames * 2; p++) {
+            page = pin(p);
+            snprintf(page, pageSize, "page %d", p);
+            unpin(p, true);
+        }
+
+        flushAll();
+        misses = getMisses();
+
+        // execute
+        for (int t = 0; t < numThreads; t++) {
+            threads.push_back(thread([this, &wrong, t]() {
+                char expected[32];
+
+                for (int i = 0; i < 500; i++) {
+                    int p = (i * 7 + t) % (numFrames * 2);
+
+                    try {
+                        char *data = pin(p);
+                        snprintf(expected, sizeof(expected), "page %d", p);
+                        wrong += strcmp(data, expected) != 0;
+                        unpin(p, false);
+                    } catch (DBException &e) {
+                        wrong++;
+                    }
+                }
+            }));
+        }
+
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+
+        pass[testNum] = wrong == 0 && getMisses() > misses;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << "End\tBufferPool::test()" << endl;
+
+    return allPass;
+}
+
+
+bool BlockStorageTest() {
+    string dbFile = "StorageTest.bin";
+    const int tests = 6, numBlocks = 256, blockSize = 512, numThreads = 4;
+    const StorageKind kinds[] = {STORAGE_FSTREAM, STORAGE_PREAD, STORAGE_MAPPED, STORAGE_MEMORY};
+    bool pass[tests], allPass = true;
+    vector<char> out(numBlocks * blockSize), in(numBlocks * blockSize);
+    vector<long> order;
+    BlockStorage *storage;
+    struct stat s;
+    int testNum = 0;
+    string message = "";
+
+    cout << highlightGreen("\nBlockStorage Test") << endl;
+
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i] = i * 13 + i / blockSize;
+    }
+
+    for (long i = 0; i < numBlocks; i++) {
+        order.push_back(i);
+    }
+
+    shuffle(order.begin(), order.end(), mt19937(11));
+
+    for (int k = 0; k < 4; k++) {   // We test the same blocks written out of order and read back on each storage
+
+        // setup
+        remove(dbFile.c_str());
+        storage = BlockStorage::open(kinds[k], dbFile);
+        message = "\tTest " + to_string(testNum + 1) + ": " + (storage != NULL? storage->getName(): "?") + " reads back " + to_string(numBlocks) + " blocks from " + to_string(numThreads) + " threads: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = storage != NULL && storage->getSize() == 0;
+        fill(in.begin(), in.end(), 1);
+
+        // execute
+        for (int i = 0; pass[testNum] && i < numBlocks; i++) {
+            pass[testNum] = storage->write(order[i] * blockSize, &out[order[i] * blockSize], blockSize);
+        }
+
+        if (pass[testNum]) {
+            vector<thread> readers;
+            atomic<bool> ok(true);
+
+            for (int t = 0; t < numThreads; t++) {
+                readers.push_back(thread([&, t]() {
+                    for (int i = t; i < numBlocks; i += numThreads) {
+                        ok = storage->read(order[i] * blockSize, &in[order[i] * blockSize], blockSize) && ok;
+                    }
+                }));
+            }
+
+            for (int t = 0; t < numThreads; t++) {
+                readers[t].join();
+            }
+
+            char tail[blockSize];
+            memset(tail, 1, blockSize);
+
+            // a read that runs off the end is zero filled
+            pass[testNum] = ok
+                         && in == out
+                         && storage->getSize() == (long) out.size()
+                         && storage->read(out.size() - blockSize / 2, tail, blockSize)
+                         && memcmp(tail, &out[out.size() - blockSize / 2], blockSize / 2) == 0
+                         && count(tail + blockSize / 2, tail + blockSize, 0) == blockSize / 2
+                         && storage->sync();
+        }
+
+        delete storage;
+
+        // a file storage leaves exactly what was written behind, memory leaves nothing
+        if (kinds[k] == STORAGE_MEMORY) {
+            pass[testNum] = pass[testNum] && stat(dbFile.c_str(), &s) != 0;
+        } else {
+            pass[testNum] = pass[testNum] && stat(dbFile.c_str(), &s) == 0 && s.st_size == (long) out.size();
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that every file storage reads what another one wrote
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A file written through mmap reads back through fstream and pread: ";
+        cout << highlightCyan(message) << endl;
+        storage = BlockStorage::open(STORAGE_MAPPED, dbFile);
+        pass[testNum] = storage->write(0, &out[0], out.size());
+        delete storage;
+
+        // execute
+        for (int k = 0; k < 2; k++) {
+            storage = BlockStorage::open(kinds[k], dbFile);
+            fill(in.begin(), in.end(), 0);
+            pass[testNum] = pass[testNum]
+                         && storage->getSize() == (long) out.size()
+                         && storage->read(0, &in[0], in.size())
+                         && in == out;
+            delete storage;
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+        remove(dbFile.c_str());
+    }
+
+    {   // We test a Memory Manager with no file under it
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A tree in memory finds every key and leaves no data file: ";
+        cout << highlightCyan(message) << endl;
+        MemoryManager *mm = new MemoryManager(dbFile, POOL_FRAMES, STORAGE_MEMORY);
+        IndexRecord root;
+        long location;
+
+        mm->FreeListInit();
+        location = mm->getNextFreeLocation();
+        root.treeNode.init(mm, location, true);
+        pass[testNum] = mm->isMapped() && mm->getPool() == NULL && mm->getStorage()->getName() == "memory";
+
+        // execute
+        for (int i = 0; i < numBlocks; i++) {
+            root.treeNode.addBalanced(mm, order[i] * 2, order[i]);
+        }
+
+        for (int i = 0; i < numBlocks; i++) {
+            pass[testNum] = pass[testNum]
+                         && root.treeNode.findByKey(mm, i * 2) == i
+                         && root.treeNode.findByKey(mm, i * 2 + 1) == -1;
+        }
+
+        pass[testNum] = pass[testNum] && mm->nodeAt(location)->getKey() == root.treeNode.getKey();
+        delete mm;
+        pass[testNum] = pass[testNum] && stat(dbFile.c_str(), &s) != 0;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+        remove((dbFile + ".map").c_str());
+    }
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("BlockStorage Test Passed"): highlightRed("BlockStorage Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+
+bool AsyncIOTest() {
+    string dbFile = "AsyncTest.bin";
+    const int tests = 3, numBlocks = 64, blockSize = 4096;
+    const IOBackend backends[] = {IO_URING, IO_THREAD_POOL};
+    bool pass[tests], allPass = true;
+    vector<char> out(numBlocks * blockSize), in(numBlocks * blockSize);
+    vector<IORequest> requests(numBlocks);
+    AsyncIO *io;
+    int testNum = 0, fd;
+    string message = "";
+
+    cout << highlightGreen("\nAsyncIO Test") << endl;
+
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i] = i * 7 + i / blockSize;
+    }
+
+    for (int b = 0; b < 2; b++) {   // We test a batch of writes and reads on each backend
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": " + (b == 0? "io_uring": "Thread pool") + " writes and reads back " + to_string(numBlocks) + " blocks: ";
+        cout << highlightCyan(message) << endl;
+        remove(dbFile.c_str());
+        fd = open(dbFile.c_str(), O_RDWR | O_CREAT, 0644);
+        fill(in.begin(), in.end(), 0);
+
+        try {
+            io = AsyncIO::open(fd, backends[b]);
+        } catch (DBException &e) {
+            cout << "\t\tio_uring is not available here, skipped" << endl;
+            pass[testNum++] = true;
+            close(fd);
+            continue;
+        }
+
+        // execute
+        for (int i = 0; i < numBlocks; i++) {
+            // written back to front so the blocks do not land in file order
+            requests[i] = {true, &out[(numBlocks - 1 - i) * blockSize], blockSize, (long) (numBlocks - 1 - i) * blockSize, 0, false};
+        }
+
+        io->run(requests);
+
+        for (int i = 0; i < numBlocks; i++) {
+            requests[i] = {false, &in[i * blockSize], blockSize, (long) i * blockSize, 0, false};
+        }
+
+        io->run(requests);
+
+        pass[testNum] = in == out
+                     && io->getSubmitted() == 2 * numBlocks
+                     && io->getMaxInFlight() == IO_DEPTH;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+        delete io;
+        close(fd);
+    }
+
+    {   // We test that a read running off the end of the file comes back short
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A read past the end of the file is short: ";
+        cout << highlightCyan(message) << endl;
+        fd = open(dbFile.c_str(), O_RDWR);
+        io = AsyncIO::open(fd);
+        requests.resize(2);
+        requests[0] = {false, &in[0], 2 * blockSize, (long) (numBlocks - 1) * blockSize, 0, false};
+        requests[1] = {false, &in[2 * blockSize], blockSize, (long) numBlocks * blockSize, 0, false};
+
+        // execute
+        io->run(requests);
+
+        pass[testNum] = requests[0].result == blockSize
+                     && requests[1].result == 0
+                     && requests[0].done && requests[1].done;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        cout << "\t\tUsing " << io->getName() << endl;
+        testNum++;
+        delete io;
+        close(fd);
+        remove(dbFile.c_str());
+    }
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("AsyncIO Test Passed"): highlightRed("AsyncIO Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+
+bool BufferPoolTest() {
+    bool pass = true;
+    ofstream t;
+
+    cout << highlightGreen("\nBufferPool Test") << endl;
+
+    t.open("PoolTest.idx");
+    t.close();
+
+    BufferPool pool("PoolTest.idx", 512, 4);
+    pass = pool.test();
+
+    cout << (pass? highlightGreen("BufferPool Test Passed"): highlightRed("BufferPool Test Failed")) << endl << endl;
+
+    return pass;
+}
+
+
+bool BlockAllocatorTest() {
+    string mapFile = "AllocTest.map";
+    const int tests = 5;
+    bool pass[tests], allPass = true;
+    BlockAllocator *allocator;
+    int testNum = 0;
+    string message = "";
+
+    cout << highlightGreen("\nBlockAllocator Test") << endl;
+    remove(mapFile.c_str());
+    allocator = new BlockAllocator(mapFile, 1000);
+
+    {   // We test allocating with nothing free
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": An empty map allocates from the end of the file: ";
+        cout << highlightCyan(message) << endl;
+
+        // execute
+        pass[testNum] = allocator->allocate(1, -1, 1000) == 1000 /* non-destructive */
+                     && allocator->allocate(4, 10, 1000) == 1000
+                     && allocator->getNumBlocks()  == 0
+                     && allocator->getFreeBlocks() == 0;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that the hint picks the free block after it
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Allocating near a hint: ";
+        cout << highlightCyan(message) << endl;
+
+        for (long i = 100; i < 900; i += 100) {
+            allocator->release(i, 1);
+        }
+
+        // execute
+        pass[testNum] = allocator->getFreeBlocks() == 8
+                     && allocator->allocate(1, 450, 1000) == 500
+                     && allocator->allocate(1, 450, 1000) == 600
+                     && allocator->allocate(1, 850, 1000) == 100 /* wraps around */
+                     && allocator->allocate(1, -1, 1000)  == 200
+                     && !allocator->isFree(500)
+                     && allocator->isFree(300)
+                     && allocator->getFreeBlocks() == 4;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test contiguous runs
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Allocating contiguous runs: ";
+        cout << highlightCyan(message) << endl;
+        allocator->release(40, 3);
+        allocator->release(60, 64);     // crosses a word
+        allocator->release(995, 5);     // the file ends in free blocks
+
+        // execute
+        pass[testNum] = allocator->allocate(3, -1, 1000)  == 40
+                     && allocator->allocate(10, -1, 1000) == 60
+                     && allocator->allocate(54, -1, 1000) == 70
+                     && allocator->allocate(8, -1, 1000)  == 995 /* runs past the end of the file */
+                     && !allocator->isFree(999)
+                     && allocator->allocate(1, 990, 1000) == 300;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that freeing a free block is caught
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Freeing a free block throws: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        try {
+            allocator->release(400, 1);
+        } catch (DBException &e) {
+            cout << endl;
+            pass[testNum] = allocator->getFreeBlocks() == 3;
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that only a cleanly closed map survives a reopen
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Reopening a closed map and an unclean one: ";
+        cout << highlightCyan(message) << endl;
+        allocator->close();
+        delete allocator;
+
+        // execute
+        allocator = new BlockAllocator(mapFile, 1000);
+        pass[testNum] = allocator->getFreeBlocks() == 3
+                     && allocator->isFree(400)
+                     && allocator->isFree(800)
+                     && !allocator->isFree(999);
+        delete allocator; // never closed
+
+        allocator = new BlockAllocator(mapFile, 1000);
+        pass[testNum] = pass[testNum] && allocator->getFreeBlocks() == 0 && !allocator->isFree(400);
+        allocator->release(400, 1);
+        allocator->close();
+        delete allocator;
+
+        allocator = new BlockAllocator(mapFile, 100); // the file shrank, the map is not for it
+        pass[testNum] = pass[testNum] && allocator->getFreeBlocks() == 0;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    delete allocator;
+    remove(mapFile.c_str());
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("BlockAllocator Test Passed"): highlightRed("BlockAllocator Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+bool MemoryManager::test() {
+    const int tests = 9;
+    bool pass[tests], allPass = true;
+    // IndexRecord record, fln;
+    IndexRecord record, rec2;
+    FreeListNode fln;
+    int location, testNum = 0;
+    string message = "";
+    
+    cout << "Start\tMemoryManager::test()" << endl;
+    
+    /*
+        First, We test the basic 
+    */
+    
+    {   // We test blockSize = sizeof(IndexRecord)
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Block Size == sizeof(IndexRecord):  ";
+        cout << highlightCyan(message) << sizeof(IndexRecord) << endl;
+        pass[testNum] = false;
+
+        // execute
+        pass[testNum] = getBlockSize() == sizeof(IndexRecord);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    } 
+
+    {   // We test that the file is open
+    
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": File is open: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        pass[testNum] = storage != NULL;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+
+    {   // We test getNumLocations
+    
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": getNumLocations: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        
+        // execute
+        pass[testNum] = getNumLocations() == 0;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+
+    {   // We test writing to the index file
+    
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Writing to the index file:";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        location = 2;
+
+        // execute
+        record.freeNode.init(this, location);
+        writeAt(location, record);
+        pass[testNum] = getNumLocations() == (location + 1);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+
+    {   // We test reading from the index file
+    
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Reading from the index file: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+     
+        // execute
+        readAt(location, fln); // we test on both a FreeListNode and an IndexRecord
+        readAt(location, rec2);
+
+        pass[testNum] = rec2.freeNode.type              == record.freeNode.type
+                     && rec2.freeNode.location          == record.freeNode.location
+                     && rec2.freeNode.getNextLocation() == record.freeNode.getNextLocation()
+                     && fln.type                        == record.freeNode.type
+                     && fln.location                    == record.freeNode.location
+                     && fln.getNextLocation()           == record.freeNode.getNextLocation();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+
+    {   // We test FreeListInit and memory management
+    
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": FreeListInit and memory management: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        
+        // execute
+        FreeListInit();
+        readAt(0, fln);
+        pass[testNum] = fln.type == FreeListHead.freeNode.type
+               && fln.location == FreeListHead.freeNode.location
+               && fln.getNextLocation() == FreeListHead.freeNode.getNextLocation();
+               
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test getNextFreeLocation, its important to test when it is a root node
+    
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": getNextFreeLocation: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        pass[testNum] = getNextFreeLocation() == location + 1 /* non-destructive */
+                     && getNextFreeLocation() == location + 1; /* non-destructive */
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test free location 
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": freeLocation: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        freeLocation(location);
+        pass[testNum] = getNextFreeLocation() == location /* destructive */
+                        && getNumLocations() == location + 1
+                        && getNextFreeLocation() == location + 1; /* non-destructive */
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that reusing freed locations never touches the file
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Freeing and reusing a location without I/O: ";
+        cout << highlightCyan(message) << endl;
+        long pins = pool->getHits() + pool->getMisses();
+
+        // execute
+        freeLocation(location);
+        pass[testNum] = getNextFreeLocation(0) == location
+                     && pool->getHits() + pool->getMisses() == pins;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << "End\tMemoryManager::test()" << endl;
+
+    return allPass;
+}
+
+
+bool MemoryManagerTest() {
+    bool pass = true;
+    MemoryManager *mm;
+    
+    cout << highlightGreen("\nMemoryManager Test") << endl;
+    
+    mm = new MemoryManager("test.idx");
+    pass = mm->test();
+    delete mm;
+
+    cout << (pass? highlightGreen("MemoryManager Test Passed"): highlightRed("MemoryManager Test Failed")) << endl << endl;
+    
+    return pass;
+}
+
+
+bool FreeListNodeTest() {
+    string dbFile = "FreeTest.idx";
+    int tests = 7, retval = -2;
+    bool pass[tests], allPass = true;
+    MemoryManager *mm;
+    IndexRecord record;
+
+
+    cout << highlightGreen("\nFreeListNode Test") << endl;
+    mm = new MemoryManager(dbFile);
+    
+    {   // We test the creation of the head free node
+        // setup
+        cout << highlightCyan("\tTest 1: Creation of the head free node: ") << endl;
+        pass[0] = false;
+
+        // execute
+        record.freeNode.init(mm, 0);
+        pass[0] = record.freeNode.type == FREE 
+            && record.freeNode.location == 0
+            && record.freeNode.getNextLocation() == -1;
+
+        // cleanup
+        cout << "\t\t" << (pass[0]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+    }
+
+
+    {   // We test the isEmpty method when list is empty
+        // setup
+        cout << highlightCyan("\tTest 2: isEmpty method when list is empty: ") << endl;
+        pass[1] = false;
+
+        // execute
+        pass[1] = record.freeNode.isEmpty();
+
+
+        // cleanup
+        cout << "\t\t" << (pass[1]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+    }
+
+    {   // We test pushing a new location onto the free list
+        // setup
+        cout << highlightCyan("\tTest 3: Pushing a new location onto the free list:") << endl;
+        pass[2] = false;
+
+        // execute
+        record.freeNode.push(mm, 2);
+        pass[2] = record.freeNode.type == FREE 
+            && record.freeNode.location == 0
+            && record.freeNode.getNextLocation() == 2;
+
+        // cleanup
+        cout << "\t\t" << (pass[2]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+    }
+
+    {   // We test isEmpty method when list is not empty
+        // setup
+        cout << highlightCyan("\tTest 4: isEmpty method when list is not empty: ") << endl;
+        pass[3] = false;
+
+        // execute
+        pass[3] = !record.freeNode.isEmpty();
+
+        // cleanup
+        cout << "\t\t" << (pass[3]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+    }
+
+    {   // We test pushing another element onto the free list
+        // setup
+        cout << highlightCyan("\tTest 5: Pushing another element onto the free list: ") << endl;
+        pass[4] = false;
+
+        // execute
+        record.freeNode.push(mm, 7);
+        pass[4] = record.freeNode.type == FREE 
+            && record.freeNode.location == 0
+            && record.freeNode.getNextLocation() == 7;
+
+        // cleanup
+        cout << "\t\t" << (pass[4]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+    }
+
+
+    {   // We test popping a location off the free list
+        // setup
+        cout << highlightCyan("\tTest 6: Popping a location off the free list: ") << endl;
+        pass[5] = false;
+
+        // cout << record.freeNode.nextLocation << " " << retval << endl;
+        // execute
+        retval = record.freeNode.pop(mm);
+        pass[5] = record.freeNode.type == FREE 
+            && record.freeNode.location == 0
+            && record.freeNode.getNextLocation() == 2
+            && retval == 7;
+
+
+        // cout << record.freeNode.nextLocation << " " << retval << endl;
+        // cleanup
+        cout << "\t\t" << (pass[5]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        retval = -2;
+    }
+
+
+    {   // We test that we can recover items pushed onto the free list in reverse order
+        // setup
+        cout << highlightCyan("\tTest 7: Recovering items pushed onto the free list in reverse order: ") << endl;
+        pass[6] = true;
+        int items[10] = {
+            11, 2, 3, 4, 5, 6, 7, 8, 9, 10
+        };
+
+        // execute
+        for(int i = 0; i < 10; i++) {
+            record.freeNode.push(mm, items[i]);
+        }
+
+        for(int i = 9; i >= 0; i--) {
+            retval = record.freeNode.pop(mm);
+            pass[6] = pass[6] && (retval == items[i]);
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[6]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+    }
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+        if (!pass[i]) {
+            cout << "\t\tTest " << i+1 << " failed" << endl;
+        }
+    }
+
+    cout << (allPass? highlightGreen("FreeListNode Test Passed"): highlightRed("FreeListNode Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+
+bool TreeNodeTest() {
+    string dbFile = "TreeTest.idx";
+    const int tests = 6, numRecords = 7;
+    long keys[numRecords], values[numRecords];
+    bool pass[tests], allPass = true, tempResult = false;
+    MemoryManager *mm;
+    IndexRecord firstRecord, secondRecord, thirdRecord;
+    int location, testNum = 0;
+    string message = "";
+    
+    cout << highlightGreen("\nTreeNode Test") << endl;
+    mm = new MemoryManager(dbFile);
+    mm->FreeListInit();
+
+    {   // We test the creation of the root of our binary tree
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Creation of the root of our binary tree: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        location = mm->getNextFreeLocation();
+
+
+        // execute
+        firstRecord.treeNode.init(mm, location, false);
+        secondRecord.treeNode.from(mm, location);
+        
+        pass[testNum] = firstRecord.treeNode.type               == secondRecord.treeNode.type
+                     && firstRecord.treeNode.getLocation()      == secondRecord.treeNode.getLocation()
+                     && firstRecord.treeNode.getLeftLocation()  == secondRecord.treeNode.getLeftLocation()
+                     && firstRecord.treeNode.getRightLocation() == secondRecord.treeNode.getRightLocation()
+                     && firstRecord.treeNode.getKey()           == secondRecord.treeNode.getKey()
+                     && firstRecord.treeNode.getValue()         == secondRecord.treeNode.getValue()
+                     && location                                == 1 /* The root must always be placed after the free list head */
+                     && firstRecord.treeNode.isLeaf()
+                     && !firstRecord.treeNode.isRoot();
+
+        firstRecord.treeNode.setRoot(true);
+        pass[testNum] = pass[testNum] && firstRecord.treeNode.isRoot();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    } 
+
+    {   // We test adding a key value pair to the root of our binary tree
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Adding a key value pair to the root of our binary tree: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false; 
+        keys[0] = 20;
+        values[0] = 12;
+
+        // execute
+        firstRecord.treeNode.add(mm, keys[0], values[0]);
+        pass[testNum] = firstRecord.treeNode.getKey()   == keys[0]
+                     && firstRecord.treeNode.getValue() == values[0]
+                     && mm->getNumLocations()           == 2
+                     && firstRecord.treeNode.isLeaf();
+
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test adding a left node to the root of our binary tree
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Adding a left node to the root of our binary tree: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        keys[1] = 10;
+        values[1] = 11;
+
+        // execute
+        firstRecord.treeNode.add(mm, keys[1], values[1]);
+        pass[testNum] = firstRecord.treeNode.getLeftLocation()  != -1
+                     && firstRecord.treeNode.getRightLocation() == -1
+                     && mm->getNumLocations()                   == 3
+                     && !firstRecord.treeNode.isLeaf();
+
+        if (pass[testNum]) {
+            mm->readAt(firstRecord.treeNode.getLeftLocation(), secondRecord);
+            pass[testNum] = secondRecord.treeNode.getKey()   == keys[1]
+                         && secondRecord.treeNode.getValue() == values[1]
+                         && secondRecord.treeNode.isLeaf();
+        }
+
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // we test adding a right node to the root of our binary tree
+    
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Adding a right node to the root of our binary tree: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        keys[2] = 30;
+        values[2] = 13;
+
+        // execute
+        firstRecord.treeNode.add(mm, keys[2], values[2]);
+        pass[testNum] = firstRecord.treeNode.getLeftLocation()  != -1
+                     && firstRecord.treeNode.getRightLocation() != -1
+                     && mm->getNumLocations()                   == 4
+                     && !firstRecord.treeNode.isLeaf();
+
+        if (pass[testNum]) {
+            mm->readAt(firstRecord.treeNode.getRightLocation(), secondRecord);
+            pass[testNum] = secondRecord.treeNode.getKey()   == keys[2]
+                         && secondRecord.treeNode.getValue() == values[2]
+                         && secondRecord.treeNode.isLeaf();
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+
+    {   // We test all paths of the delete function
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": All paths of our del method, ending with the root node: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        keys[3] = 40;
+        values[3] = 14;
+        keys[4] = 5;
+        values[4] = 16;
+        keys[5] = 15;
+        values[5] = 17;
+
+        // execute
+        firstRecord.treeNode.add(mm, keys[3], values[3]);
+
+
+        pass[testNum] = firstRecord.treeNode.getLeftLocation()  != -1
+                     && firstRecord.treeNode.getRightLocation() != -1
+                     && mm->getNumLocations()                   == 5
+                     && !firstRecord.treeNode.isLeaf();
+
+
+        if (pass[testNum]) {
+            cout << highlightYellow("\t\tCases: 7->3") << endl;
+
+            firstRecord.treeNode.del(mm, keys[2]);
+            secondRecord.treeNode.from(mm, firstRecord.treeNode.getRightLocation());
+
+            pass[testNum] = secondRecord.treeNode.getKey()   == keys[3]
+                         && secondRecord.treeNode.getValue() == values[3]
+                         && mm->getNumLocations()            == 5
+                         && secondRecord.treeNode.isLeaf();
+
+            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        }
+
+        firstRecord.treeNode.add(mm, keys[4], values[4]);
+        firstRecord.treeNode.add(mm, keys[5], values[5]);
+
+        if (pass[testNum]) {
+            cout << highlightYellow("\t\tCases: 6->5") << endl;
+
+            // firstRecord.treeNode.from(mm, firstRecord.treeNode.getLocation());
+
+            firstRecord.treeNode.del(mm, keys[1]);
+            secondRecord.treeNode.from(mm, firstRecord.treeNode.getLeftLocation());
+
+            pass[testNum] = secondRecord.treeNode.getKey()   == keys[4]
+                         && secondRecord.treeNode.getValue() == values[4]
+                         && mm->getNumLocations()            == 6
+                         && !secondRecord.treeNode.isLeaf();
+
+            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        }
+
+        if(pass[testNum]) {
+            cout << highlightYellow("\t\tCases: 6->7->2") << endl;
+
+            firstRecord.treeNode.del(mm, keys[5]);
+            secondRecord.treeNode.from(mm, firstRecord.treeNode.getLeftLocation());
+
+            pass[testNum] = secondRecord.treeNode.getKey()   == keys[4]
+                         && secondRecord.treeNode.getValue() == values[4]
+                         && mm->getNumLocations()            == 6
+                         && secondRecord.treeNode.isLeaf();
+
+            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        }
+
+        if(pass[testNum]) {
+            cout << highlightYellow("\t\tCases: 7->2") << endl;
+
+            firstRecord.treeNode.del(mm, keys[3]);
+            secondRecord.treeNode.from(mm, firstRecord.treeNode.getLeftLocation());
+
+            pass[testNum] = firstRecord.treeNode.getRightLocation() == -1 
+                         && secondRecord.treeNode.getKey()          == keys[4]
+                         && secondRecord.treeNode.getValue()        == values[4]
+                         && mm->getNumLocations()                   == 6
+                         && secondRecord.treeNode.isLeaf();
+            
+            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        }
+
+        if(pass[testNum]) {
+            cout << highlightYellow("\t\tCase: 4") << endl;
+
+            firstRecord.treeNode.del(mm, keys[0]);
+
+            pass[testNum] = firstRecord.treeNode.getKey()           == keys[4]
+                         && firstRecord.treeNode.getValue()         == values[4]
+                         && firstRecord.treeNode.getLeftLocation()  == -1
+                         && firstRecord.treeNode.getRightLocation() == -1
+                         && mm->getNumLocations()                   == 6
+                         && firstRecord.treeNode.isLeaf();
+
+            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        }
+
+        if (pass[testNum]) {
+            cout << highlightYellow("\t\tCase: 1") << endl;
+
+            firstRecord.treeNode.del(mm, keys[4]);
+
+            firstRecord.treeNode.from(mm, firstRecord.treeNode.getLocation());
+
+            pass[testNum] = firstRecord.treeNode.getKey()           == -1
+                         && firstRecord.treeNode.getValue()         == -1
+                         && firstRecord.treeNode.getLeftLocation()  == -1
+                         && firstRecord.treeNode.getRightLocation() == -1
+                         && mm->getNumLocations()                   == 6
+                         && firstRecord.treeNode.isLeaf();
+
+            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+
+    {   // We test that add and del only write the nodes they change
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Each add writes at most 2 blocks and each del at most 2, at any depth: ";
+        cout << highlightCyan(message) << endl;
+        const int treeKeys = 500;
+        vector<long> order;
+        long writes, maxAdd = 0, maxUpdate = 0, maxDel = 0;
+
+        for (long i = 0; i < treeKeys; i++) {
+            order.push_back(i * 3);
+        }
+
+        shuffle(order.begin(), order.end(), mt19937(21));
+
+        // execute
+        for (int i = 0; i < treeKeys; i++) {
+            writes = mm->getBlockWrites();
+            firstRecord.treeNode.add(mm, order[i], order[i] + 1);
+            maxAdd = max(maxAdd, mm->getBlockWrites() - writes);
+        }
+
+        for (int i = 0; i < treeKeys; i += 5) {
+            writes = mm->getBlockWrites();
+            firstRecord.treeNode.add(mm, order[i], order[i] + 2);
+            maxUpdate = max(maxUpdate, mm->getBlockWrites() - writes);
+        }
+
+        for (int i = treeKeys - 1; i > 0; i -= 2) {
+            writes = mm->getBlockWrites();
+            firstRecord.treeNode.del(mm, order[i]);
+            maxDel = max(maxDel, mm->getBlockWrites() - writes);
+        }
+
+        pass[testNum] = maxAdd == 2 && maxUpdate == 1 && maxDel <= 2;
+
+        for (int i = 0; i < treeKeys; i++) {
+            long expected = i % 2 == 1? -1: order[i] + (i % 5 == 0? 2: 1);
+            pass[testNum] = pass[testNum] && firstRecord.treeNode.findByKey(mm, order[i]) == expected;
+        }
+
+        cout << "\t\tMost blocks written by an add " << maxAdd << ", an update " << maxUpdate << ", a del " << maxDel << endl;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("TreeNode Test Passed"): highlightRed("TreeNode Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+bool BalancedTreeNodeTest() {
+    string dbFile = "BalancedTest.idx";
+    const int tests = 5, numRecords = 1000;
+    bool pass[tests], allPass = true;
+    MemoryManager *mm;
+    IndexRecord root, node;
+    int location, testNum = 0;
+    string message = "";
+
+    cout << highlightGreen("\nBalanced TreeNode Test") << endl;
+    remove(dbFile.c_str());
+    remove((dbFile + ".map").c_str());
+    mm = new MemoryManager(dbFile);
+    mm->FreeListInit();
+    location = mm->getNextFreeLocation();
+    root.treeNode.init(mm, location, true);
+
+    {   // We test that rotations keep the root at its location
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A rotation at the root keeps the root in place: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        root.treeNode.addBalanced(mm, 1, 10);
+        root.treeNode.addBalanced(mm, 2, 20);
+        root.treeNode.addBalanced(mm, 3, 30); // forces a left rotation at the root
+        node.treeNode.from(mm, location);
+
+        pass[testNum] = node.treeNode.getKey()      == 2
+                     && node.treeNode.getValue()    == 20
+                     && node.treeNode.getHeight()   == 2
+                     && node.treeNode.isRoot()
+                     && root.treeNode.getKey()      == 2
+                     && mm->getNumLocations()       == 4
+                     && root.treeNode.isBalanced(mm);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test autoincrement inserts, which degenerate the unbalanced tree into a list
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": " + to_string(numRecords) + " ascending keys stay O(log n) high: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        for (int i = 4; i <= numRecords; i++) {
+            root.treeNode.addBalanced(mm, i, i * 10);
+        }
+
+        pass[testNum] = root.treeNode.getHeight() <= 14 /* 1.44 * log2(1000) */
+                     && mm->getNumLocations()     == numRecords + 1
+                     && root.treeNode.isBalanced(mm);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test deleting every other key, the freed locations go back to the free space map
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Deleting half of the keys keeps the tree balanced: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        for (int i = 2; i <= numRecords; i += 2) {
+            root.treeNode.delBalanced(mm, i);
+        }
+
+        pass[testNum] = root.treeNode.isBalanced(mm)
+                     && root.treeNode.getHeight() <= 13;
+
+        for (int i = 2; i <= numRecords; i += 2) {
+            root.treeNode.addBalanced(mm, i, i * 10);
+        }
+
+        pass[testNum] = pass[testNum]
+                     && mm->getNumLocations()     == numRecords + 1 /* every location was reused */
+                     && root.treeNode.isBalanced(mm);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test deleting every key, ending with an empty root
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Deleting every key leaves an empty root: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        for (int i = numRecords; i >= 1; i--) {
+            root.treeNode.delBalanced(mm, i);
+        }
+
+        node.treeNode.from(mm, location);
+        pass[testNum] = !node.treeNode.isValid()
+                     && node.treeNode.isLeaf()
+                     && node.treeNode.getHeight() == 0;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    delete mm;
+
+    {   // We test two trees in their own files, built at the same time on two threads
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Two trees built on two threads at once: ";
+        cout << highlightCyan(message) << endl;
+        string files[2] = {"BalancedTestA.idx", "BalancedTestB.idx"};
+        MemoryManager *managers[2];
+        IndexRecord roots[2];
+        thread builders[2];
+
+        for (int t = 0; t < 2; t++) {
+            remove(files[t].c_str());
+            remove((files[t] + ".map").c_str());
+            managers[t] = new MemoryManager(files[t]);
+            managers[t]->FreeListInit();
+            roots[t].treeNode.init(managers[t], managers[t]->getNextFreeLocation(), true);
+        }
+
+        // execute
+        for (int t = 0; t < 2; t++) {
+            builders[t] = thread([&roots, &managers, t]() {
+                for (int i = 1; i <= numRecords; i++) {
+                    roots[t].treeNode.addBalanced(managers[t], i * 2 + t, t);
+                }
+            });
+        }
+
+        for (int t = 0; t < 2; t++) {
+            builders[t].join();
+        }
+
+        pass[testNum] = true;
+
+        for (int t = 0; t < 2; t++) {
+            pass[testNum] = pass[testNum]
+                         && roots[t].treeNode.isBalanced(managers[t])
+                         && roots[t].treeNode.findByKey(managers[t], 500 + t) == t
+                         && roots[t].treeNode.findByKey(managers[t], 501 - t) == -1
+                         && managers[t]->getNumLocations() == numRecords + 1;
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+
+        for (int t = 0; t < 2; t++) {
+            delete managers[t];
+            remove(files[t].c_str());
+            remove((files[t] + ".map").c_str());
+        }
+    }
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("Balanced TreeNode Test Passed"): highlightRed("Balanced TreeNode Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+
+bool TreeCursorTest() {
+    string dbFile = "CursorTest.idx";
+    const int tests = 4, numRecords = 2000;
+    vector<long> keys, found;
+    bool pass[tests], allPass = true;
+    MemoryManager *mm;
+    IndexRecord root;
+    int location, testNum = 0;
+    string message = "";
+
+    cout << highlightGreen("\nTreeCursor Test") << endl;
+    remove(dbFile.c_str());
+    remove((dbFile + ".map").c_str());
+    mm = new MemoryManager(dbFile, 4); // a small pool, so read ahead has something to do
+    mm->FreeListInit();
+    location = mm->getNextFreeLocation();
+    root.treeNode.init(mm, location, true);
+
+    {   // We test a cursor over an empty tree
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A cursor over an empty tree is not valid: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        TreeCursor cursor(mm, location);
+        pass[testNum] = !cursor.isValid()
+                     && root.treeNode.findByKey(mm, 5) == -1;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    for (long i = 0; i < numRecords; i++) {
+        keys.push_back(i * 2);
+    }
+
+    shuffle(keys.begin(), keys.end(), mt19937(3));
+
+    for (int i = 0; i < numRecords; i++) {
+        root.treeNode.addBalanced(mm, keys[i], keys[i] + 1);
+    }
+
+    {   // We test findByKey
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": findByKey finds every key and misses the gaps: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+
+        // execute
+        for (int i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum]
+                         && root.treeNode.findByKey(mm, keys[i])     == keys[i] + 1
+                         && root.treeNode.findByKey(mm, keys[i] + 1) == -1;
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test a full in-order walk
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A full walk visits every key in order: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        found.clear();
+
+        // execute
+        for (TreeCursor cursor(mm, location); cursor.isValid(); cursor.next()) {
+            pass[testNum] = pass[testNum] && cursor.getValue() == cursor.getKey() + 1;
+            found.push_back(cursor.getKey());
+        }
+
+        pass[testNum] = pass[testNum]
+                     && found.size() == (size_t) numRecords
+                     && is_sorted(found.begin(), found.end())
+                     && mm->getPool()->getPrefetches() > 0;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test a range that starts between two keys
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Seeking to 501 and stopping at 900: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        found.clear();
+
+        // execute
+        TreeCursor cursor(mm, location);
+
+        for (cursor.seek(501); cursor.isValid() && cursor.getKey() <= 900; cursor.next()) {
+            found.push_back(cursor.getKey());
+        }
+
+        pass[testNum] = found.size()  == 200
+                     && found.front() == 502
+                     && found.back()  == 900
+                     && is_sorted(found.begin(), found.end());
+
+        cursor.seek(numRecords * 2);
+        pass[testNum] = pass[testNum] && !cursor.isValid();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    delete mm;
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("TreeCursor Test Passed"): highlightRed("TreeCursor Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+
+bool MappedMemoryManagerTest() {
+    string dbFile = "MappedTest.idx";
+    const int tests = 4, numRecords = 2000, extent = 50000;
+    vector<long> keys;
+    bool pass[tests], allPass = true;
+    MemoryManager *mm;
+    IndexRecord root;
+    TreeNode *rootNode;
+    struct stat s;
+    long location, far = -1;
+    int testNum = 0;
+    string message = "";
+
+    cout << highlightGreen("\nMapped MemoryManager Test") << endl;
+    remove(dbFile.c_str());
+    remove((dbFile + ".map").c_str());
+    mm = new MemoryManager(dbFile, POOL_FRAMES, STORAGE_MAPPED);
+    mm->FreeListInit();
+    location = mm->getNextFreeLocation();
+    root.treeNode.init(mm, location, true);
+
+    for (long i = 0; i < numRecords; i++) {
+        keys.push_back(i * 2);
+    }
+
+    shuffle(keys.begin(), keys.end(), mt19937(5));
+
+    {   // We test lookups that follow pointers into the mapping
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A mapped tree finds every key in place: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = mm->isMapped() && mm->getPool() == NULL;
+
+        // execute
+        for (int i = 0; i < numRecords; i++) {
+            root.treeNode.addBalanced(mm, keys[i], keys[i] + 1);
+        }
+
+        for (int i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum]
+                         && root.treeNode.findByKey(mm, keys[i])     == keys[i] + 1
+                         && root.treeNode.findByKey(mm, keys[i] + 1) == -1;
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that growing the file does not move what is already mapped
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Growing the file leaves node pointers where they were: ";
+        cout << highlightCyan(message) << endl;
+        rootNode = mm->nodeAt(location);
+        long rootKey = rootNode->getKey();
+        long before = mm->getSize();
+
+        // execute
+        far = mm->getFreeExtent(extent) + extent - 1;
+        mm->writeAt(far, root.treeNode);
+
+        pass[testNum] = mm->nodeAt(location) == rootNode
+                     && rootNode->getKey() == rootKey
+                     && mm->getSize() == (far + 1) * mm->getBlockSize()
+                     && mm->getSize() > 16 * before
+                     && root.treeNode.findByKey(mm, keys[0]) == keys[0] + 1;
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+        mm->freeLocation(far - extent + 1, extent);
+    }
+
+    {   // We test that a mapped manager refuses transactions
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A mapped Memory Manager cannot begin a transaction: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        try {
+            mm->begin();
+        } catch (DBException &e) {
+            cout << endl;
+            pass[testNum] = !mm->inTransaction();
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that the file is trimmed on close and reads back through the pool
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A mapped file reopens through the buffer pool: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+
+        // execute
+        delete mm;
+        stat(dbFile.c_str(), &s);
+        mm = new MemoryManager(dbFile);
+        root.treeNode.from(mm, location);
+
+        for (int i = 0; i < numRecords; i += 7) {
+            pass[testNum] = pass[testNum] && root.treeNode.findByKey(mm, keys[i]) == keys[i] + 1;
+        }
+
+        pass[testNum] = pass[testNum]
+                     && s.st_size == (far + 1) * mm->getBlockSize()
+                     && mm->getSize() == s.st_size
+                     && !mm->isMapped();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    delete mm;
+    remove(dbFile.c_str());
+    remove((dbFile + ".map").c_str());
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("Mapped MemoryManager Test Passed"): highlightRed("Mapped MemoryManager Test Failed")) << endl << endl;
+
+    return allPass;
 }
 
 
-/* ***************************************************** */
-/*                          Tests                        */
-/* ***************************************************** */
+bool IntIndexTest() {
+    string dbFile = "IntIndexTest.idx";
+    const int tests = 13, numRecords = 20000;
+    vector<long> keys;
+    vector<pair<long, long>> entries;
+    bool pass[tests], allPass = true;
+    IntIndex *index;
+    long reads, pages;
+    int testNum = 0;
+    string message = "";
+
+    cout << highlightGreen("\nIntIndex Test") << endl;
+    remove(dbFile.c_str());
+    index = new IntIndex(dbFile);
+
+    for (long i = 0; i < numRecords; i++) {
+        keys.push_back(i * 3);
+    }
+
+    {   // We test an empty index
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": An empty index has a single leaf and no keys: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        pass[testNum] = index->size()          == 0
+                     && index->getHeight()     == 1
+                     && index->findByKey(42)   == -1
+                     && !index->del(42)
+                     && index->check();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test adding keys in shuffled order until pages split
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Adding " + to_string(numRecords) + " shuffled keys: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        shuffle(keys.begin(), keys.end(), mt19937(7));
+
+        // execute
+        for (int i = 0; i < numRecords; i++) {
+            index->add(keys[i], keys[i] + 1);
+        }
+
+        for (int i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum] && index->findByKey(keys[i]) == keys[i] + 1;
+        }
+
+        pass[testNum] = pass[testNum]
+                     && index->size()        == numRecords
+                     && index->getHeight()   == 2
+                     && index->findByKey(1)  == -1
+                     && index->check();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that a lookup reads one page per level
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A lookup reads one page per level: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        reads = index->getPageReads();
+
+        // execute
+        index->findByKey(keys[numRecords / 2]);
+        pass[testNum] = index->getPageReads() - reads == index->getHeight();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test overwriting the value of an existing key
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Adding an existing key overwrites its value: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+
+        // execute
+        index->add(keys[0], 99);
+        pass[testNum] = index->findByKey(keys[0]) == 99
+                     && index->size()             == numRecords;
+        index->add(keys[0], keys[0] + 1);
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that the index survives being closed and reopened
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Reopening the index file: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        pages = index->getNumPages();
+
+        // execute
+        delete index;
+        index = new IntIndex(dbFile);
+
+        for (int i = 0; i < numRecords; i += 97) {
+            pass[testNum] = pass[testNum] && index->findByKey(keys[i]) == keys[i] + 1;
+        }
+
+        pass[testNum] = pass[testNum]
+                     && index->size()       == numRecords
+                     && index->getNumPages() == pages
+                     && index->check();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test deleting every key, which exercises borrowing and merging
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Deleting keys merges pages back down to a single leaf: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+
+        // execute
+        for (int i = 0; i < numRecords; i += 2) {
+            pass[testNum] = pass[testNum] && index->del(keys[i]);
+        }
+
+        pass[testNum] = pass[testNum] && index->check() && !index->del(keys[0]);
+
+        for (int i = 1; i < numRecords; i += 2) {
+            pass[testNum] = pass[testNum] && index->findByKey(keys[i]) == keys[i] + 1;
+        }
+
+        for (int i = 1; i < numRecords; i += 2) {
+            pass[testNum] = pass[testNum] && index->del(keys[i]);
+        }
+
+        pass[testNum] = pass[testNum]
+                     && index->size()      == 0
+                     && index->getHeight() == 1
+                     && index->check();
+
+        // freed pages are reused before the file grows
+        for (int i = 0; i < numRecords; i++) {
+            index->add(keys[i], keys[i]);
+        }
+
+        pass[testNum] = pass[testNum] && index->getNumPages() <= pages && index->check();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test that bulk loading refuses an index that already has keys
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Bulk loading a non-empty index throws: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
+        entries.push_back(make_pair(1L, 1L));
+
+        // execute
+        try {
+            index->bulkLoad(entries);
+        } catch (DBException &e) {
+            cout << endl;
+            pass[testNum] = index->size() == numRecords;
+        }
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    delete index;
+    remove(dbFile.c_str());
+    index = new IntIndex(dbFile);
+
+    {   // We test bulk loading shuffled pairs with a repeated key
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Bulk loading " + to_string(numRecords * 5) + " shuffled keys: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        entries.clear();
+
+        for (long i = 0; i < numRecords * 5; i++) {
+            entries.push_back(make_pair(i * 2, i));
+        }
+
+        shuffle(entries.begin(), entries.end(), mt19937(11));
+        entries.push_back(make_pair(10L, -5L)); // a repeated key keeps the last value
+
+        // execute
+        index->bulkLoad(entries);
+
+        for (long i = 0; i < numRecords * 5; i += 13) {
+            pass[testNum] = pass[testNum] && index->findByKey(i * 2) == (i == 5? -5: i);
+        }
+
+        // every page is full, the leaves and each level above them are contiguous
+        pass[testNum] = pass[testNum]
+                     && index->size()        == numRecords * 5
+                     && index->getHeight()   == 3
+                     && index->getNumPages() == 1 + 397 + 2 + 1
+                     && index->findByKey(3)  == -1
+                     && index->check();
+
+        index->add(3, 3);
+        pass[testNum] = pass[testNum] && index->findByKey(3) == 3 && index->check();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test a range scan across many leaves
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Range scan from 1001 to 60000 across the leaf chain: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        keys.clear();
+
+        // execute
+        for (IndexCursor cursor = index->seek(1001); cursor.isValid() && cursor.getKey() <= 60000; cursor.next()) {
+            pass[testNum] = pass[testNum] && cursor.getValue() == cursor.getKey() / 2;
+            keys.push_back(cursor.getKey());
+        }
+
+        pass[testNum] = pass[testNum]
+                     && keys.size()  == 29500
+                     && keys.front() == 1002
+                     && keys.back()  == 60000
+                     && is_sorted(keys.begin(), keys.end())
+                     && !index->seek(numRecords * 10).isValid();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test merging a shuffled batch into a full index
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Batch adding " + to_string(numRecords) + " keys into a full index: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        entries.clear();
+
+        for (long i = 0; i < numRecords; i++) {
+            entries.push_back(make_pair(i * 5, -i)); // every other key is already there
+        }
+
+        shuffle(entries.begin(), entries.end(), mt19937(13));
+
+        // execute
+        index->addBatch(entries);
+
+        for (long i = 0; i < numRecords; i += 7) {
+            pass[testNum] = pass[testNum] && index->findByKey(i * 5) == -i;
+        }
+
+        pass[testNum] = pass[testNum]
+                     && index->size()       == numRecords * 5 + 1 + numRecords / 2
+                     && index->findByKey(2) == 1
+                     && index->findByKey(3) == 3
+                     && index->check();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    delete index;
+    remove(dbFile.c_str());
+
+    {   // We test that a batch writes each page once where add writes one per key
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Batch adding writes fewer pages than adding one key at a time: ";
+        cout << highlightCyan(message) << endl;
+        IntIndex *single = new IntIndex("IntIndexSingle.idx");
+        long singleWrites, batchWrites;
+        entries.clear();
+
+        for (long i = 0; i < numRecords; i++) {
+            entries.push_back(make_pair(i * 3, i));
+        }
 
+        shuffle(entries.begin(), entries.end(), mt19937(17));
+        index = new IntIndex(dbFile);
 
-int basicTest() {
-    cout << "hello from test" << endl;
-    return 0;
-}
+        // execute
+        for (size_t i = 0; i < entries.size(); i++) {
+            single->add(entries[i].first, entries[i].second);
+        }
 
+        batchWrites = index->getPageWrites();
+        index->addBatch(entries);
+        batchWrites = index->getPageWrites() - batchWrites;
+        singleWrites = single->getPageWrites();
 
+        pass[testNum] = index->size() == numRecords
+                     && index->check()
+                     && index->findByKey(300) == 100
+                     && batchWrites <= index->getNumPages() - 1
+                     && batchWrites * 100 < singleWrites;
 
-bool MemoryManager::test() {
-    const int tests = 7;
-    bool pass[tests], allPass = true;
-    // IndexRecord record, fln;
-    IndexRecord record, rec2;
-    FreeListNode fln;
-    int location, testNum = 0;
-    string message = "";
-    
-    cout << "Start\tMemoryManager::test()" << endl;
-    
-    /*
-        First, We test the basic 
-    */
-    
-    {   // We test blockSize = sizeof(IndexRecord)
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+        delete single;
+        remove("IntIndexSingle.idx");
+    }
+
+    {   // We test finds and scans running beside a writer that splits and merges pages
 
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": Block Size == sizeof(IndexRecord):  ";
-        cout << highlightCyan(message) << sizeof(IndexRecord) << endl;
-        pass[testNum] = false;
+        message = "\tTest " + to_string(testNum + 1) + ": Finds and scans on 4 threads while another adds and deletes: ";
+        cout << highlightCyan(message) << endl;
+        const int readers = 4;
+        vector<thread> threads;
+        vector<char> readerPass(readers, true);
 
         // execute
-        pass[testNum] = getBlockSize() == sizeof(IndexRecord);
+        for (int t = 0; t < readers; t++) {
+            threads.push_back(thread([&, t]() {
+                for (int round = 0; round < 3; round++) {
+                    long seen = 0, last = -1;
+
+                    for (long i = t; i < numRecords; i += readers) {
+                        readerPass[t] = readerPass[t] && index->findByKey(i * 3) == i;
+                    }
+
+                    // the writer's keys come and go, but every key a scan returns is in order and ours all show up
+                    for (IndexCursor cursor = index->seek(0); cursor.isValid(); cursor.next()) {
+                        readerPass[t] = readerPass[t] && cursor.getKey() > last;
+                        last = cursor.getKey();
+                        seen += last % 3 == 0;
+                    }
+
+                    readerPass[t] = readerPass[t] && seen == numRecords;
+                }
+            }));
+        }
+
+        threads.push_back(thread([&]() {
+            for (long i = 0; i < numRecords; i++) {
+                index->add(i * 3 + 1, -i);
+            }
+
+            for (long i = 0; i < numRecords; i++) {
+                index->del(i * 3 + 1);
+            }
+        }));
+
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+
+        pass[testNum] = index->size() == numRecords
+                     && index->findByKey(4) == -1
+                     && index->findByKey(300) == 100
+                     && index->check();
+
+        for (int t = 0; t < readers; t++) {
+            pass[testNum] = pass[testNum] && readerPass[t];
+        }
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
-    } 
+    }
+
+    {   // We test that the Bloom filter turns away absent keys and is saved with the index
 
-    {   // We test that the file is open
-    
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": File is open: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Finds of absent keys read no page, the filter is saved and reloaded: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
+        pass[testNum] = true;
+        string filterFile = dbFile + ".bloom";
+        struct stat s;
+        long skips;
+
+        // execute, the writer above added and deleted i * 3 + 1, so the filter still has those
+        for (int round = 0; round < 3; round++) {
+            reads = index->getPageReads();
+            skips = index->getFilterSkips();
+
+            for (long i = 0; i < numRecords; i++) {
+                pass[testNum] = pass[testNum] && index->findByKey(i * 3 + 2) == -1;
+            }
+
+            for (long i = 0; i < numRecords; i += 97) {
+                pass[testNum] = pass[testNum] && index->findByKey(i * 3) == i;
+            }
+
+            pass[testNum] = pass[testNum] && (index->getFilterSkips() - skips) * 100 > numRecords * 98;
+
+            if (round == 0) {
+                // flush saves the filter, a reopen reads it instead of the leaves
+                index->flush();
+                pass[testNum] = pass[testNum] && stat(filterFile.c_str(), &s) == 0;
+                delete index;
+                index = new IntIndex(dbFile);
+                pass[testNum] = pass[testNum] && index->getPageReads() == 0;
+
+            } else if (round == 1) {
+                // the first add after a save removes it, without one the reopen rebuilds from the leaves
+                index->add(2, 2);
+                pass[testNum] = pass[testNum] && stat(filterFile.c_str(), &s) != 0 && index->findByKey(2) == 2;
+                index->del(2);
+                delete index;
+                remove(filterFile.c_str());
+                index = new IntIndex(dbFile);
+                pass[testNum] = pass[testNum] && index->getPageReads() > 0;
+            }
+        }
+
+        pass[testNum] = pass[testNum] && index->check();
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    delete index;
+
+    for(int i = 0; i < tests; i++) {
+        allPass = allPass && pass[i];
+    }
+
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("IntIndex Test Passed"): highlightRed("IntIndex Test Failed")) << endl << endl;
+
+    return allPass;
+}
+
+bool LsmIndexTest() {
+    string dbFile = "LsmIndexTest.idx", btreeFile = "LsmIndexBtree.idx";
+    const int tests = 7, numRecords = 20000, memtableEntries = 1000;
+    vector<long> keys;
+    bool pass[tests], allPass = true;
+    KeyIndex *btree;
+    LsmIndex *index;
+    long lsmBytes, btreeBytes, reads;
+    int testNum = 0;
+    string message = "";
+
+    // an index is its manifest and the run files named after it
+    auto removeRuns = [](string fileName) {
+        remove(fileName.c_str());
+
+        for (int id = 1; id < 1000; id++) {
+            remove((fileName + "." + to_string(id) + ".run").c_str());
+        }
+    };
+
+    cout << highlightGreen("\nLsmIndex Test") << endl;
+    removeRuns(dbFile);
+    remove(btreeFile.c_str());
+
+    for (long i = 0; i < numRecords; i++) {
+        keys.push_back(i * 3);
+    }
+
+    {   // We test that both engines open behind KeyIndex and start empty
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Both engines open empty behind KeyIndex: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        btree = KeyIndex::open(ENGINE_BTREE, btreeFile);
+        KeyIndex *lsm = KeyIndex::open(ENGINE_LSM, dbFile);
 
         // execute
-        pass[testNum] = file->is_open();
+        for (KeyIndex *each : {btree, lsm}) {
+            pass[testNum] = pass[testNum]
+                         && each->size()         == 0
+                         && each->findByKey(42)  == -1
+                         && !each->del(42)
+                         && each->check();
+        }
+
+        pass[testNum] = pass[testNum]
+                     && btree->getEngine() == "btree"
+                     && lsm->getEngine()   == "lsm";
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
+        delete lsm;
+        index = new LsmIndex(dbFile, memtableEntries);
     }
 
+    {   // We test that the same adds, overwrites and deletes give the same answers as IntIndex
 
-    {   // We test getNumLocations
-    
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": getNumLocations: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Adds, overwrites and deletes match IntIndex: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
-        
+        pass[testNum] = true;
+        shuffle(keys.begin(), keys.end(), mt19937(11));
+
         // execute
-        pass[testNum] = getNumLocations() == 0;
+        for (int i = 0; i < numRecords; i++) {
+            btree->add(keys[i], keys[i] + 1);
+            index->add(keys[i], keys[i] + 1);
+        }
+
+        for (int i = 0; i < numRecords; i += 3) {
+            btree->add(keys[i], -keys[i]);
+            index->add(keys[i], -keys[i]);
+        }
+
+        for (int i = 1; i < numRecords; i += 5) {
+            pass[testNum] = pass[testNum] && btree->del(keys[i]) == index->del(keys[i]);
+        }
+
+        for (int i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum] && btree->findByKey(keys[i]) == index->findByKey(keys[i]);
+            pass[testNum] = pass[testNum] && index->findByKey(keys[i] + 1) == -1;
+        }
+
+        pass[testNum] = pass[testNum]
+                     && index->del(keys[1])     == false
+                     && index->size()           == btree->size()
+                     && index->getRunsWritten() >= numRecords / memtableEntries
+                     && index->check();
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
+    {   // We test that compaction keeps level 0 short and a scan merges every level in order
 
-    {   // We test writing to the index file
-    
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": Writing to the index file:";
+        message = "\tTest " + to_string(testNum + 1) + ": Compaction bounds level 0 and scans match IntIndex: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
-        location = 2;
+        pass[testNum] = true;
+        IndexCursor expected = ((IntIndex*) btree)->seek(100);
 
         // execute
-        record.freeNode.init(location);
-        writeAt(location, record);
-        pass[testNum] = getNumLocations() == (location + 1);
+        index->waitForCompaction();
+
+        for (LsmCursor cursor = index->seek(100); cursor.isValid(); cursor.next(), expected.next()) {
+            pass[testNum] = pass[testNum]
+                         && expected.isValid()
+                         && cursor.getKey()   == expected.getKey()
+                         && cursor.getValue() == expected.getValue();
+        }
+
+        pass[testNum] = pass[testNum]
+                     && !expected.isValid()
+                     && index->getCompactions() > 0
+                     && index->getNumLevels()   > 1
+                     && index->getNumRuns(0)    < LSM_L0_RUNS
+                     && index->check();
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
+    {   // We test that closing writes the memtable and reopening reads the manifest back
 
-    {   // We test reading from the index file
-    
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": Reading from the index file: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Reopening the index keeps every key: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
-     
+        pass[testNum] = true;
+        index->add(1, 2);
+        index->del(keys[0]);
+        btree->add(1, 2);
+        btree->del(keys[0]);
+
         // execute
-        readAt(location, fln); // we test on both a FreeListNode and an IndexRecord
-        readAt(location, rec2);
+        delete index;
+        index = new LsmIndex(dbFile, memtableEntries);
 
-        pass[testNum] = rec2.freeNode.type              == record.freeNode.type
-                     && rec2.freeNode.location          == record.freeNode.location
-                     && rec2.freeNode.getNextLocation() == record.freeNode.getNextLocation()
-                     && fln.type                        == record.freeNode.type
-                     && fln.location                    == record.freeNode.location
-                     && fln.getNextLocation()           == record.freeNode.getNextLocation();
+        for (int i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum] && btree->findByKey(keys[i]) == index->findByKey(keys[i]);
+        }
+
+        pass[testNum] = pass[testNum]
+                     && index->findByKey(1) == 2
+                     && index->size()       == btree->size()
+                     && index->check();
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
+        delete btree;
+        remove(btreeFile.c_str());
     }
 
+    {   // We test ingest cost against an IntIndex whose pages do not fit in its pool
 
-    {   // We test FreeListInit and memory management
-    
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": FreeListInit and memory management: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Shuffled ingest writes less than IntIndex with a small pool: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
-        
+        IntIndex *small = new IntIndex(btreeFile, 16);
+        LsmIndex *ingest = new LsmIndex("LsmIndexIngest.idx", memtableEntries);
+        shuffle(keys.begin(), keys.end(), mt19937(13));
+
         // execute
-        FreeListInit();
-        readAt(0, fln);
-        pass[testNum] = fln.type == FreeListHead.freeNode.type
-               && fln.location == FreeListHead.freeNode.location
-               && fln.getNextLocation() == FreeListHead.freeNode.getNextLocation();
-               
+        for (int i = 0; i < numRecords; i++) {
+            small->add(keys[i], i);
+            ingest->add(keys[i], i);
+        }
+
+        small->flush();
+        ingest->flush();
+        ingest->waitForCompaction();
+        btreeBytes = small->getPool()->getPageWrites() * PAGE_SIZE;
+        lsmBytes = ingest->getBytesWritten();
+        cout << "\t\tIntIndex wrote " << btreeBytes / 1024 << " KB, LsmIndex wrote " << lsmBytes / 1024 << " KB in "
+             << ingest->getRunsWritten() << " runs and " << ingest->getCompactions() << " compactions" << endl;
+
+        pass[testNum] = ingest->size() == numRecords
+                     && ingest->check()
+                     && lsmBytes * 10 < btreeBytes;
+
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
+        delete small;
+        delete ingest;
+        remove(btreeFile.c_str());
+        removeRuns("LsmIndexIngest.idx");
     }
 
-    {   // We test getNextFreeLocation, its important to test when it is a root node
-    
+    {   // We test finds and scans running beside a writer whose flushes start compactions
+
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": getNextFreeLocation: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Finds and scans on 4 threads while another adds and deletes: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
+        const int readers = 4;
+        vector<thread> threads;
+        vector<char> readerPass(readers, true);
+        long expectedKeys = index->size();
 
         // execute
-        pass[testNum] = getNextFreeLocation() == location + 1 /* non-destructive */
-                     && getNextFreeLocation() == location + 1; /* non-destructive */
+        for (int t = 0; t < readers; t++) {
+            threads.push_back(thread([&, t]() {
+                for (int round = 0; round < 2; round++) {
+                    long last = LONG_MIN;
+
+                    for (long i = t; i < numRecords; i += readers * 7) {
+                        long value = index->findByKey(keys[i] + 2);
+                        readerPass[t] = readerPass[t] && (value == -1 || value == keys[i]);
+                    }
+
+                    for (LsmCursor cursor = index->seek(LONG_MIN); cursor.isValid(); cursor.next()) {
+                        readerPass[t] = readerPass[t] && cursor.getKey() > last;
+                        last = cursor.getKey();
+                    }
+                }
+            }));
+        }
+
+        threads.push_back(thread([&]() {
+            for (long i = 0; i < numRecords; i++) {
+                index->add(keys[i] + 2, keys[i]);
+            }
+
+            for (long i = 0; i < numRecords; i++) {
+                index->del(keys[i] + 2);
+            }
+        }));
+
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+
+        index->waitForCompaction();
+        pass[testNum] = index->size() == expectedKeys
+                     && index->findByKey(keys[0] + 2) == -1
+                     && index->check();
+
+        for (int t = 0; t < readers; t++) {
+            pass[testNum] = pass[testNum] && readerPass[t];
+        }
+
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
-    {   // We test free location 
+    {   // We test that the run filters keep finds of absent keys off the run pages
 
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": freeLocation: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Finds of absent keys read almost no run pages: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
+        pass[testNum] = true;
+        index->flush();
+        index->waitForCompaction();
+        reads = index->getRunReads();
 
         // execute
-        freeLocation(location);
-        pass[testNum] = getNextFreeLocation() == location /* destructive */
-                        && getNumLocations() == location + 1
-                        && getNextFreeLocation() == location + 1; /* non-destructive */
+        for (int i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum] && index->findByKey(keys[i] + 4) == -1;
+        }
+
+        reads = index->getRunReads() - reads;
+        cout << "\t\t" << reads << " run pages read for " << numRecords << " absent keys over "
+             << index->getNumLevels() << " levels" << endl;
+
+        pass[testNum] = pass[testNum]
+                     && reads * 20 < numRecords
+                     && index->findByKey(1) == 2;
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
+    delete index;
+    removeRuns(dbFile);
+
     for(int i = 0; i < tests; i++) {
         allPass = allPass && pass[i];
     }
 
     cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
-    cout << "End\tMemoryManager::test()" << endl;
+    cout << (allPass? highlightGreen("LsmIndex Test Passed"): highlightRed("LsmIndex Test Failed")) << endl << endl;
 
     return allPass;
 }
 
+/**
+ * @brief copies a file byte for byte, the tests use it to freeze the state a crash would leave
+ */
+void copyFile(string from, string to) {
+    ifstream in(from, ios::binary);
+    ofstream out(to, ios::binary | ios::trunc);
 
-bool MemoryManagerTest() {
-    bool pass = true;
-    
-    cout << highlightGreen("\nMemoryManager Test") << endl;
-    
-    mm = new MemoryManager("test.idx");
-    pass = mm->test();
-    delete mm;
-
-    cout << (pass? highlightGreen("MemoryManager Test Passed"): highlightRed("MemoryManager Test Failed")) << endl << endl;
-    
-    return pass;
+    out << in.rdbuf();
 }
 
 
-bool FreeListNodeTest() {
-    string dbFile = "FreeTest.idx";
-    int tests = 7, retval = -2;
+bool HashIndexTest() {
+    string dbFile = "HashTest.idx", crashFile = "HashCrash.idx";
+    const int tests = 8, numRecords = 20000, copies = 3 * 255 + 10;
     bool pass[tests], allPass = true;
-    IndexRecord record;
+    HashIndex *index, *copy;
+    long value, reads;
+    int testNum = 0;
+    string message = "";
 
+    cout << highlightGreen("\nHashIndex Test") << endl;
+    remove(dbFile.c_str());
+    index = new HashIndex();
+
+    {   // We test opening a new hash file
 
-    cout << highlightGreen("\nFreeListNode Test") << endl;
-    mm = new MemoryManager(dbFile);
-    
-    {   // We test the creation of the head free node
         // setup
-        cout << highlightCyan("\tTest 1: Creation of the head free node: ") << endl;
-        pass[0] = false;
+        message = "\tTest " + to_string(testNum + 1) + ": A new hash file has one empty bucket: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
 
         // execute
-        record.freeNode.init(0);
-        pass[0] = record.freeNode.type == FREE 
-            && record.freeNode.location == 0
-            && record.freeNode.getNextLocation() == -1;
+        pass[testNum] = index->open(dbFile)
+                     && index->size()           == 0
+                     && index->getNumPages()    == 2
+                     && index->getGlobalDepth() == 0
+                     && !index->find(42, value);
 
         // cleanup
-        cout << "\t\t" << (pass[0]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
     }
 
+    {   // We test inserting enough keys to split buckets and grow the directory
 
-    {   // We test the isEmpty method when list is empty
         // setup
-        cout << highlightCyan("\tTest 2: isEmpty method when list is empty: ") << endl;
-        pass[1] = false;
+        message = "\tTest " + to_string(testNum + 1) + ": Inserting " + to_string(numRecords) + " keys, each found with one page read: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
 
         // execute
-        pass[1] = record.freeNode.isEmpty();
+        for (long i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum] && index->insert(i * 7, i);
+        }
+
+        reads = index->getPageReads();
+
+        for (long i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum] && index->find(i * 7, value) && value == i;
+        }
 
+        pass[testNum] = pass[testNum]
+                     && index->getPageReads() - reads == numRecords
+                     && index->size()                 == numRecords
+                     && index->getGlobalDepth()       >= 6 /* 255 keys per bucket */
+                     && !index->find(1, value);
 
         // cleanup
-        cout << "\t\t" << (pass[1]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
     }
 
-    {   // We test pushing a new location onto the free list
+    {   // We test duplicate keys and erase
+
         // setup
-        cout << highlightCyan("\tTest 3: Pushing a new location onto the free list:") << endl;
-        pass[2] = false;
+        message = "\tTest " + to_string(testNum + 1) + ": A repeated key finds its smallest value, erase removes one pair: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = false;
 
         // execute
-        record.freeNode.push(2);
-        pass[2] = record.freeNode.type == FREE 
-            && record.freeNode.location == 0
-            && record.freeNode.getNextLocation() == 2;
+        index->insert(7, -3);
+        pass[testNum] = index->find(7, value) && value == -3;
+
+        pass[testNum] = pass[testNum]
+                     && index->erase(7, -3)
+                     && index->find(7, value) && value == 1
+                     && !index->erase(7, -3)
+                     && index->erase(14, 2)
+                     && !index->find(14, value)
+                     && index->size() == numRecords - 1;
 
         // cleanup
-        cout << "\t\t" << (pass[2]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
     }
 
-    {   // We test isEmpty method when list is not empty
+    {   // We test that a hash that was never closed rebuilds its directory from the buckets
+
         // setup
-        cout << highlightCyan("\tTest 4: isEmpty method when list is not empty: ") << endl;
-        pass[3] = false;
+        message = "\tTest " + to_string(testNum + 1) + ": Opening a hash that was not closed rebuilds the directory: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        copy = new HashIndex();
+
+        // execute
+        pass[testNum] = copy->open(dbFile) && !copy->openedClean();
+
+        for (long i = 0; i < numRecords; i += 37) {
+            pass[testNum] = pass[testNum] && copy->find(i * 7, value) && value == i;
+        }
+
+        pass[testNum] = pass[testNum]
+                     && copy->size()           == numRecords - 1
+                     && copy->getGlobalDepth() == index->getGlobalDepth();
+
+        delete copy; // closes the copy, the original below rewrites everything on its own close
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
+
+    {   // We test closing and reopening
+
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": Reopening a closed hash loads its directory: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
 
         // execute
-        pass[3] = !record.freeNode.isEmpty();
+        pass[testNum] = index->close();
+        delete index;
+        index = new HashIndex();
+        pass[testNum] = pass[testNum] && index->open(dbFile) && index->openedClean();
+
+        for (long i = 1; i < numRecords; i += 41) {
+            pass[testNum] = pass[testNum] && index->find(i * 7, value) && value == i;
+        }
+
+        pass[testNum] = pass[testNum] && index->size() == numRecords - 1;
 
         // cleanup
-        cout << "\t\t" << (pass[3]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
     }
 
-    {   // We test pushing another element onto the free list
+    {   // We test that the Bloom filter turns away absent keys without a bucket read
+
         // setup
-        cout << highlightCyan("\tTest 5: Pushing another element onto the free list: ") << endl;
-        pass[4] = false;
+        message = "\tTest " + to_string(testNum + 1) + ": Finds of absent keys skip the bucket read: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        mt19937 random(5);
+        reads = index->getPageReads();
 
         // execute
-        record.freeNode.push(7);
-        pass[4] = record.freeNode.type == FREE 
-            && record.freeNode.location == 0
-            && record.freeNode.getNextLocation() == 7;
+        for (long i = 0; i < numRecords; i++) {
+            pass[testNum] = pass[testNum] && !index->find(i * 7 + 3, value);
+        }
+
+        reads = index->getPageReads() - reads;
+        cout << "\t\t" << reads << " bucket reads for " << numRecords << " absent keys, filter of "
+             << index->getFilterBytes() / 1024 << " KB" << endl;
+
+#if defined(__x86_64__) || defined(__i386__)
+        // both probes agree, on blocks about three quarters full
+        for (int i = 0; i < 10000 && __builtin_cpu_supports("avx2"); i++) {
+            BloomBlock block;
+            uint32_t key = random();
+
+            for (int w = 0; w < BLOOM_BLOCK_WORDS; w++) {
+                block.words[w] = random() | random();
+            }
+
+            pass[testNum] = pass[testNum] && BloomFilter::probeAVX2(block, key) == BloomFilter::probeScalar(block, key);
+        }
+#endif
+
+        pass[testNum] = pass[testNum]
+                     && reads * 50 < numRecords
+                     && index->getFilterSkips() == numRecords - reads
+                     && index->find(7, value) && value == 1;
 
         // cleanup
-        cout << "\t\t" << (pass[4]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
     }
 
+    {   // We test more copies of one key than a bucket holds, no split can separate them
 
-    {   // We test popping a location off the free list
         // setup
-        cout << highlightCyan("\tTest 6: Popping a location off the free list: ") << endl;
-        pass[5] = false;
+        message = "\tTest " + to_string(testNum + 1) + ": " + to_string(copies) + " copies of one key go to overflow pages: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        long pages = index->getNumPages();
+        int depth = index->getGlobalDepth();
 
-        // cout << record.freeNode.nextLocation << " " << retval << endl;
         // execute
-        retval = record.freeNode.pop();
-        pass[5] = record.freeNode.type == FREE 
-            && record.freeNode.location == 0
-            && record.freeNode.getNextLocation() == 2
-            && retval == 7;
+        for (long i = copies; i > 0; i--) {
+            pass[testNum] = pass[testNum] && index->insert(1, i);
+        }
 
+        cout << "\t\t" << index->getNumPages() - pages << " new pages, global depth "
+             << index->getGlobalDepth() << endl;
+
+        pass[testNum] = pass[testNum]
+                     && index->getGlobalDepth() <= depth + 1
+                     && index->getNumPages() - pages <= copies / 255 + 2
+                     && index->size() == numRecords - 1 + copies
+                     && index->find(1, value) && value == 1
+                     && index->erase(1, 1)
+                     && index->erase(1, copies)
+                     && index->find(1, value) && value == 2;
+
+        copy = new HashIndex();
+        pass[testNum] = pass[testNum]
+                     && copy->open(dbFile) && !copy->openedClean()
+                     && copy->find(1, value) && value == 2
+                     && copy->size() == numRecords - 3 + copies;
+        delete copy;
+
+        pass[testNum] = pass[testNum] && index->close();
+        delete index;
+        index = new HashIndex();
+        pass[testNum] = pass[testNum] && index->open(dbFile) && index->openedClean();
+
+        for (long i = 2; i < copies; i++) {
+            pass[testNum] = pass[testNum] && index->find(1, value) && value == i && index->erase(1, i);
+        }
+
+        for (long i = 1; i < numRecords; i += 41) {
+            pass[testNum] = pass[testNum] && index->find(i * 7, value) && value == i;
+        }
+
+        pass[testNum] = pass[testNum]
+                     && !index->find(1, value)
+                     && index->size() == numRecords - 1;
+
+        // the same object on a file that is gone starts over, nothing of the last file is left
+        index->setTag(5);
+        pass[testNum] = pass[testNum] && index->close();
+        remove(dbFile.c_str());
+        pass[testNum] = pass[testNum]
+                     && index->open(dbFile) && !index->openedClean()
+                     && index->getTag() == 0
+                     && index->size() == 0
+                     && !index->find(7, value);
 
-        // cout << record.freeNode.nextLocation << " " << retval << endl;
         // cleanup
-        cout << "\t\t" << (pass[5]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
-        retval = -2;
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
     }
 
+    {   // We test a crash in the middle of a split, after the new bucket and the header but before the old bucket
 
-    {   // We test that we can recover items pushed onto the free list in reverse order
         // setup
-        cout << highlightCyan("\tTest 7: Recovering items pushed onto the free list in reverse order: ") << endl;
-        pass[6] = true;
-        int items[10] = {
-            11, 2, 3, 4, 5, 6, 7, 8, 9, 10
-        };
+        message = "\tTest " + to_string(testNum + 1) + ": A split cut short by a crash is finished on open: ";
+        cout << highlightCyan(message) << endl;
+        pass[testNum] = true;
+        char newBucket[HASH_PAGE_SIZE], newHeader[HASH_PAGE_SIZE];
+        long pages = index->getNumPages(), found = 0, keys = 0;
 
         // execute
-        for(int i = 0; i < 10; i++) {
-            record.freeNode.push(items[i]);
+        while (pass[testNum] && index->getNumPages() == pages) {
+            copyFile(dbFile, crashFile);
+            pass[testNum] = index->insert(keys * 7, keys);
+            keys++;
         }
 
-        for(int i = 9; i >= 0; i--) {
-            retval = record.freeNode.pop();
-            pass[6] = pass[6] && (retval == items[i]);
+        // the file as it was before the split, with the split's new bucket and header on top
+        ifstream after(dbFile, ios::binary);
+        after.read(newHeader, HASH_PAGE_SIZE);
+        after.seekg(pages * HASH_PAGE_SIZE);
+        after.read(newBucket, HASH_PAGE_SIZE);
+        after.close();
+        fstream crashed(crashFile, ios::in | ios::out | ios::binary);
+        crashed.write(newHeader, HASH_PAGE_SIZE);
+        crashed.seekp(pages * HASH_PAGE_SIZE);
+        crashed.write(newBucket, HASH_PAGE_SIZE);
+        crashed.close();
+
+        copy = new HashIndex();
+        pass[testNum] = pass[testNum] && copy->open(crashFile) && !copy->openedClean();
+
+        for (long i = 0; i < keys; i++) {
+            bool has = copy->find(i * 7, value);
+            pass[testNum] = pass[testNum] && (i == keys - 1 || has) && (!has || value == i);
+            found += has;
+        }
+
+        // the counts add up and the finished split splits again
+        pass[testNum] = pass[testNum] && copy->size() == found;
+
+        for (long i = keys; i < 4 * keys; i++) {
+            pass[testNum] = pass[testNum] && copy->insert(i * 7, i);
         }
 
+        for (long i = 0; i < 4 * keys; i++) {
+            pass[testNum] = pass[testNum] && (copy->find(i * 7, value) ? value == i : i == keys - 1);
+        }
+
+        pass[testNum] = pass[testNum] && copy->size() == found + 3 * keys;
+        delete copy;
+
         // cleanup
-        cout << "\t\t" << (pass[6]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        remove(crashFile.c_str());
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
     }
 
+    delete index;
+
     for(int i = 0; i < tests; i++) {
         allPass = allPass && pass[i];
-        if (!pass[i]) {
-            cout << "\t\tTest " << i+1 << " failed" << endl;
-        }
     }
 
-    cout << (allPass? highlightGreen("FreeListNode Test Passed"): highlightRed("FreeListNode Test Failed")) << endl << endl;
+    cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
+    cout << (allPass? highlightGreen("HashIndex Test Passed"): highlightRed("HashIndex Test Failed")) << endl << endl;
 
     return allPass;
 }
 
-
-bool TreeNodeTest() {
-    string dbFile = "TreeTest.idx";
-    const int tests = 5, numRecords = 7;
-    long keys[numRecords], values[numRecords];
-    bool pass[tests], allPass = true, tempResult = false;
-    IndexRecord firstRecord, secondRecord, thirdRecord;
+bool WriteAheadLogTest() {
+    string dbFile = "WalTest.idx", crashFile = "WalCrash.idx";
+    const int tests = 8, numThreads = 8, commitsPerThread = 25;
+    bool pass[tests], allPass = true;
+    IndexRecord root;
+    MemoryManager *mm, *original;
+    struct stat s;
     int location, testNum = 0;
+    long redone = 0;
     string message = "";
-    
-    cout << highlightGreen("\nTreeNode Test") << endl;
-    mm = new MemoryManager(dbFile);
-    mm->FreeListInit();
 
-    {   // We test the creation of the root of our binary tree
+    cout << highlightGreen("\nWriteAheadLog Test") << endl;
+    remove(dbFile.c_str());
+    remove((dbFile + ".wal").c_str());
+    remove((dbFile + ".map").c_str());
+
+    {   // We test that records of transactions without a commit are not redone
 
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": Creation of the root of our binary tree: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Recovery redoes committed transactions only: ";
         cout << highlightCyan(message) << endl;
         pass[testNum] = false;
-        location = mm->getNextFreeLocation();
-
+        remove("LogTest.wal");
+        WriteAheadLog *log = new WriteAheadLog("LogTest.wal");
+        char image[8] = "block";
 
         // execute
-        firstRecord.treeNode.init(location, false);
-        secondRecord.treeNode.from(location);
-        
-        pass[testNum] = firstRecord.treeNode.type               == secondRecord.treeNode.type
-                     && firstRecord.treeNode.getLocation()      == secondRecord.treeNode.getLocation()
-                     && firstRecord.treeNode.getLeftLocation()  == secondRecord.treeNode.getLeftLocation()
-                     && firstRecord.treeNode.getRightLocation() == secondRecord.treeNode.getRightLocation()
-                     && firstRecord.treeNode.getKey()           == secondRecord.treeNode.getKey()
-                     && firstRecord.treeNode.getValue()         == secondRecord.treeNode.getValue()
-                     && location                                == 1 /* The root must always be placed after the free list head */
-                     && firstRecord.treeNode.isLeaf()
-                     && !firstRecord.treeNode.isRoot();
-
-        firstRecord.treeNode.setRoot(true);
-        pass[testNum] = pass[testNum] && firstRecord.treeNode.isRoot();
+        log->append(1, LOG_UPDATE, 10, image, sizeof(image));
+        log->append(2, LOG_UPDATE, 20, image, sizeof(image));
+        log->append(1, LOG_UPDATE, 11, image, sizeof(image));
+        log->commit(1);
+        delete log; // transaction 2 reaches the log, but never commits
+
+        log = new WriteAheadLog("LogTest.wal");
+        vector<long> locations;
+        redone = log->recover([&locations](long location, const char *, int) {
+            locations.push_back(location);
+        });
+
+        pass[testNum] = redone == 2
+                     && locations.size() == 2
+                     && locations[0] == 10
+                     && locations[1] == 11;
+
+        delete log;
+        remove("LogTest.wal");
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
-    } 
+    }
 
-    {   // We test adding a key value pair to the root of our binary tree
+    {   // We test group commit with many threads committing at once
 
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": Adding a key value pair to the root of our binary tree: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Concurrent commits share syncs: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false; 
-        keys[0] = 20;
-        values[0] = 12;
+        pass[testNum] = false;
+        remove("LogTest.wal");
+        WriteAheadLog log("LogTest.wal");
+        vector<thread> threads;
+        char image[64] = "block";
 
         // execute
-        firstRecord.treeNode.add(keys[0], values[0]);
-        pass[testNum] = firstRecord.treeNode.getKey()   == keys[0]
-                     && firstRecord.treeNode.getValue() == values[0]
-                     && mm->getNumLocations()           == 2
-                     && firstRecord.treeNode.isLeaf();
+        for (int t = 0; t < numThreads; t++) {
+            threads.push_back(thread([&log, &image, t]() {
+                for (int i = 0; i < commitsPerThread; i++) {
+                    long txn = t * commitsPerThread + i + 1;
+                    log.append(txn, LOG_UPDATE, txn, image, sizeof(image));
+                    log.commit(txn);
+                }
+            }));
+        }
+
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+
+        pass[testNum] = log.getCommits()     == numThreads * commitsPerThread
+                     && log.getSyncs()       <= log.getCommits()
+                     && log.getDurableLSN()  == 2 * numThreads * commitsPerThread;
 
+        cout << "\t\t" << log.getCommits() << " commits in " << log.getSyncs() << " syncs" << endl;
+        remove("LogTest.wal");
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
-    {   // We test adding a left node to the root of our binary tree
+    {   // We test a crash after commit, before the pages reached the file
 
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": Adding a left node to the root of our binary tree: ";
+        message = "\tTest " + to_string(testNum + 1) + ": A committed transaction survives a crash: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
-        keys[1] = 10;
-        values[1] = 11;
+        pass[testNum] = true;
+        mm = new MemoryManager(dbFile);
+        mm->FreeListInit();
+        location = mm->getNextFreeLocation();
+        root.treeNode.init(mm, location, true);
+        mm->flush();
 
         // execute
-        firstRecord.treeNode.add(keys[1], values[1]);
-        pass[testNum] = firstRecord.treeNode.getLeftLocation()  != -1
-                     && firstRecord.treeNode.getRightLocation() == -1
-                     && mm->getNumLocations()                   == 3
-                     && !firstRecord.treeNode.isLeaf();
+        mm->begin();
+        for (int i = 1; i <= 50; i++) {
+            root.treeNode.addBalanced(mm, i, i * 10);
+        }
+        mm->commit();
 
-        if (pass[testNum]) {
-            mm->readAt(firstRecord.treeNode.getLeftLocation(), secondRecord);
-            pass[testNum] = secondRecord.treeNode.getKey()   == keys[1]
-                         && secondRecord.treeNode.getValue() == values[1]
-                         && secondRecord.treeNode.isLeaf();
+        mm->begin();
+        root.treeNode.addBalanced(mm, 1000, 1); // open when the "crash" happens
+
+        // what a crash here would leave on disk
+        copyFile(dbFile, crashFile);
+        copyFile(dbFile + ".wal", crashFile + ".wal");
+
+        original = mm;
+        mm = new MemoryManager(crashFile);
+        root.treeNode.from(mm, location);
+
+        for (int i = 1; i <= 50; i++) {
+            pass[testNum] = pass[testNum] && root.treeNode.findByKey(mm, i) == i * 10;
         }
 
+        stat((crashFile + ".wal").c_str(), &s);
+        pass[testNum] = pass[testNum]
+                     && root.treeNode.findByKey(mm, 1000) == -1
+                     && root.treeNode.isBalanced(mm)
+                     && s.st_size == 0; /* recovery checkpoints and empties the log */
+
+        delete mm;
+        mm = original;
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
-    {   // we test adding a right node to the root of our binary tree
-    
+    {   // We test that closing with an open transaction throws its changes away
+
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": Adding a right node to the root of our binary tree: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Closing mid transaction keeps it out of the file: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
-        keys[2] = 30;
-        values[2] = 13;
+        pass[testNum] = true;
 
         // execute
-        firstRecord.treeNode.add(keys[2], values[2]);
-        pass[testNum] = firstRecord.treeNode.getLeftLocation()  != -1
-                     && firstRecord.treeNode.getRightLocation() != -1
-                     && mm->getNumLocations()                   == 4
-                     && !firstRecord.treeNode.isLeaf();
+        delete mm; // the transaction from the last test is still open
+        mm = new MemoryManager(dbFile);
+        root.treeNode.from(mm, location);
 
-        if (pass[testNum]) {
-            mm->readAt(firstRecord.treeNode.getRightLocation(), secondRecord);
-            pass[testNum] = secondRecord.treeNode.getKey()   == keys[2]
-                         && secondRecord.treeNode.getValue() == values[2]
-                         && secondRecord.treeNode.isLeaf();
-        }
+        pass[testNum] = root.treeNode.findByKey(mm, 1000) == -1
+                     && root.treeNode.findByKey(mm, 50)   == 500
+                     && root.treeNode.isBalanced(mm);
+
+        delete mm;
 
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
-
-    {   // We test all paths of the delete function
+    {   // We test the same concurrent commits under every durability mode
 
         // setup
-        message = "\tTest " + to_string(testNum + 1) + ": All paths of our del method, ending with the root node: ";
+        message = "\tTest " + to_string(testNum + 1) + ": Every durability mode keeps its promise, and reports what it cost: ";
         cout << highlightCyan(message) << endl;
-        pass[testNum] = false;
-        keys[3] = 40;
-        values[3] = 14;
-        keys[4] = 5;
-        values[4] = 16;
-        keys[5] = 15;
-        values[5] = 17;
+        const DurabilityMode modes[] = {DURABILITY_NONE, DURABILITY_ASYNC, DURABILITY_BATCHED, DURABILITY_COMMIT};
+        pass[testNum] = true;
 
         // execute
-        firstRecord.treeNode.add(keys[3], values[3]);
+        for (int m = 0; m < 4; m++) {
+            remove("LogTest.wal");
+            WriteAheadLog log("LogTest.wal", modes[m], 2);
+            Durability *durability = log.getDurability();
+            vector<thread> threads;
+            atomic<int> notDurable(0);
+            char image[64] = "block";
+
+            for (int t = 0; t < numThreads; t++) {
+                threads.push_back(thread([&log, &image, &notDurable, t]() {
+                    for (int i = 0; i < commitsPerThread; i++) {
+                        long txn = t * commitsPerThread + i + 1;
+                        log.append(txn, LOG_UPDATE, txn, image, sizeof(image));
+
+                        long lsn = log.commit(txn);
+
+                        if (log.getDurableLSN() < lsn) {
+                            notDurable++;
+                        }
+                    }
+                }));
+            }
 
+            for (size_t t = 0; t < threads.size(); t++) {
+                threads[t].join();
+            }
 
-        pass[testNum] = firstRecord.treeNode.getLeftLocation()  != -1
-                     && firstRecord.treeNode.getRightLocation() != -1
-                     && mm->getNumLocations()                   == 5
-                     && !firstRecord.treeNode.isLeaf();
+            if (modes[m] == DURABILITY_ASYNC) {
+                this_thread::sleep_for(chrono::milliseconds(50));   // a few rounds of the flusher
+            }
 
+            cout << "\t\t" << setw(8) << durability->getName() << ": " << durability->getSyncs() << " syncs, "
+                 << durability->getSyncMicros() << " us syncing, " << durability->getWaitMicros() << " us waiting, "
+                 << notDurable << " commits returned before they were durable" << endl;
+
+            pass[testNum] = pass[testNum] && durability->getCommits() == numThreads * commitsPerThread;
+
+            if (modes[m] == DURABILITY_NONE) {
+                pass[testNum] = pass[testNum] && durability->getSyncs() == 0 && log.getDurableLSN() == 0;
+            } else if (modes[m] == DURABILITY_ASYNC) {
+                pass[testNum] = pass[testNum]
+                             && durability->getWaitMicros() == 0
+                             && log.getDurableLSN() == 2 * numThreads * commitsPerThread;
+            } else {
+                pass[testNum] = pass[testNum]
+                             && notDurable == 0
+                             && durability->getSyncs() <= durability->getCommits();
+            }
+        }
 
-        if (pass[testNum]) {
-            cout << highlightYellow("\t\tCases: 7->3") << endl;
+        remove("LogTest.wal");
 
-            firstRecord.treeNode.del(keys[2]);
-            secondRecord.treeNode.from(firstRecord.treeNode.getRightLocation());
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
 
-            pass[testNum] = secondRecord.treeNode.getKey()   == keys[3]
-                         && secondRecord.treeNode.getValue() == values[3]
-                         && mm->getNumLocations()            == 5
-                         && secondRecord.treeNode.isLeaf();
+    {   // We test a crash under asynchronous commits while the pool is evicting pages
 
-            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": An async crash loses the last commits, never half of one: ";
+        cout << highlightCyan(message) << endl;
+        const int asyncKeys = 1500;
+        MemoryManager *async;
+        long found = 0;
+
+        remove((dbFile + ".async").c_str());
+        remove((dbFile + ".async.wal").c_str());
+        remove((dbFile + ".async.map").c_str());
+        async = new MemoryManager(dbFile + ".async", 8);
+        async->setDurability(DURABILITY_ASYNC, 1000);
+        async->FreeListInit();
+        location = async->getNextFreeLocation();
+        root.treeNode.init(async, location, true);
+        async->flush();
+
+        // execute
+        for (int i = 1; i <= asyncKeys; i++) {
+            async->begin();
+            root.treeNode.addBalanced(async, i, i * 10);
+            async->commit();
         }
 
-        firstRecord.treeNode.add(keys[4], values[4]);
-        firstRecord.treeNode.add(keys[5], values[5]);
+        copyFile(dbFile + ".async", crashFile);
+        copyFile(dbFile + ".async.wal", crashFile + ".wal");
+        pass[testNum] = async->getLog()->getDurability()->getName() == "async"
+                     && async->getLog()->getDurability()->getWaitMicros() == 0
+                     && async->getPool()->getEvictions() > 0;
+        delete async;
 
-        if (pass[testNum]) {
-            cout << highlightYellow("\t\tCases: 6->5") << endl;
+        mm = new MemoryManager(crashFile);
+        root.treeNode.from(mm, location);
 
-            // firstRecord.treeNode.from(firstRecord.treeNode.getLocation());
+        while (found < asyncKeys && root.treeNode.findByKey(mm, found + 1) == (found + 1) * 10) {
+            found++;
+        }
 
-            firstRecord.treeNode.del(keys[1]);
-            secondRecord.treeNode.from(firstRecord.treeNode.getLeftLocation());
+        for (int i = found + 1; i <= asyncKeys; i++) {
+            pass[testNum] = pass[testNum] && root.treeNode.findByKey(mm, i) == -1;
+        }
 
-            pass[testNum] = secondRecord.treeNode.getKey()   == keys[4]
-                         && secondRecord.treeNode.getValue() == values[4]
-                         && mm->getNumLocations()            == 6
-                         && !secondRecord.treeNode.isLeaf();
+        cout << "\t\t" << found << " of " << asyncKeys << " commits survived" << endl;
+        pass[testNum] = pass[testNum] && found > 0 && root.treeNode.isBalanced(mm);
 
-            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
-        }
+        delete mm;
+        remove((dbFile + ".async").c_str());
+        remove((dbFile + ".async.wal").c_str());
+        remove((dbFile + ".async.map").c_str());
 
-        if(pass[testNum]) {
-            cout << highlightYellow("\t\tCases: 6->7->2") << endl;
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
 
-            firstRecord.treeNode.del(keys[5]);
-            secondRecord.treeNode.from(firstRecord.treeNode.getLeftLocation());
+    {   // We test a transaction that changes more pages than the pool has frames
 
-            pass[testNum] = secondRecord.treeNode.getKey()   == keys[4]
-                         && secondRecord.treeNode.getValue() == values[4]
-                         && mm->getNumLocations()            == 6
-                         && secondRecord.treeNode.isLeaf();
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A transaction bigger than the pool is undone after a crash: ";
+        cout << highlightCyan(message) << endl;
+        const int bigKeys = 3000;
+        MemoryManager *small;
+        long evictions;
+
+        remove((dbFile + ".steal").c_str());
+        remove((dbFile + ".steal.wal").c_str());
+        remove((dbFile + ".steal.map").c_str());
+        small = new MemoryManager(dbFile + ".steal", 8);
+        small->FreeListInit();
+        location = small->getNextFreeLocation();
+        root.treeNode.init(small, location, true);
+
+        small->begin();
+        for (int i = 1; i <= 50; i++) {
+            root.treeNode.addBalanced(small, -i, i);
+        }
+        small->commit();
+        evictions = small->getPool()->getEvictions();
 
-            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        // execute
+        small->begin();
+        for (int i = 1; i <= bigKeys; i++) {
+            root.treeNode.addBalanced(small, i, i * 10);
         }
 
-        if(pass[testNum]) {
-            cout << highlightYellow("\t\tCases: 7->2") << endl;
+        // the pages it wrote back so far, and the log that lets them be undone
+        copyFile(dbFile + ".steal", crashFile);
+        copyFile(dbFile + ".steal.wal", crashFile + ".wal");
+        small->commit();
 
-            firstRecord.treeNode.del(keys[3]);
-            secondRecord.treeNode.from(firstRecord.treeNode.getLeftLocation());
+        pass[testNum] = small->getPool()->getEvictions() - evictions > 8;
+        cout << "\t\t" << small->getPool()->getEvictions() - evictions << " pages evicted in one transaction" << endl;
+        delete small;
 
-            pass[testNum] = firstRecord.treeNode.getRightLocation() == -1 
-                         && secondRecord.treeNode.getKey()          == keys[4]
-                         && secondRecord.treeNode.getValue()        == values[4]
-                         && mm->getNumLocations()                   == 6
-                         && secondRecord.treeNode.isLeaf();
-            
-            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        mm = new MemoryManager(crashFile);
+        root.treeNode.from(mm, location);
+
+        for (int i = 1; i <= 50; i++) {
+            pass[testNum] = pass[testNum] && root.treeNode.findByKey(mm, -i) == i;
         }
 
-        if(pass[testNum]) {
-            cout << highlightYellow("\t\tCase: 4") << endl;
+        for (int i = 1; i <= bigKeys; i += 7) {
+            pass[testNum] = pass[testNum] && root.treeNode.findByKey(mm, i) == -1;
+        }
 
-            firstRecord.treeNode.del(keys[0]);
+        pass[testNum] = pass[testNum] && root.treeNode.isBalanced(mm);
+        delete mm;
 
-            pass[testNum] = firstRecord.treeNode.getKey()           == keys[4]
-                         && firstRecord.treeNode.getValue()         == values[4]
-                         && firstRecord.treeNode.getLeftLocation()  == -1
-                         && firstRecord.treeNode.getRightLocation() == -1
-                         && mm->getNumLocations()                   == 6
-                         && firstRecord.treeNode.isLeaf();
+        mm = new MemoryManager(dbFile + ".steal");
+        root.treeNode.from(mm, location);
 
-            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        for (int i = 1; i <= bigKeys; i += 7) {
+            pass[testNum] = pass[testNum] && root.treeNode.findByKey(mm, i) == i * 10;
         }
 
-        if (pass[testNum]) {
-            cout << highlightYellow("\t\tCase: 1") << endl;
+        pass[testNum] = pass[testNum] && root.treeNode.isBalanced(mm);
+        delete mm;
+        remove((dbFile + ".steal").c_str());
+        remove((dbFile + ".steal.wal").c_str());
+        remove((dbFile + ".steal.map").c_str());
+
+        // cleanup
+        cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
+        testNum++;
+    }
 
-            firstRecord.treeNode.del(keys[4]);
+    {   // We test that a log which cannot be written keeps the records it could not write
 
-            firstRecord.treeNode.from(firstRecord.treeNode.getLocation());
+        // setup
+        message = "\tTest " + to_string(testNum + 1) + ": A failed flush keeps its records and fails again: ";
+        cout << highlightCyan(message) << endl;
+        WriteAheadLog *log = new WriteAheadLog("/dev/full");  // every write fails, the disk is full
+        char image[8] = "block";
+        int failures = 0;
 
-            pass[testNum] = firstRecord.treeNode.getKey()           == -1
-                         && firstRecord.treeNode.getValue()         == -1
-                         && firstRecord.treeNode.getLeftLocation()  == -1
-                         && firstRecord.treeNode.getRightLocation() == -1
-                         && mm->getNumLocations()                   == 6
-                         && firstRecord.treeNode.isLeaf();
+        // execute
+        log->append(1, LOG_UPDATE, 10, image, sizeof(image));
 
-            cout << "\t\t\t" << (pass[testNum]? highlightGreen("Cases Passed"): highlightRed("Cases Failed")) << endl;
+        for (int i = 0; i < 2; i++) {
+            try {
+                log->flush();
+            } catch (DBException &e) {
+                failures++;
+            }
         }
 
+        pass[testNum] = failures == 2 && log->getDurableLSN() == 0 && log->getSyncs() == 0;
+        delete log;
+
         // cleanup
         cout << "\t\t" << (pass[testNum]? highlightGreen("Passed"): highlightRed("Failed")) << endl;
         testNum++;
     }
 
-
     for(int i = 0; i < tests; i++) {
         allPass = allPass && pass[i];
     }
 
     cout << "\t" << (allPass? highlightGreen("All Tests Passed"): highlightRed("Some Tests Failed")) << endl;
-    cout << (allPass? highlightGreen("TreeNode Test Passed"): highlightRed("TreeNode Test Failed")) << endl << endl;
+    cout << (allPass? highlightGreen("WriteAheadLog Test Passed"): highlightRed("WriteAheadLog Test Failed")) << endl << endl;
 
     return allPass;
 }
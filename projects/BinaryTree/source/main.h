@@ -15,21 +15,48 @@
 
 #include <iostream>
 #include <iomanip>
+#include <climits>
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cstring>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <functional>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ExtendibleHash.h"
+#include "BlockStorage.h"
+#include "BloomFilter.h"
 
 using namespace std;
 
 int basicTest();
 
+const int PAGE_SIZE = 4096;     // bytes the buffer pool moves to and from disk at a time
+const int POOL_FRAMES = 64;     // default number of pages the buffer pool keeps in memory
+const long WAL_CHECKPOINT_BYTES = 16L << 20;    // a commit that leaves the log bigger than this checkpoints
+
 enum RecordType {
     FREE, 
     OCCUPIED,
     INVALID
 };
 
+class MemoryManager;
+
 class DBException {
     private:
         string errorMessage;
@@ -42,7 +69,7 @@ class FreeListNode {
     public:
         RecordType type;
         long location;
-        void init(long memLocation, long nextLocation);
+        void init(MemoryManager *mm, long memLocation, long nextLocation);
         long getLocation();
     private:
         long nextLocation;
@@ -51,13 +78,14 @@ class FreeListNode {
         long getNextLocation();
         // void setLocation(int newLocation);
 
-        void push(int newLocation);
-        int pop();
+        void push(MemoryManager *mm, int newLocation);
+        int pop(MemoryManager *mm);
         bool isEmpty();
 
         friend ostream & operator << (ostream& out, const FreeListNode& node);
 };
 
+// A node is nothing but its block, every operation is given the MemoryManager that holds it
 class TreeNode {
     public: // Both the tree and free list need to have theese properties at the top of their memory block
 
@@ -67,14 +95,15 @@ class TreeNode {
 
         // constructors
         // void init(long memLocation);
-        void init(long memLocation, bool root);
-        void init(long key, long value, long memLocation, long left, long right);
-        void from(long memLocation);
+        void init(MemoryManager *mm, long memLocation, bool root);
+        void init(MemoryManager *mm, long key, long value, long memLocation, long left, long right);
+        void from(MemoryManager *mm, long memLocation);
 
     private:
 
         // properties
         bool root;
+        char height;    // AVL height of this subtree, only maintained by addBalanced and delBalanced
         // bool leaf;
         long leftLocation;
         long rightLocation;
@@ -85,7 +114,15 @@ class TreeNode {
         void copy(TreeNode &node);
 
         // manipulation
-        void addNode(TreeNode &node); // used internally by del
+        bool addNode(MemoryManager *mm, TreeNode &node); // used internally by del
+
+        // balancing
+        int heightAt(MemoryManager *mm, long location);
+        int checkSubtree(MemoryManager *mm, long location, long low, long high);
+        void updateHeight(MemoryManager *mm);
+        void rotateLeft(MemoryManager *mm);
+        void rotateRight(MemoryManager *mm);
+        void rebalance(MemoryManager *mm);
 
     public:
 
@@ -98,19 +135,25 @@ class TreeNode {
         long getLocation();
         long getLeftLocation();
         long getRightLocation();
+        int getHeight();
+        bool isBalanced(MemoryManager *mm);
 
         // setters
         void setRoot(bool isRoot);
 
         // manipulation
-        void save();
-        void add(long key, long value);
-        bool del(long key);
-        long findByKey(long key);
+        void save(MemoryManager *mm);
+        void add(MemoryManager *mm, long key, long value);
+        bool del(MemoryManager *mm, long key);
+        long findByKey(MemoryManager *mm, long key);
+
+        // balanced variants, a tree should only ever be modified through one of add/del or these
+        void addBalanced(MemoryManager *mm, long key, long value);
+        bool delBalanced(MemoryManager *mm, long key);
 
         // destructors
-        void freeNode();
-        void invalidate();
+        void freeNode(MemoryManager *mm);
+        void invalidate(MemoryManager *mm);
         void destroy();
         // ~TreeNode();
 
@@ -124,39 +167,854 @@ union IndexRecord {
     TreeNode treeNode;
 };
 
+static_assert(sizeof(IndexRecord) == 56, "an IndexRecord is one block of an existing file, 56 bytes");
+
+const int READ_AHEAD = 4;   // how many upcoming blocks or pages a cursor asks the buffer pool for
+
+/**
+ * Walks a TreeNode tree in key order with an explicit stack instead of recursion.
+ * 
+ * The top of the stack is the current node, the rest are the ancestors 
+ *      whose keys come after it. Their right subtrees are what the cursor
+ *      visits next, so those blocks are prefetched.
+ */
+class TreeCursor {
+    private:
+        MemoryManager *mm;
+        long rootLocation;
+        vector<TreeNode> stack;
+        void pushLeft(long location);
+        void readAhead();
+
+    public:
+        TreeCursor(MemoryManager *mm, long rootLocation);
+
+        // getters
+        bool isValid();
+        long getKey();
+        long getValue();
+
+        // manipulation
+        void seek(long lowKey);
+        void next();
+};
+
+const int IO_DEPTH = 32;    // reads and writes an AsyncIO keeps in flight at once
+const int IO_THREADS = 4;   // workers behind a ThreadPoolIO
+
+enum IOBackend {
+    IO_AUTO,    // io_uring when the kernel allows it, otherwise the thread pool
+    IO_URING,
+    IO_THREAD_POOL
+};
+
+/**
+ * One read or write handed to an AsyncIO. It has to stay where it is 
+ *      until it is reaped.
+ */
+struct IORequest {
+    bool write;
+    char *buffer;
+    long bytes;
+    long offset;
+    long result;    // bytes moved, or -errno
+    bool done;
+};
+
+/**
+ * Asynchronous positioned reads and writes on one file descriptor.
+ * 
+ * submit() starts a request without waiting for it, reap() collects the 
+ *      ones that have finished, marking them done. At most getDepth()
+ *      requests are in flight, submitting another first waits for one
+ *      to finish. Only one thread may use an AsyncIO at a time.
+ */
+class AsyncIO {
+    protected:
+        int fd;
+        int depth;
+        int inFlight;
+        int maxInFlight;
+        long submitted;
+
+        void started();
+
+    public:
+        AsyncIO(int fd, int depth);
+        virtual ~AsyncIO();
+
+        // getters
+        virtual string getName() = 0;
+        int getDepth();
+        int getMaxInFlight();
+        long getSubmitted();
+
+        // manipulation
+        virtual void submit(IORequest *request) = 0;
+        virtual int reap(bool wait) = 0;
+        void run(vector<IORequest> &requests);
+
+        static AsyncIO *open(int fd, IOBackend backend = IO_AUTO, int depth = IO_DEPTH);
+};
+
+/**
+ * AsyncIO on an io_uring, set up with the raw system calls. Requests 
+ *      queue in the submission ring and reach the kernel together on
+ *      the next reap.
+ */
+class UringIO : public AsyncIO {
+    private:
+        int ringFd;
+        unsigned pending;   // queued in the submission ring, not yet handed to the kernel
+        void *sqRing;
+        void *cqRing;
+        size_t sqRingSize;
+        size_t cqRingSize;
+        io_uring_sqe *sqes;
+        size_t sqesSize;
+        unsigned *sqTail;
+        unsigned *sqMask;
+        unsigned *sqArray;
+        unsigned *cqHead;
+        unsigned *cqTail;
+        unsigned *cqMask;
+        io_uring_cqe *cqes;
+
+    public:
+        UringIO(int fd, int depth);
+        ~UringIO();
+
+        string getName();
+        void submit(IORequest *request);
+        int reap(bool wait);
+};
+
+/**
+ * AsyncIO for kernels without io_uring, worker threads run pread and pwrite
+ */
+class ThreadPoolIO : public AsyncIO {
+    private:
+        vector<thread> workers;
+        mutex latch;
+        condition_variable queued;
+        condition_variable finished;
+        deque<IORequest*> queue;
+        vector<IORequest*> completed;
+        bool stopping;
+
+        void work();
+
+    public:
+        ThreadPoolIO(int fd, int depth, int threads = IO_THREADS);
+        ~ThreadPoolIO();
+
+        string getName();
+        void submit(IORequest *request);
+        int reap(bool wait);
+};
+
+/**
+ * A fixed number of page frames sitting in front of a file.
+ * 
+ * Pages are pinned while in use and unpinned when the caller is done,
+ *      dirty pages only reach the file when they are evicted or flushed.
+ *      Victims are picked with the CLOCK algorithm.
+ * 
+ * Every method may be called from any thread. The pool only guards which 
+ *      page sits in which frame, callers sharing a page latch it themselves.
+ * 
+ * The file is read and written through an AsyncIO. A batch prefetch and 
+ *      flushAll put all of their pages in flight at once instead of 
+ *      moving them one at a time. A miss reads its page with pread after
+ *      letting go of the latch, so hits and other misses do not wait on it.
+ */
+class BufferPool {
+    private:
+        struct Frame {
+            long pageId;
+            int pinCount;
+            bool dirty;
+            bool referenced;
+            bool loading;   // reserved by a miss whose read has not finished, pinned by it
+            char *data;
+        };
+
+        int fd;
+        AsyncIO *io;
+        int pageSize;
+        int numFrames;
+        int clockHand;
+        long fileSize; // logical size of the file, pages are never written past it
+        Frame *frames;
+        unordered_map<long, int> pageTable;
+        mutex latch;    // guards the frame table and counters, not the bytes of a pinned page
+        condition_variable loaded;  // a frame stopped loading
+
+        long hits;
+        long misses;
+        long evictions;
+        long pageWrites;
+        long prefetches;
+        function<void()> beforeWriteBack;   // see setWriteBackHook
+
+        int findVictim();
+        int reserve(long pageId);
+        void readPage(Frame &frame);
+        void writePage(Frame &frame);
+        IORequest writeRequest(Frame &frame);
+        void writeBack(vector<int> &dirty);
+
+    public:
+        BufferPool(string fileName, int pageSize, int numFrames, IOBackend backend = IO_AUTO);
+        ~BufferPool();
+
+        // getters
+        int getPageSize();
+        int getNumFrames();
+        long getFileSize();
+        long getHits();
+        long getMisses();
+        long getEvictions();
+        long getPageWrites();
+        long getPrefetches();
+        AsyncIO *getIO();
+        bool isCached(long pageId);
+
+        // setters
+        void extend(long newSize);
+        void setWriteBackHook(function<void()> hook);
+
+        // manipulation
+        char *pin(long pageId);
+        void unpin(long pageId, bool dirty);
+        void discard(long pageId);
+        void prefetch(long pageId);
+        void prefetch(vector<long> &pageIds);
+        void flush(long pageId);
+        void flushAll();
+
+        bool test();
+};
+
+const long ALLOCATOR_MAGIC = 0x434F4C4C414B4C42;    // "BLKALLOC", marks a file as a free space map
+
+/**
+ * First bytes of a free space map file, the bitmap words follow it
+ */
+struct AllocatorHeader {
+    long magic;
+    long numBlocks;
+    long freeBlocks;
+    int clean;  // 0 while a MemoryManager has the map open
+};
+
+/**
+ * Free space map for the blocks of a MemoryManager file.
+ * 
+ * One bit per block, set while the block is free. Blocks past the end of 
+ *      the map are in use, and blocks past the end of the file are free
+ *      without being in it. The whole map lives in memory and only goes
+ *      back to its file on close. A map that was not closed cleanly is 
+ *      thrown away on open, leaking its free blocks rather than risking
+ *      handing out a block that is still in use.
+ */
+class BlockAllocator {
+    private:
+        string fileName;
+        vector<unsigned long> words;
+        long numBlocks;     // blocks the map covers
+        long freeBlocks;
+
+        bool load(long fileBlocks);
+        void writeHeader(bool clean);
+        void setRun(long location, long count, bool free);
+        long findRun(long count, long from, long to);
+
+    public:
+        BlockAllocator(string fileName, long fileBlocks);
+
+        // getters
+        long getNumBlocks();
+        long getFreeBlocks();
+        bool isFree(long location);
+
+        // manipulation
+        long allocate(long count, long hint, long endOfFile);
+        void release(long location, long count);
+        void close();
+};
+
+enum LogRecordType {
+    LOG_UPDATE,     // redo image of one block
+    LOG_COMMIT,
+    LOG_UNDO        // image of a block before its transaction first changed it
+};
+
+struct LogRecord {
+    long lsn;
+    long txn;
+    LogRecordType type;
+    int length;     // bytes of block image following the record
+    long location;
+    unsigned long checksum;
+};
+
+/**
+ * Redo and undo log for the blocks of one file, with group commit.
+ * 
+ * Records are appended to an in-memory buffer. A commit waits until its 
+ *      commit record is durable, whichever waiting thread gets there first
+ *      writes the whole buffer and syncs it once for everybody queued 
+ *      behind it.
+ * 
+ * That is DURABILITY_COMMIT, the default. In the other modes of 
+ *      BlockStorage.h a commit waits for a background sync or not at all,
+ *      and a crash can lose the last commits but never half of one.
+ */
+class WriteAheadLog {
+    private:
+        string fileName;
+        int fd;
+        mutex latch;
+        condition_variable flushed;
+        vector<char> buffer;    // appended records that have not been written yet
+        long nextLSN;
+        long durableLSN;
+        long logSize;
+        bool flushing;
+        long syncs;
+        long commits;
+        Durability *durability;
+
+        static unsigned long checksum(LogRecord &record, const char *data);
+
+    public:
+        WriteAheadLog(string fileName, DurabilityMode mode = DURABILITY_COMMIT, int intervalMs = DURABILITY_INTERVAL);
+        ~WriteAheadLog();
+
+        // getters
+        long getDurableLSN();
+        long getSize();
+        long getSyncs();
+        long getCommits();
+        Durability *getDurability();
+
+        // manipulation
+        long append(long txn, LogRecordType type, long location, const char *data, int length);
+        long commit(long txn);
+        void flushTo(long lsn);
+        void flush();
+        long recover(function<void(long location, const char *data, int length)> apply);
+        void truncate();
+};
+
+/**
+ * Fixed size blocks of one file, read and written by location.
+ * 
+ * The blocks sit on a BlockStorage. On STORAGE_PREAD with frames to spare
+ *      they are copied in and out of a buffer pool, which does its own 
+ *      positional I/O on the file and is the only way to run transactions.
+ *      Every other storage is read and written directly.
+ * 
+ * On STORAGE_MAPPED and STORAGE_MEMORY the blocks lie in address space 
+ *      reserved up front, so a pointer from nodeAt stays good for the life
+ *      of the manager and a warm lookup is pointer chasing with no system
+ *      calls. STORAGE_MEMORY keeps nothing, which is what lets a benchmark
+ *      see the cost of the tree apart from the disk under it. The free 
+ *      space map is a file on every storage.
+ */
 class MemoryManager {
     private:
         int blockSize;
+        int blocksPerPage;
         string fileName;
-        fstream *file;
+        StorageKind kind;
+        BlockStorage *storage;
+        BufferPool *pool;   // NULL unless pooled
+        BlockAllocator *allocator;
+        WriteAheadLog *wal;
+        long currentTxn;
+        long nextTxn;
+        long blockWrites;   // blocks written since the manager was created, see getBlockWrites
+        DurabilityMode durabilityMode;  // how its log makes commits durable
+        int durabilityInterval;
+        set<long> txnPages; // pages the open transaction changed
+        set<long> txnBlocks;    // blocks whose image before the open transaction is logged
         void checkFile();
+        void readBlock(long location, char *dest, int bytes);
+        void writeBlock(long location, const char *src, int bytes);
+        void syncFile();
         IndexRecord FreeListHead;
         bool hasFreeListHead;
         bool hasTreeRoot;
 
         
     public:
-        MemoryManager(string fileName);
+        MemoryManager(string fileName, int poolFrames = POOL_FRAMES, StorageKind kind = STORAGE_PREAD);
         ~MemoryManager();
         void FreeListInit();
         int getBlockSize();
+        long getBlockWrites();
+        bool isMapped();
+        BlockStorage *getStorage();
+        BufferPool *getPool();
+        BlockAllocator *getAllocator();
+        WriteAheadLog *getLog();
+        void prefetch(long location);
+        void prefetch(vector<long> &locations);
+        void flush();
+        void setDurability(DurabilityMode mode, int intervalMs = DURABILITY_INTERVAL);
+
+        // transactions
+        void begin();
+        void commit();
+        void checkpoint();
+        bool inTransaction();
+
         void readAt(int location, IndexRecord &record);
         void readAt(int location, FreeListNode &record);
         void readAt(int location, TreeNode &record);
         void writeAt(int location, IndexRecord record);
         void writeAt(int location, FreeListNode record);
         void writeAt(int location, TreeNode record);
+        TreeNode *nodeAt(long location);
         int getSize();
         int getNumLocations();
-        void freeLocation(long location);
-        long getNextFreeLocation();
+        void freeLocation(long location, long count = 1);
+        long getNextFreeLocation(long hint = -1);
+        long getFreeExtent(long count, long hint = -1);
 
         bool test();
         
 };
 
-class IntIndex {
+const int BTREE_MAX_KEYS = (PAGE_SIZE - 56) / 16;   // keys per B+tree page, 252 with 4 KiB pages
+const int BTREE_MIN_KEYS = BTREE_MAX_KEYS / 2;      // a non-root page never holds fewer than this
+const long INDEX_MAGIC = 0x4249445842545245;        // "ERTBXDIB", marks a file as an IntIndex
+const long INDEX_FILTER_MAGIC = 0x4D4C4F4F4C425245; // "ERBLOOLM", starts the <index>.bloom file of an IntIndex
+
+class IndexCursor;
+
+/**
+ * One page of the B+tree. 
+ * 
+ * Leaves keep values in children[i] next to keys[i] and are chained
+ *      through next/prev. Internal pages keep numKeys + 1 child pages.
+ *      Each array has one slot of slack so a page can overflow by one
+ *      key before it is split.
+ */
+struct IndexPage {
+    RecordType type;
+    bool leaf;
+    int numKeys;
+    long next;  // right sibling for leaves, next free page for FREE pages
+    long prev;  // left sibling for leaves
+    long keys[BTREE_MAX_KEYS + 1];
+    long children[BTREE_MAX_KEYS + 2];
+};
+
+static_assert(sizeof(IndexPage) <= PAGE_SIZE, "an IndexPage must fit in one page");
+
+/**
+ * Page 0 of an index file
+ */
+struct IndexMeta {
+    long magic;
+    long rootPage;
+    long freePage;  // head of the free page list, -1 when empty
+    long numPages;
+    long numKeys;
+    int height;
+};
+
+/**
+ * Reader-writer latches for the pages of an IntIndex, made the first time 
+ *      a page is latched. The table is split into shards so threads 
+ *      latching different pages rarely wait on the same shard.
+ */
+class LatchTable {
+    private:
+        static const int SHARDS = 64;
+
+        struct Shard {
+            mutex lock;
+            unordered_map<long, unique_ptr<shared_mutex>> latches;
+        };
+
+        Shard shards[SHARDS];
+
+    public:
+        shared_mutex &get(long page);
+};
+
+enum IndexEngine {
+    ENGINE_BTREE,   // IntIndex, updated in place
+    ENGINE_LSM      // LsmIndex, log structured
+};
+
+/**
+ * What every engine behind a key to record location index offers, so an
+ *      index can be switched from one engine to another by how it is opened.
+ *      Each engine also has a seek for range scans, with a cursor of its own.
+ */
+class KeyIndex {
+    public:
+        virtual ~KeyIndex();
+
+        // getters
+        virtual string getEngine() = 0;
+        virtual long size() = 0;
+
+        // manipulation
+        virtual void add(long key, long value) = 0;
+        virtual void addBatch(vector<pair<long, long>> &entries) = 0;
+        virtual bool del(long key) = 0;
+        virtual long findByKey(long key) = 0;
+        virtual void flush() = 0;
+
+        virtual bool check() = 0;
+
+        static KeyIndex *open(IndexEngine engine, string fileName);
+};
+
+/**
+ * A B+tree from long keys to long values (record locations) stored 
+ *      in its own file of PAGE_SIZE pages behind a buffer pool
+ * 
+ * Single key operations and cursors may run on many threads at once. 
+ *      They latch pages on the way down with latch crabbing: a reader
+ *      lets go of a page once it holds the child, a writer lets go of
+ *      every page above a child that cannot split or underflow. Bulk
+ *      loads, batches, flush and check take the whole tree.
+ * 
+ * A Bloom filter of the keys turns most finds of absent keys away before
+ *      the root is read. flush writes it to <index>.bloom, and the first
+ *      add after that removes the file again, so a filter on disk never 
+ *      misses a key the tree has. Without one the filter is rebuilt from
+ *      the leaves when the index is opened.
+ */
+class IntIndex : public KeyIndex {
+    friend class IndexCursor;
+
+    private:
+        string fileName;
+        BufferPool *pool;   // opens, creates and does all the I/O of the file
+        IndexMeta meta;
+        atomic<long> pageReads;
+        atomic<long> pageWrites;
+        shared_mutex treeLatch; // shared by single key operations, exclusive for whole tree ones
+        shared_mutex rootLatch; // guards meta.rootPage and meta.height
+        mutex metaLatch;        // guards the rest of meta
+        LatchTable latches;
+        long pendingPage;   // a leaf whose prev link a batch split changed, see addBatch
+        long pendingPrev;
+        BloomFilter filter;     // replaced only with the whole tree held
+        atomic<bool> filterSaved;
+        mutex filterLatch;      // guards removing the saved filter
+        atomic<long> filterSkips;
+
+        // page management
+        void readPage(long page, IndexPage &node);
+        void writePage(long page, IndexPage &node);
+        void saveMeta();
+        long allocatePage();
+        void freePage(long page);
+        void countKeys(long delta);
+
+        // filter
+        string filterName();
+        bool loadFilter();
+        void saveFilter();
+        void rebuildFilter(long expectedKeys);
+        void filterChanged();
+        bool filterFull();
+
+        // latching
+        long latchLeaf(long key, IndexPage &node);
+        void latchPath(long key, bool inserting, vector<long> &held, unique_lock<shared_mutex> &root);
+        void unlatchPath(vector<long> &held);
+
+        // manipulation
+        bool insertInto(long page, long key, long value, long &upKey, long &upPage);
+        bool removeFrom(long page, long key);
+        void fixUnderflow(IndexPage &parent, int childIndex);
+        bool checkPage(long page, int depth, long low, long high, long &leaves);
+        static long numPagesFor(long entries, int fill, int minEntries);
+        static void sortEntries(vector<pair<long, long>> &entries);
+
+        // batches
+        void insertBatch(long page, vector<pair<long, long>> &entries, size_t begin, size_t end, vector<pair<long, long>> &promoted);
+        void writeLeaf(long page, IndexPage &node, vector<long> &keys, vector<long> &values, vector<pair<long, long>> &promoted);
+        void writeInternal(long page, IndexPage &node, vector<long> &keys, vector<long> &children, vector<pair<long, long>> &promoted);
+        void flushPendingPrev();
+
+    public:
+        IntIndex(string fileName, int poolFrames = POOL_FRAMES);
+        ~IntIndex();
+
+        // getters
+        string getEngine();
+        long size();
+        int getHeight();
+        long getNumPages();
+        long getPageReads();
+        long getPageWrites();
+        long getFilterSkips();
+        long getFilterBytes();
+        BufferPool *getPool();
+
+        // manipulation
+        void add(long key, long value);
+        void addBatch(vector<pair<long, long>> &entries);
+        bool del(long key);
+        long findByKey(long key);
+        IndexCursor seek(long lowKey);
+        void flush();
+
+        // loading
+        void bulkLoad(vector<pair<long, long>> &entries, int fill = BTREE_MAX_KEYS);
+
+        bool check();
+};
+
+/**
+ * Exact match index from a key to a record location, one bucket page read per lookup
+ */
+typedef ExtendibleHash<long> HashIndex;
+
+/**
+ * Walks the leaves of an IntIndex in key order through their sibling links,
+ *      prefetching the pages ahead of the one it is on
+ * 
+ * The cursor works on a copy of its leaf and only latches a page while 
+ *      copying it, so it sees other threads' changes a page at a time. If 
+ *      the next leaf was split or merged away in the meantime it finds 
+ *      its place again from the root.
+ */
+class IndexCursor {
+    private:
+        IntIndex *index;
+        IndexPage page;
+        long pageId;
+        int position;
+        long low;   // smallest key the cursor can still return
+        void skipEmpty();
+        void readAhead();
+        void reseek();
+
+    public:
+        IndexCursor(IntIndex *index, long lowKey);
+
+        // getters
+        bool isValid();
+        long getKey();
+        long getValue();
+
+        // manipulation
+        void next();
+};
+
+const int LSM_MEMTABLE_ENTRIES = 1 << 16;   // keys an LsmIndex buffers in memory before writing a run
+const int LSM_L0_RUNS = 4;      // runs level 0 holds before they are compacted into level 1
+const int LSM_L0_STALL = 12;    // runs level 0 holds before writers wait for compaction
+const int LSM_FANOUT = 10;      // each level below 0 holds this many times the one above
+const long LSM_TOMBSTONE = LONG_MIN;    // the value of a deleted key, it cannot be stored
+const long LSM_MAGIC = 0x424E524D534C5245;  // "ERLSMRNB", ends every run file
+const long LSM_MANIFEST_MAGIC = 0x5453494E414D5245; // "ERMANIST", starts the manifest of an LsmIndex
+const int LSM_WRITE_PAGES = 16; // pages a run writer hands to the file at a time
+
+struct LsmEntry {
+    long key;
+    long value;
+};
+
+const int LSM_PAGE_ENTRIES = PAGE_SIZE / sizeof(LsmEntry);
+
+/**
+ * An immutable sorted run of an LsmIndex, in a file of its own
+ * 
+ * The entries are written in key order in PAGE_SIZE pages, followed by 
+ *      the first key of every page, a Bloom filter of the keys and a 
+ *      trailer. The first keys and the filter are kept in memory, so 
+ *      finding a key reads one page, and none for most absent keys.
+ */
+class LsmRun {
+    private:
+        string fileName;
+        long id;
+        BlockStorage *storage;
+        long count;
+        long minKey;
+        long maxKey;
+        vector<long> fences;    // first key of every page
+        BloomFilter filter;
+
+    public:
+        LsmRun(string fileName, long id);
+        ~LsmRun();
+
+        // getters
+        string getFileName();
+        long getId();
+        long getCount();
+        long getNumPages();
+        long getMinKey();
+        long getMaxKey();
+        long getBytes();
+
+        // manipulation
+        bool mayContain(long key);
+        bool find(long key, long &value);
+        long pageFor(long key);
+        void readPage(long page, vector<LsmEntry> &entries);
+
+        bool check();
+};
+
+/**
+ * Writes a new run one page at a time, in one sequential pass
+ */
+class LsmRunWriter {
+    private:
+        string fileName;
+        BlockStorage *storage;
+        vector<LsmEntry> pending;   // up to LSM_WRITE_PAGES pages not written yet
+        vector<long> fences;
+        BloomFilter filter;
+        long count;
+        long offset;
+        long minKey;
+        long maxKey;
+        void writePending();
+
+    public:
+        LsmRunWriter(string fileName, long expectedKeys);
+        ~LsmRunWriter();
+
+        // getters
+        long getCount();
+
+        // manipulation
+        void add(long key, long value);
+        long finish();
+};
+
+/**
+ * Walks several sorted sources at once in key order. Sources are ranked, 
+ *      the first one holding a key is the one whose value is returned.
+ */
+class LsmMerge {
+    private:
+        struct Source {
+            shared_ptr<LsmRun> run;     // NULL for entries held in memory
+            vector<LsmEntry> entries;
+            size_t position;
+            long nextPage;
+        };
+
+        vector<Source> sources;
+        bool fill(Source &source);
+
+    public:
+        // manipulation
+        void addRun(shared_ptr<LsmRun> run, long lowKey);
+        void addEntries(vector<LsmEntry> &entries);
+        bool next(LsmEntry &entry);
+};
+
+/**
+ * A range scan of an LsmIndex, over a snapshot of it taken by seek
+ */
+class LsmCursor {
+    private:
+        shared_ptr<LsmMerge> merge;
+        LsmEntry entry;
+        bool valid;
+
+    public:
+        LsmCursor(shared_ptr<LsmMerge> merge);
+
+        // getters
+        bool isValid();
+        long getKey();
+        long getValue();
+
+        // manipulation
+        void next();
+};
+
+/**
+ * A log structured index from long keys to long values, for write heavy loads
+ * 
+ * Changes go to a sorted memtable. A full memtable is written out in one 
+ *      sequential pass as a sorted run in level 0, and a background thread
+ *      compacts: once level 0 holds LSM_L0_RUNS runs they are merged into
+ *      level 1, and any level past its capacity is merged into the next.
+ *      Every level below 0 is one run. A deleted key is a tombstone until 
+ *      a merge into the last level drops it.
+ * 
+ * A lookup tries the memtable, then runs from newest to oldest, and each
+ *      run costs at most one page read, none when the run's filter rules
+ *      the key out. The file itself is the manifest,
+ *      the list of runs by level, replaced whole when a run comes or goes.
+ *      Like IntIndex's pool, the memtable is durable once flush returns or
+ *      the index is closed. size is a full scan, knowing whether a key is
+ *      new would cost every add a lookup.
+ */
+class LsmIndex : public KeyIndex {
+    private:
+        string fileName;
+        int memtableEntries;
+        mutex latch;                    // guards everything below but the counters
+        condition_variable changed;     // a flush or compaction finished, or there is work for one
+        map<long, long> memtable;
+        shared_ptr<map<long, long>> frozen;     // a full memtable while it is written out
+        vector<vector<shared_ptr<LsmRun>>> levels;  // level 0 newest first, one run in each other level
+        long nextRun;
+        bool compacting;
+        bool stopping;
+        bool compactorRunning;          // false once the compactor gave up on an error
+        thread compactor;
+
+        atomic<long> runsWritten;
+        atomic<long> bytesWritten;
+        atomic<long> compactions;
+        atomic<long> runReads;
+
+        string runName(long id);
+        bool findInMemory(long key, long &value);
+        vector<shared_ptr<LsmRun>> allRuns();
+        void loadManifest();
+        void saveManifest();
+        void flushMemtable(unique_lock<mutex> &lock);
+        bool pickCompaction(vector<shared_ptr<LsmRun>> &inputs, int &outputLevel);
+        void compact();
+        void snapshot(long lowKey, LsmMerge &merge);
+
+    public:
+        LsmIndex(string fileName, int memtableEntries = LSM_MEMTABLE_ENTRIES);
+        ~LsmIndex();
+
+        // getters
+        string getEngine();
+        long size();
+        int getNumLevels();
+        int getNumRuns(int level);
+        long getRunsWritten();
+        long getBytesWritten();
+        long getCompactions();
+        long getRunReads();
+
+        // manipulation
+        void add(long key, long value);
+        void addBatch(vector<pair<long, long>> &entries);
+        bool del(long key);
+        long findByKey(long key);
+        LsmCursor seek(long lowKey);
+        void flush();
+        void waitForCompaction();
 
+        bool check();
 };
 
 